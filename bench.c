@@ -0,0 +1,444 @@
+#include "lib.h"
+
+#define BENCH_FRAMES_DEFAULT 1000000
+#define BENCH_PRODUCERS_DEFAULT 4
+#define BENCH_QUEUE_SIZE 10000
+#define BENCH_BATCH_SIZE 256
+
+void print_usage_canbench(char *arg0, char *arg1)
+{
+	char prg[_MAX_FNAME];
+	char *cmd;
+
+	basename(arg0, prg, sizeof(prg));
+	cmd = arg1;
+
+	fprintf(stderr, "%s %s - micro benchmarks without CAN devices.\n\n", prg, cmd);
+	fprintf(stderr, "Usage: %s %s [options] <target>\n", prg, cmd);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -n <count>                     (frames per producer or iterations - default 1000000)\n");
+	fprintf(stderr, "  -p <num>                       (number of producer threads - default 4)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Targets:\n");
+	fprintf(stderr, "  queue                          (global log_queue vs per-channel spsc_ring)\n");
+	fprintf(stderr, "  format                         (snprintf based vs table driven log formatting)\n");
+	fprintf(stderr, "  bustime                        (exact bit time of a frame, checked against known bit counts first)\n");
+}
+
+typedef struct {
+	int channel;
+	int count;
+	log_queue *queue;
+	spsc_ring *ring;
+} bench_producer_param;
+
+DWORD WINAPI bench_queue_producer(LPVOID param) {
+	int i;
+	can_log log;
+	bench_producer_param *tp = (bench_producer_param *)param;
+
+	memset(&log, '\0', sizeof(can_log));
+	log.channel = tp->channel;
+	log.frame.dlc = 8;
+
+	for(i = 0; i < tp->count; i++){
+		log.timestamp = i;
+		enqueue_frame(tp->queue, &log);
+	}
+
+	return 0;
+}
+
+DWORD WINAPI bench_ring_producer(LPVOID param) {
+	int i;
+	can_log log;
+	bench_producer_param *tp = (bench_producer_param *)param;
+
+	memset(&log, '\0', sizeof(can_log));
+	log.channel = tp->channel;
+	log.frame.dlc = 8;
+
+	for(i = 0; i < tp->count; i++){
+		log.timestamp = i;
+		while(spsc_ring_push(tp->ring, &log) != 0){
+			// full - give the consumer the CPU
+			Sleep(0);
+		}
+	}
+
+	return 0;
+}
+
+void bench_report(const char *name, uint64_t frames, uint64_t elapsed){
+	if(elapsed == 0){
+		elapsed = 1;
+	}
+
+	printf("%-12s %10llu frames %10.3f ms %12.0f frames/s\n",
+		name,
+		(unsigned long long)frames,
+		elapsed / 1000.0,
+		frames * 1000000.0 / elapsed);
+}
+
+int bench_queue(int producers, int count){
+	int i, n, idle;
+	uint64_t received, total, start, elapsed;
+	can_log log;
+	can_log logs[BENCH_BATCH_SIZE];
+	log_queue queue;
+	spsc_ring rings[MAX_CHANNELS];
+	bench_producer_param params[MAX_CHANNELS];
+	HANDLE handles[MAX_CHANNELS];
+
+	total = (uint64_t)producers * count;
+
+	//
+	// global queue: every producer takes the same lock
+	//
+	if(init_queue(&queue, BENCH_QUEUE_SIZE) != 0){
+		fprintf(stderr, "Failed to initialize queue\n");
+		return -1;
+	}
+
+	start = get_monotonic_time();
+	for(i = 0; i < producers; i++){
+		params[i].channel = i;
+		params[i].count = count;
+		params[i].queue = &queue;
+		handles[i] = CreateThread(NULL, 0, bench_queue_producer, &params[i], 0, NULL);
+	}
+
+	for(received = 0; received < total; received++){
+		if(dequeue_frame(&queue, &log) != 0){
+			break;
+		}
+	}
+	elapsed = get_monotonic_time() - start;
+
+	WaitForMultipleObjects(producers, handles, TRUE, INFINITE);
+	for(i = 0; i < producers; i++){
+		CloseHandle(handles[i]);
+	}
+	destroy_queue(&queue);
+
+	bench_report("log_queue", received, elapsed);
+
+	//
+	// global queue drained in batches
+	//
+	if(init_queue(&queue, BENCH_QUEUE_SIZE) != 0){
+		fprintf(stderr, "Failed to initialize queue\n");
+		return -1;
+	}
+
+	start = get_monotonic_time();
+	for(i = 0; i < producers; i++){
+		params[i].channel = i;
+		params[i].count = count;
+		params[i].queue = &queue;
+		handles[i] = CreateThread(NULL, 0, bench_queue_producer, &params[i], 0, NULL);
+	}
+
+	received = 0;
+	while(received < total && !stop_flag){
+		received += dequeue_frames(&queue, logs, BENCH_BATCH_SIZE, 50);
+	}
+	elapsed = get_monotonic_time() - start;
+
+	WaitForMultipleObjects(producers, handles, TRUE, INFINITE);
+	for(i = 0; i < producers; i++){
+		CloseHandle(handles[i]);
+	}
+	destroy_queue(&queue);
+
+	bench_report("log_queue/b", received, elapsed);
+
+	//
+	// per-producer rings drained round robin by one consumer
+	//
+	for(i = 0; i < producers; i++){
+		if(spsc_ring_init(&rings[i], BENCH_QUEUE_SIZE) != 0){
+			fprintf(stderr, "Failed to initialize ring\n");
+			return -1;
+		}
+	}
+
+	start = get_monotonic_time();
+	for(i = 0; i < producers; i++){
+		params[i].channel = i;
+		params[i].count = count;
+		params[i].ring = &rings[i];
+		handles[i] = CreateThread(NULL, 0, bench_ring_producer, &params[i], 0, NULL);
+	}
+
+	received = 0;
+	while(received < total && !stop_flag){
+		idle = 1;
+		for(i = 0; i < producers; i++){
+			while((n = spsc_ring_pop_batch(&rings[i], logs, BENCH_BATCH_SIZE)) > 0){
+				received += n;
+				idle = 0;
+			}
+		}
+		if(idle){
+			Sleep(0);
+		}
+	}
+	elapsed = get_monotonic_time() - start;
+
+	WaitForMultipleObjects(producers, handles, TRUE, INFINITE);
+	for(i = 0; i < producers; i++){
+		CloseHandle(handles[i]);
+		spsc_ring_destroy(&rings[i]);
+	}
+
+	bench_report("spsc_ring", received, elapsed);
+
+	return 0;
+}
+
+// the printf based formatting that sprint_log replaces, kept as reference
+int bench_snprint_log(char *buf, size_t size, can_log *log, int verbose){
+	int i, n, flag;
+
+	n = snprintf(buf, size, "(%010d.%06d) %d ",
+		(int)(log->timestamp / 1000000L),
+		(int)(log->timestamp % 1000000L),
+		log->channel);
+
+	if(log->frame.flag & canMSG_EXT){
+		n += snprintf(buf + n, size - n, "%08lX#", (unsigned long)(log->frame.id & 0x1FFFFFFF));
+	}else{
+		n += snprintf(buf + n, size - n, "%03lX#", (unsigned long)(log->frame.id & 0x7FF));
+	}
+
+	if(log->frame.flag & canFDMSG_FDF){
+		flag = CANFD_FDF;
+		if(log->frame.flag & canFDMSG_BRS){
+			flag |= CANFD_BRS;
+		}
+		if(log->frame.flag & canFDMSG_ESI){
+			flag |= CANFD_ESI;
+		}
+		n += snprintf(buf + n, size - n, "#%d", flag);
+	}
+
+	for(i = 0; i < (int)log->frame.dlc; i++){
+		n += snprintf(buf + n, size - n, "%02X", log->frame.msg[i]);
+	}
+
+	if(verbose){
+		n += snprintf(buf + n, size - n, " [%c%c%c%c%c%c%c]",
+			(log->frame.flag & canMSG_EXT)        ? 'x' : ' ',
+			(log->frame.flag & canMSG_RTR)        ? 'R' : ' ',
+			(log->frame.flag & canMSGERR_OVERRUN) ? 'o' : ' ',
+			(log->frame.flag & canMSG_NERR)       ? 'N' : ' ',
+			(log->frame.flag & canFDMSG_FDF)      ? 'F' : ' ',
+			(log->frame.flag & canFDMSG_BRS)      ? 'B' : ' ',
+			(log->frame.flag & canFDMSG_ESI)      ? 'E' : ' ');
+	}
+
+	n += snprintf(buf + n, size - n, "\n");
+
+	return n;
+}
+
+void bench_fill_log(can_log *log, int fd){
+	int i;
+
+	memset(log, '\0', sizeof(can_log));
+	log->channel = 1;
+	log->timestamp = 1700000000123456ULL;
+	if(fd){
+		log->frame.id = 0x1ABCDEF0;
+		log->frame.flag = canMSG_EXT | canFDMSG_FDF | canFDMSG_BRS;
+		log->frame.dlc = CANFD_MAX_DLEN;
+	}else{
+		log->frame.id = 0x123;
+		log->frame.dlc = CAN_MAX_DLEN;
+	}
+	for(i = 0; i < (int)log->frame.dlc; i++){
+		log->frame.msg[i] = (__u8)(i * 37 + 11);
+	}
+}
+
+int bench_format(int count){
+	int i, fd, len, ref_len;
+	uint64_t start, elapsed;
+	char buf[LOG_LINE_MAX], ref[LOG_LINE_MAX];
+	volatile int sink = 0;
+	can_log log;
+
+	for(fd = 0; fd <= 1; fd++){
+		bench_fill_log(&log, fd);
+
+		// both formatters must agree byte for byte
+		len = sprint_log(buf, &log, 1);
+		ref_len = bench_snprint_log(ref, sizeof(ref), &log, 1);
+		if(len != ref_len || memcmp(buf, ref, len) != 0){
+			fprintf(stderr, "Formatter mismatch:\n  %.*s  %.*s", ref_len, ref, len, buf);
+			return -1;
+		}
+
+		start = get_monotonic_time();
+		for(i = 0; i < count; i++){
+			log.timestamp++;
+			sink += bench_snprint_log(buf, sizeof(buf), &log, 0);
+		}
+		elapsed = get_monotonic_time() - start;
+		printf("%-12s %s %8.1f ns/frame\n", "snprintf", fd ? "FD64" : "CC8 ",
+			elapsed * 1000.0 / count);
+
+		start = get_monotonic_time();
+		for(i = 0; i < count; i++){
+			log.timestamp++;
+			sink += sprint_log(buf, &log, 0);
+		}
+		elapsed = get_monotonic_time() - start;
+		printf("%-12s %s %8.1f ns/frame\n", "sprint_log", fd ? "FD64" : "CC8 ",
+			elapsed * 1000.0 / count);
+	}
+
+	return 0;
+}
+
+/**
+ * Frames with their bits on the bus, stuff bits included, at the nominal
+ * and at the data bitrate. Worked out apart from bustime.c, the first one
+ * by hand: 34 dominant bits from SOF to the end of the CRC (which is 0)
+ * take a stuff bit after every five, 6, plus the 13 bits after the CRC.
+ *
+ */
+typedef struct {
+	const char *frame;
+	int nominal;
+	int data;
+} bench_bits_vector;
+
+static const bench_bits_vector bench_bits_vectors[] = {
+	{ "000#", 53, 0 },
+	{ "7FF#", 50, 0 },
+	{ "123#1122334455667788", 112, 0 },
+	{ "18FEF100#FF00", 88, 0 },
+	{ "1ABCDEF0#FFFFFFFFFFFFFFFF", 146, 0 },
+	{ "000##0", 32, 33 },
+	{ "1ABCDEF0##11122334455667788", 51, 97 },
+	{ "123##1000000000000000000000000", 30, 147 },
+	{ "7FF##0FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF", 32, 229 },
+};
+
+int bench_bustime(int count){
+	int i, fd, nominal, data;
+	uint64_t start, elapsed;
+	volatile uint64_t sink = 0;
+	char buf[LOG_LINE_MAX];
+	can_frame frame;
+	can_log log;
+
+	for(i = 0; i < (int)(sizeof(bench_bits_vectors) / sizeof(bench_bits_vectors[0])); i++){
+		strncpy_s(buf, sizeof(buf), bench_bits_vectors[i].frame, _TRUNCATE);
+		if(!parse_canframe(buf, &frame)){
+			fprintf(stderr, "Invalid can-frame value: %s\n", bench_bits_vectors[i].frame);
+			return -1;
+		}
+
+		can_frame_bits(&frame, CAN_STUFF_EXACT, &nominal, &data);
+		if(nominal != bench_bits_vectors[i].nominal || data != bench_bits_vectors[i].data){
+			fprintf(stderr, "Bit count mismatch for %s: %d + %d bits, expected %d + %d\n", bench_bits_vectors[i].frame,
+				nominal, data, bench_bits_vectors[i].nominal, bench_bits_vectors[i].data);
+			return -1;
+		}
+	}
+
+	for(fd = 0; fd <= 1; fd++){
+		bench_fill_log(&log, fd);
+
+		start = get_monotonic_time();
+		for(i = 0; i < count; i++){
+			log.frame.msg[0] = (__u8)i;
+			sink += can_frame_time(&log.frame, CAN_BITRATE_DEFAULT, CANFD_DATA_BITRATE_DEFAULT);
+		}
+		elapsed = get_monotonic_time() - start;
+		printf("%-12s %s %8.1f ns/frame\n", "bustime", fd ? "FD64" : "CC8 ",
+			elapsed * 1000.0 / count);
+	}
+
+	return 0;
+}
+
+int canbench(int argc, char *argv[]){
+	int i, producers, count;
+	char *target;
+
+	if(argc <= 2){
+		print_usage_canbench(argv[0], argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	producers = BENCH_PRODUCERS_DEFAULT;
+	count = BENCH_FRAMES_DEFAULT;
+	target = NULL;
+
+	for(i = 2; i < argc; i++){
+		if(strcmp(argv[i], "-n") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing count value after %s\n\n", argv[i]);
+				print_usage_canbench(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			count = atoi(argv[i]);
+
+			if (count <= 0) {
+				fprintf(stderr, "Invalid count value: %s\n\n", argv[i]);
+				print_usage_canbench(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "-p") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing num value after %s\n\n", argv[i]);
+				print_usage_canbench(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			producers = atoi(argv[i]);
+
+			if (producers <= 0 || producers > MAX_CHANNELS) {
+				fprintf(stderr, "Invalid num value: %s\n\n", argv[i]);
+				print_usage_canbench(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "help") == 0){
+			print_usage_canbench(argv[0], argv[1]);
+			return EXIT_FAILURE;
+		}
+		else{
+			target = argv[i];
+		}
+	}
+
+	if(target == NULL){
+		print_usage_canbench(argv[0], argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	if(strcmp(target, "queue") == 0){
+		return bench_queue(producers, count) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	else if(strcmp(target, "format") == 0){
+		return bench_format(count) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	else if(strcmp(target, "bustime") == 0){
+		return bench_bustime(count) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	fprintf(stderr, "Unknown benchmark target: %s\n\n", target);
+	print_usage_canbench(argv[0], argv[1]);
+
+	return EXIT_FAILURE;
+}
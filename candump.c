@@ -13,143 +13,344 @@ void print_usage_candump(char *arg0, char *arg1)
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "  -t <type>                      (timestamp: (a)bsolute/(d)elta - default 'a')\n");
 	fprintf(stderr, "  -v                             (verbose CAN flags)\n");
+	fprintf(stderr, "  -o <file>                      (write the log to <file> instead of stdout)\n");
+	fprintf(stderr, "  -B <file>                      (write a binary capture to <file> instead of stdout)\n");
+	fprintf(stderr, "  -s <MiB>                       (start a new <file>.<n> every <MiB> of output)\n");
+	fprintf(stderr, "  -p <sec>                       (start a new <file>.<n> every <sec> seconds)\n");
+	fprintf(stderr, "  -z                             (zstd compress <file>, adds .zst)\n");
+	fprintf(stderr, "  -i                             (write a time index <file>.idx for canplay --start, see kv index)\n");
+	fprintf(stderr, "  -L <ms>                        (max output latency, 0 flushes every batch - default 100ms)\n");
+	fprintf(stderr, "  -M <ms>                        (reorder window to merge channels by timestamp, 0 disables - default 20ms)\n");
+	fprintf(stderr, "  -Q <policy>                    (when a channel queue is full: block/newest/oldest/spill - default 'block')\n");
+	fprintf(stderr, "  -S <sec>                       (print per channel queue statistics every <sec> seconds)\n");
+	fprintf(stderr, "  -R <ringfile>                  (flight recorder: keep traffic in a memory-mapped ring file only)\n");
+	fprintf(stderr, "  -W <MiB>                       (flight recorder ring size - default 256MiB)\n");
+	fprintf(stderr, "  -w <pre>:<post>                (seconds frozen before/after a trigger - default 30:10)\n");
+	fprintf(stderr, "  -T <trigger>                   (freeze on a matching frame, may be repeated)\n");
+#ifdef SIGUSR1
+	fprintf(stderr, "                                 (a key press or SIGUSR1 also triggers)\n");
+#else
+	fprintf(stderr, "                                 (a key press or Ctrl+Break also triggers)\n");
+#endif
 	fprintf(stderr, "\n");
-	fprintf(stderr, "Format of <channel>: <channel-num>{f|F}{_}{b|B<bitrate>}{d|D<data-bitrate>}\n");
+	fprintf(stderr, "Format of <channel>: <channel-num>{f|F}{_}{b|B<bitrate>}{d|D<data-bitrate>}{,<filter>}\n");
 	fprintf(stderr, "  examples:\n");
 	fprintf(stderr, "    0                            (channel 0, CAN-CC)\n");
 	fprintf(stderr, "    0F                           (channel 0, CAN-FD)\n");
 	fprintf(stderr, "    0_b500K                      (channel 0, CAN-CC, bitrate 500K)\n");
 	fprintf(stderr, "    0Fb500Kd2M                   (channel 0, CAN-FD, arbitration bitrate 500K, data bitrate 2M)\n");
+	fprintf(stderr, "    sock:vcan0                   (SocketCAN interface vcan0 on the lowest free channel, Linux only)\n");
+	fprintf(stderr, "    sim:a/l40                    (simulated bus a with 40%% synthetic load, no hardware needed)\n");
+	fprintf(stderr, "    0,123:7FF,400:700            (channel 0, can-id 0x123 and 0x400-0x4FF only)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Format of <filter>: <can-id>:<mask> or <can-id>~<mask> (inverted)\n");
+	fprintf(stderr, "  a frame passes when (id & mask) == (can-id & mask) for any filter of its channel\n");
+	fprintf(stderr, "  can-ids with more than 3 digits match 29-bit frames\n");
+	fprintf(stderr, "  examples:\n");
+	fprintf(stderr, "    123:7FF                      (can-id 0x123)\n");
+	fprintf(stderr, "    18DA00F1:1FFFFF00            (29-bit can-id 0x18DA00xx)\n");
+	fprintf(stderr, "    7DF~7FF                      (everything but can-id 0x7DF)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Format of <trigger>: <can-id>{:<mask>}{#<data>}\n");
+	fprintf(stderr, "  examples:\n");
+	fprintf(stderr, "    123                          (can-id 0x123)\n");
+	fprintf(stderr, "    100:700                      (can-id 0x100-0x1FF)\n");
+	fprintf(stderr, "    123#DEAD                     (can-id 0x123, payload starting with 0xDEAD)\n");
+	fprintf(stderr, "  Frozen windows are written to <ringfile>.<n>.log\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Queue policies:\n");
+	fprintf(stderr, "    block                        (channel thread waits, the driver queue may overrun)\n");
+	fprintf(stderr, "    newest                       (drop the received frame)\n");
+	fprintf(stderr, "    oldest                       (drop the oldest queued frame)\n");
+	fprintf(stderr, "    spill                        (queue to a temporary file until the output catches up)\n");
 }
 
-// Thread-Safe Queue
 typedef struct {
-    can_log* buffer;
-    int head;
-    int tail;
-    int count;
-    int size;
-    CRITICAL_SECTION mutex;
-    CONDITION_VARIABLE not_empty;
-    CONDITION_VARIABLE not_full;
-} log_queue;
-
-int init_queue(log_queue* queue, int size) {
-    queue->buffer = (can_log*)malloc(sizeof(can_log) * size);
-    if (queue->buffer == NULL) {
-        return -1;
-    }
+	char timestamp_type;
+	uint64_t start_time;
+	int verbose;
+	int latency;
+	int pending;
+	uint64_t last_flush;
+	FILE *out;
+	log_writer *writer;
+	flight_recorder *recorder;
+	int stats_interval;
+	uint64_t last_stats;
+	log_merger *merger;
+} output_thread_param;
 
-    queue->head = 0;
-    queue->tail = 0;
-    queue->count = 0;
-    queue->size = size;
+typedef struct {
+	HANDLE thread_handle;
+	DWORD thread_id;
+} thread;
+
+thread channel_threads[MAX_CHANNELS];
+
+// capture start, as unix time and as host monotonic time taken together
+uint64_t capture_start_time;
+uint64_t capture_epoch;
+
+#define RING_SIZE 16384
+#define RING_DRAIN_MAX 256
+#define RING_SPACE_WAIT 10      // ms a blocked channel thread sleeps at most before it looks again
+#define KV_READ_BATCH 256
+
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+#define OUTPUT_LATENCY_DEFAULT 100
+#define MERGE_WINDOW_DEFAULT 20
 
-    InitializeCriticalSection(&queue->mutex);
-    InitializeConditionVariable(&queue->not_empty);
-    InitializeConditionVariable(&queue->not_full);
+#define QUEUE_POLICY_BLOCK  0
+#define QUEUE_POLICY_NEWEST 1
+#define QUEUE_POLICY_OLDEST 2
+#define QUEUE_POLICY_SPILL  3
 
-    return 0;
+#define RECORDER_SIZE_DEFAULT 256
+#define RECORDER_PRE_DEFAULT 30
+#define RECORDER_POST_DEFAULT 10
+
+flight_recorder recorder;
+log_writer writer;
+log_merger merger;
+volatile int recorder_signaled = 0;
+
+void recorder_signal_handler(int sig){
+	recorder_signaled = 1;
+	signal(sig, recorder_signal_handler);
 }
 
-void destroy_queue(log_queue* queue) {
-    if (queue->buffer) {
-        free(queue->buffer);
-        queue->buffer = NULL;
-    }
+// one ring per channel, the output thread is the only consumer
+spsc_ring channel_rings[MAX_CHANNELS];
+spill_file channel_spills[MAX_CHANNELS];
+int queue_policy = QUEUE_POLICY_BLOCK;
+HANDLE frames_ready;
+volatile LONG output_waiting;
+// a channel thread waits for room in its full ring (block policy)
+HANDLE ring_space[MAX_CHANNELS];
+volatile LONG ring_waiting[MAX_CHANNELS];
+
+// written by the channel thread only
+typedef struct {
+	uint64_t frames;
+	uint64_t filtered;
+	uint64_t dropped;
+	uint64_t spilled;
+	uint64_t overruns;
+	uint64_t bus_time;      // ns, exact frame bit times
+	unsigned int high_water;
+} channel_stats;
+
+channel_stats channel_counters[MAX_CHANNELS];
+// frames the merger could not take, written by the output thread only
+uint64_t merge_dropped[MAX_CHANNELS];
+// bus load is printed over the time since the previous stats
+uint64_t stats_since;
+uint64_t stats_bus_time[MAX_CHANNELS];
+can_filter channel_filters[MAX_CHANNELS];
 
-    DeleteCriticalSection(&queue->mutex);
+// compile the software filters, narrow down the acceptance filters where possible
+int setup_filters(){
+	int i;
+	__u32 code, mask;
+
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(!channels[i].state || channel_filters[i].num_rules == 0){
+			continue;
+		}
+
+		if(filter_compile(&channel_filters[i]) != 0){
+			return -1;
+		}
+
+		if(filter_hw_mask(&channel_filters[i], 0, &code, &mask) == 0){
+			kv_set_filter(i, code, mask, 0);
+		}
+		if(filter_hw_mask(&channel_filters[i], 1, &code, &mask) == 0){
+			kv_set_filter(i, code, mask, 1);
+		}
+	}
+
+	return 0;
 }
 
-int enqueue_frame(log_queue* queue, const can_log* frame) {
-    EnterCriticalSection(&queue->mutex);
+void destroy_filters(){
+	int i;
 
-	while (queue->count >= queue->size && !stop_flag) {
-		// Buffer is full - sleep so consumers can get items.
-		SleepConditionVariableCS(&queue->not_full, &queue->mutex, INFINITE);
+	for(i = 0; i < MAX_CHANNELS; i++){
+		filter_destroy(&channel_filters[i]);
 	}
+}
 
-    if (stop_flag) {
-        LeaveCriticalSection(&queue->mutex);
-        return -1;
-    }
+void wake_output_thread(){
+	// make the pushed frame visible before looking at the waiting flag
+	MemoryBarrier();
+	if(output_waiting){
+		SetEvent(frames_ready);
+	}
+}
 
-	// Copy the log to buffer
-    memcpy(&queue->buffer[queue->head], frame, sizeof(can_log));
-    queue->head = (queue->head + 1) % queue->size;
-    queue->count++;
+int init_rings(){
+	int i;
 
-    LeaveCriticalSection(&queue->mutex);
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(channels[i].state){
+			if(spsc_ring_init(&channel_rings[i], RING_SIZE) != 0){
+				return -1;
+			}
+			channel_rings[i].overwrite = (queue_policy == QUEUE_POLICY_OLDEST);
+			if(queue_policy == QUEUE_POLICY_SPILL && spill_open(&channel_spills[i]) != 0){
+				return -1;
+			}
+			ring_space[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+			if(ring_space[i] == NULL){
+				return -1;
+			}
+		}
+	}
 
-	// If a consumer is waiting, wake it
-    WakeConditionVariable(&queue->not_empty);
+	frames_ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if(frames_ready == NULL){
+		return -1;
+	}
 
-    return 0;
+	return 0;
 }
 
-int dequeue_frame(log_queue* queue, can_log* frame) {
-    EnterCriticalSection(&queue->mutex);
+void destroy_rings(){
+	int i;
 
-	while (queue->count == 0 && !stop_flag) {
-		// Buffer is empty - sleep so producers can create items.
-		SleepConditionVariableCS(&queue->not_empty, &queue->mutex, 50);
+	for(i = 0; i < MAX_CHANNELS; i++){
+		spsc_ring_destroy(&channel_rings[i]);
+		spill_close(&channel_spills[i]);
+		if(ring_space[i]){
+			CloseHandle(ring_space[i]);
+			ring_space[i] = NULL;
+		}
 	}
+	merger_destroy(&merger);
 
-	// Stop flag is set and queue is empty
-    if (queue->count == 0 && stop_flag) {
-        LeaveCriticalSection(&queue->mutex);
-        return -1;
-    }
+	if(frames_ready){
+		CloseHandle(frames_ready);
+		frames_ready = NULL;
+	}
+}
 
-	// Get frame
-    memcpy(frame, &queue->buffer[queue->tail], sizeof(can_log));
-    queue->tail = (queue->tail + 1) % queue->size;
-    queue->count--;
+void queue_log(int channel, can_log *log){
+	spsc_ring *ring = &channel_rings[channel];
+	channel_stats *st = &channel_counters[channel];
+	unsigned int count;
 
-    LeaveCriticalSection(&queue->mutex);
+	st->frames++;
+	if(log->frame.flag & canMSGERR_OVERRUN){
+		st->overruns++;
+	}
+	st->bus_time += can_frame_time(&log->frame, channels[channel].bitrate, channels[channel].data_bitrate);
 
-	// If a producer is waiting, wake it.
-    WakeConditionVariable(&queue->not_full);
+	if(!filter_match(&channel_filters[channel], &log->frame)){
+		st->filtered++;
+		return;
+	}
 
-    return 0;
+	switch(queue_policy){
+		case QUEUE_POLICY_BLOCK:
+			while(spsc_ring_push(ring, log) != 0 && !stop_flag){
+				// Ring is full - announce that we wait, then check once more
+				// so a pop in between is not missed, and sleep until the
+				// output thread has made room.
+				ring_waiting[channel] = 1;
+				MemoryBarrier();
+				wake_output_thread();
+				if(spsc_ring_count(ring) > ring->mask){
+					WaitForSingleObject(ring_space[channel], RING_SPACE_WAIT);
+				}
+				ring_waiting[channel] = 0;
+			}
+			break;
+		case QUEUE_POLICY_NEWEST:
+			if(spsc_ring_push(ring, log) != 0){
+				st->dropped++;
+			}
+			break;
+		case QUEUE_POLICY_OLDEST:
+			st->dropped += spsc_ring_push_overwrite(ring, log);
+			break;
+		case QUEUE_POLICY_SPILL:
+			// once spilling, stay on the file until it is drained to keep the order
+			if(channel_spills[channel].active || spsc_ring_push(ring, log) != 0){
+				if(spill_write(&channel_spills[channel], log) == 0){
+					st->spilled++;
+				}else{
+					st->dropped++;
+				}
+			}
+			break;
+	}
+
+	count = spsc_ring_count(ring);
+	if(count > st->high_water){
+		st->high_water = count;
+	}
 }
 
-typedef struct {
-	char timestamp_type;
-	uint64_t start_time;
-	int verbose;
-} output_thread_param;
+void print_channel_stats(FILE *stream){
+	int i;
+	channel_stats *st;
+	uint64_t now, bus_time;
 
-typedef struct {
-	HANDLE thread_handle;
-	DWORD thread_id;
-} thread;
+	now = get_monotonic_time();
 
-thread channel_threads[MAX_CHANNELS];
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(!channels[i].state){
+			continue;
+		}
+		st = &channel_counters[i];
+		bus_time = st->bus_time;
+		fprintf(stream, "ch %d: frames %llu, filtered %llu, dropped %llu, spilled %llu, overruns %llu, high-water %u/%u, bus load %.1f%%\n",
+			i,
+			(unsigned long long)st->frames,
+			(unsigned long long)st->filtered,
+			(unsigned long long)(st->dropped + merge_dropped[i] + writer.dropped[i]),
+			(unsigned long long)st->spilled,
+			(unsigned long long)st->overruns,
+			st->high_water,
+			channel_rings[i].mask + 1,
+			now > stats_since ? (bus_time - stats_bus_time[i]) / 10.0 / (now - stats_since) : 0.0);
+		stats_bus_time[i] = bus_time;
+	}
 
-#define MAX_QUEUE_SIZE 10000
-log_queue log_q;
+	stats_since = now;
+}
 
 DWORD WINAPI channel_thread(LPVOID param) {
-    long id;
-    unsigned char msg[CANFD_MAX_DLEN];
-    unsigned int dlc;
-    unsigned int flag;
-    unsigned long timestamp;
-	can_log log;
+	can_log logs[KV_READ_BATCH];
+	int i, n;
+	uint64_t now, next_sample;
 	can_channel *tp = (can_channel *)param;
 
+	kv_sample_clock(tp->channel);
+	next_sample = get_monotonic_time() + CLOCK_SAMPLE_INTERVAL;
+
 	while(!stop_flag){
-		if(kv_read(tp->channel, &id, msg, &dlc, &flag, &timestamp) == 0){
-			log.channel = tp->channel;
-			log.timestamp = timestamp;
-			log.frame.id = id;
-			log.frame.dlc = dlc;
-			log.frame.flag = flag;
-			memcpy(log.frame.msg, msg, dlc);
+		// keep the device clock mapping current, also through quiet periods
+		now = get_monotonic_time();
+		if(now >= next_sample){
+			kv_sample_clock(tp->channel);
+			next_sample = now + CLOCK_SAMPLE_INTERVAL;
+		}
 
-            enqueue_frame(&log_q, &log);
+		n = kv_read_batch(tp->channel, logs, KV_READ_BATCH);
+		if(n < 0){
+			// driver error, do not spin on it
+			Sleep(10);
+			continue;
 		}
+
+		for(i = 0; i < n; i++){
+			// host monotonic -> time since capture start
+			logs[i].timestamp = logs[i].timestamp > capture_epoch ? logs[i].timestamp - capture_epoch : 0;
+			queue_log(tp->channel, &logs[i]);
+		}
+		wake_output_thread();
 	}
 
 	return 0;
@@ -166,33 +367,367 @@ void adjust_timestamp(can_log *log, char type, uint64_t start_time){
 	}
 }
 
-DWORD WINAPI output_thread(LPVOID param) {
+void output_log(output_thread_param *tp, can_log *log){
+	if(tp->recorder){
+		recorder_write(tp->recorder, log);
+	}else if(tp->writer){
+		writer_write_log(tp->writer, log, tp->verbose);
+	}else{
+		fprint_log(tp->out, log, tp->verbose);
+	}
+
+	if(tp->out || tp->writer){
+		tp->pending = 1;
+	}
+}
+
+// emit merged frames that are due, all of them with force
+void merge_output(output_thread_param *tp, int force){
 	can_log log;
-	output_thread_param *tp = (output_thread_param *)param;
+	uint64_t now = get_monotonic_time();
 
-	while(!stop_flag){
-		if (dequeue_frame(&log_q, &log) == 0) {
-			adjust_timestamp(&log, tp->timestamp_type, tp->start_time);
-			fprint_log(stdout, &log, tp->verbose);
+	while(merger_pop(tp->merger, &log, now, force) == 0){
+		output_log(tp, &log);
+	}
+}
+
+int drain_rings(output_thread_param *tp){
+	int i, j, n, max, total;
+	can_log logs[RING_DRAIN_MAX], log;
+	uint64_t now;
+
+	now = get_monotonic_time();
+	total = 0;
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(!channels[i].state){
+			continue;
+		}
+
+		// bounded per ring so a busy channel cannot starve the others
+		max = RING_DRAIN_MAX;
+		if(tp->merger){
+			// room for a batch; a full FIFO means the other channels are silent or far behind,
+			// the oldest frames go out without waiting out the window
+			while(merger_space(tp->merger, i) < (unsigned int)max && merger_pop(tp->merger, &log, now, 1) == 0){
+				output_log(tp, &log);
+			}
+			if(merger_space(tp->merger, i) < (unsigned int)max){
+				max = (int)merger_space(tp->merger, i);
+			}
+		}
+
+		n = spsc_ring_pop_batch(&channel_rings[i], logs, max);
+		if(n > 0){
+			// make the room visible before looking at the waiting flag
+			MemoryBarrier();
+			if(ring_waiting[i]){
+				SetEvent(ring_space[i]);
+			}
+		}
+		if(n < max && channel_spills[i].active){
+			// the ring is empty, continue with what went to the spill file
+			n += spill_read(&channel_spills[i], logs + n, max - n);
+		}
+		for(j = 0; j < n; j++){
+			adjust_timestamp(&logs[j], tp->timestamp_type, tp->start_time);
+			if(tp->merger){
+				if(merger_push(tp->merger, &logs[j], now) != 0){
+					merge_dropped[i]++;
+				}
+			}else{
+				output_log(tp, &logs[j]);
+			}
+		}
+		total += n;
+	}
+
+	if(tp->merger){
+		merge_output(tp, 0);
+	}
+
+	return total;
+}
+
+// manual triggers and writing out a frozen window once it is complete
+void poll_recorder(output_thread_param *tp){
+	uint64_t now;
+
+	now = get_unix_time();
+	if(tp->timestamp_type == 'd'){
+		now -= tp->start_time;
+	}
+
+	if(recorder_signaled){
+		recorder_signaled = 0;
+		recorder_trigger(tp->recorder, now);
+	}
+
+	while(_kbhit()){
+		_getch();
+		recorder_trigger(tp->recorder, now);
+	}
+
+	recorder_poll(tp->recorder, now);
+}
+
+// output is fully buffered, push it out once the latency budget is spent
+void flush_output(output_thread_param *tp, int force){
+	uint64_t now;
+
+	if(!tp->pending){
+		return;
+	}
+
+	now = get_monotonic_time();
+	if(force || now - tp->last_flush >= (uint64_t)tp->latency * 1000){
+		if(tp->writer){
+			writer_flush(tp->writer);
 		}else{
-			Sleep(1);
+			fflush(tp->out);
 		}
+		tp->pending = 0;
+		tp->last_flush = now;
 	}
+}
+
+DWORD output_wait_time(output_thread_param *tp){
+	uint64_t elapsed;
+	DWORD remain;
 
+	if(!tp->pending){
+		return 50;
+	}
+
+	elapsed = (get_monotonic_time() - tp->last_flush) / 1000;
+	remain = elapsed >= (uint64_t)tp->latency ? 0 : (DWORD)(tp->latency - elapsed);
+
+	return remain < 50 ? remain : 50;
+}
+
+DWORD merge_wait_time(output_thread_param *tp, DWORD wait){
+	uint64_t due;
+
+	if(tp->merger == NULL || tp->merger->heap_len == 0){
+		return wait;
+	}
+
+	// wake up in time to emit the oldest held back frame
+	due = (merger_due(tp->merger, get_monotonic_time()) + 999) / 1000;
+
+	return due < wait ? (DWORD)due : wait;
+}
+
+int rings_empty(){
+	int i;
+
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(channels[i].state && (spsc_ring_count(&channel_rings[i]) > 0 || channel_spills[i].active)){
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+DWORD WINAPI output_thread(LPVOID param) {
+	output_thread_param *tp = (output_thread_param *)param;
+
+	tp->pending = 0;
+	tp->last_flush = get_monotonic_time();
+	tp->last_stats = tp->last_flush;
+
+	while(!stop_flag){
+		if(tp->recorder){
+			poll_recorder(tp);
+		}
+
+		if(tp->stats_interval && get_monotonic_time() - tp->last_stats >= (uint64_t)tp->stats_interval * 1000000){
+			print_channel_stats(stderr);
+			tp->last_stats = get_monotonic_time();
+		}
+
+		if(drain_rings(tp) > 0){
+			flush_output(tp, 0);
+			continue;
+		}
+		flush_output(tp, 0);
+
+		// All rings are empty - announce that we sleep, then check once
+		// more so a frame pushed in between is not missed.
+		output_waiting = 1;
+		MemoryBarrier();
+		if(rings_empty()){
+			WaitForSingleObject(frames_ready, merge_wait_time(tp, output_wait_time(tp)));
+		}
+		output_waiting = 0;
+	}
 
 	// output all log before exiting
-	while (dequeue_frame(&log_q, &log) == 0){
-		adjust_timestamp(&log, tp->timestamp_type, tp->start_time);
-		fprint_log(stdout, &log, tp->verbose);
+	while(drain_rings(tp) > 0){
+	}
+	if(tp->merger){
+		merge_output(tp, 1);
+	}
+	flush_output(tp, 1);
+
+	// write out a window that is still open, as far as it goes
+	if(tp->recorder){
+		recorder_poll(tp->recorder, (uint64_t)-1);
 	}
 
 	return 0;
 }
 
+/**
+ * Capture side of candump, also used by kv stat
+ *
+ *  capture_add_channel   open <channel>{,<filter>} from the command line
+ *  capture_init          filters and rings of the opened channels
+ *  capture_start         bus on, one reader thread per channel
+ *  capture_read          take frames from the rings, for a single consumer
+ *  capture_join          wait for the reader threads (stop_flag)
+ *  capture_stop          capture_join and close all
+ *
+ */
+int capture_add_channel(const char *arg){
+	char spec[256];
+	char *filters, *tok, *ctx;
+	int channel_num;
+	can_channel ch;
+
+	strncpy_s(spec, sizeof(spec), arg, _TRUNCATE);
+	filters = strchr(spec, ',');
+	if(filters != NULL){
+		*filters++ = '\0';
+	}
+
+	ch.fd = 0;
+	ch.bitrate = CAN_BITRATE_DEFAULT;
+	ch.data_bitrate = CANFD_DATA_BITRATE_DEFAULT;
+	ch.state = 0;
+	channel_num = parse_canchannel(spec, &ch);
+	if(channel_num < 0 || channel_num >= MAX_CHANNELS){
+		fprintf(stderr, "Invalid channel value: %d\n\n", channel_num);
+		return -1;
+	}
+
+	ctx = NULL;
+	tok = (filters != NULL) ? strtok_s(filters, ",", &ctx) : NULL;
+	while(tok != NULL){
+		if(filter_add(&channel_filters[channel_num], tok) != 0){
+			fprintf(stderr, "Invalid filter value: %s\n\n", tok);
+			return -1;
+		}
+		tok = strtok_s(NULL, ",", &ctx);
+	}
+
+	return kv_setup_channel(channel_num, &ch);
+}
+
+int capture_init(){
+	capture_start_time = get_unix_time();
+	capture_epoch = get_monotonic_time();
+
+	if(setup_filters() != 0){
+		fprintf(stderr, "Failed to set up filters\n");
+		return -1;
+	}
+
+	if(init_rings() != 0){
+		fprintf(stderr, "Failed to initialize frame rings\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int capture_start(){
+	int i;
+
+	kv_sync_bus_on();
+
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(channels[i].state){
+			channel_threads[i].thread_handle = CreateThread(
+				NULL,                  			// Default Security
+				0,                      		// Default Stack Size
+				channel_thread,         		// Thread Function
+				&channels[i],            		// Paremeters
+				0,                      		// Default Creation Flag
+				&channel_threads[i].thread_id  	// Thread ID
+			);
+			if(channel_threads[i].thread_handle == NULL){
+				fprintf(stderr, "Failed to create thread for channel %d\n", i);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Up to max frames from all rings, waits up to timeout ms when there are none.
+int capture_read(can_log *logs, int max, DWORD timeout){
+	static int next = 0;
+	int i, ch, n, total;
+
+	total = 0;
+	for(i = 0; i < MAX_CHANNELS && total < max; i++){
+		// start with another ring each call so none is preferred
+		ch = (next + i) % MAX_CHANNELS;
+		if(!channels[ch].state){
+			continue;
+		}
+
+		n = spsc_ring_pop_batch(&channel_rings[ch], logs + total, max - total);
+		if(total + n < max && channel_spills[ch].active){
+			n += spill_read(&channel_spills[ch], logs + total + n, max - total - n);
+		}
+		total += n;
+	}
+	next = (next + 1) % MAX_CHANNELS;
+
+	if(total == 0 && timeout > 0){
+		output_waiting = 1;
+		MemoryBarrier();
+		if(rings_empty()){
+			WaitForSingleObject(frames_ready, timeout);
+		}
+		output_waiting = 0;
+	}
+
+	return total;
+}
+
+void capture_join(){
+	int i;
+
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(channel_threads[i].thread_handle != NULL){
+			WaitForSingleObject(channel_threads[i].thread_handle, INFINITE);
+			CloseHandle(channel_threads[i].thread_handle);
+			channel_threads[i].thread_handle = NULL;
+		}
+	}
+}
+
+void capture_stop(){
+	capture_join();
+
+	kv_cleanup_channels();
+	destroy_rings();
+	destroy_filters();
+}
+
 int candump(int argc, char *argv[]){
-	int i, channel_num, verbose;
+	int i, verbose, latency, stats_interval, merge_window, num_channels;
+	char *output_buffer;
+	char *logpath;
+	char *ringpath;
+	int binary, compress, index;
+	uint64_t ringsize, rotate_size, rotate_period;
+	FILE *out;
 	char timestamp_type;
-	can_channel ch;
 	uint64_t start_time;
 	output_thread_param output_tp;
 	HANDLE output_thread_handle;
@@ -205,9 +740,26 @@ int candump(int argc, char *argv[]){
 
 	timestamp_type = 'a';
 	verbose = 0;
+	latency = OUTPUT_LATENCY_DEFAULT;
+	merge_window = MERGE_WINDOW_DEFAULT;
+	stats_interval = 0;
+	logpath = NULL;
+	binary = 0;
+	compress = 0;
+	index = 0;
+	rotate_size = 0;
+	rotate_period = 0;
+	ringpath = NULL;
+	ringsize = (uint64_t)RECORDER_SIZE_DEFAULT << 20;
+	recorder.pre = (uint64_t)RECORDER_PRE_DEFAULT * 1000000;
+	recorder.post = (uint64_t)RECORDER_POST_DEFAULT * 1000000;
 
 	kv_initialize();
 	memset(channel_threads, '\0', sizeof(thread) * MAX_CHANNELS);
+	memset(channel_counters, '\0', sizeof(channel_stats) * MAX_CHANNELS);
+	memset(stats_bus_time, '\0', sizeof(stats_bus_time));
+	stats_since = get_monotonic_time();
+	memset(channel_filters, '\0', sizeof(can_filter) * MAX_CHANNELS);
 
 	for(i = 2; i < argc; i++){
 		if(strcmp(argv[i], "-v") == 0){
@@ -229,37 +781,280 @@ int candump(int argc, char *argv[]){
 				return EXIT_FAILURE;
 			}
 		}
+		else if(strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "-B") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing file value after %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			binary = (argv[i][1] == 'B');
+			i++;
+			logpath = argv[i];
+		}
+		else if(strcmp(argv[i], "-s") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing size value after %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			if (atoi(argv[i]) <= 0) {
+				fprintf(stderr, "Invalid size value: %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+			rotate_size = (uint64_t)atoi(argv[i]) << 20;
+		}
+		else if(strcmp(argv[i], "-p") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing period value after %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			if (atoi(argv[i]) <= 0) {
+				fprintf(stderr, "Invalid period value: %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+			rotate_period = (uint64_t)atoi(argv[i]) * 1000000;
+		}
+		else if(strcmp(argv[i], "-z") == 0){
+			compress = 1;
+		}
+		else if(strcmp(argv[i], "-i") == 0){
+			index = 1;
+		}
+		else if(strcmp(argv[i], "-R") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing ringfile value after %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			ringpath = argv[i];
+		}
+		else if(strcmp(argv[i], "-W") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing size value after %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			if (atoi(argv[i]) <= 0) {
+				fprintf(stderr, "Invalid size value: %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+			ringsize = (uint64_t)atoi(argv[i]) << 20;
+		}
+		else if(strcmp(argv[i], "-w") == 0){
+			double pre, post;
+
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing window value after %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			if (sscanf_s(argv[i], "%lf:%lf", &pre, &post) != 2 || pre < 0 || post < 0) {
+				fprintf(stderr, "Invalid window value: %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+			recorder.pre = (uint64_t)(pre * 1000000);
+			recorder.post = (uint64_t)(post * 1000000);
+		}
+		else if(strcmp(argv[i], "-T") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing trigger value after %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			if (recorder_add_trigger(&recorder, argv[i]) != 0) {
+				fprintf(stderr, "Invalid trigger value: %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "-L") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing latency value after %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			latency = atoi(argv[i]);
+
+			if (latency < 0) {
+				fprintf(stderr, "Invalid latency value: %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "-M") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing window value after %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			merge_window = atoi(argv[i]);
+
+			if (merge_window < 0) {
+				fprintf(stderr, "Invalid window value: %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "-Q") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing policy value after %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			if(strcmp(argv[i], "block") == 0){
+				queue_policy = QUEUE_POLICY_BLOCK;
+			}
+			else if(strcmp(argv[i], "newest") == 0){
+				queue_policy = QUEUE_POLICY_NEWEST;
+			}
+			else if(strcmp(argv[i], "oldest") == 0){
+				queue_policy = QUEUE_POLICY_OLDEST;
+			}
+			else if(strcmp(argv[i], "spill") == 0){
+				queue_policy = QUEUE_POLICY_SPILL;
+			}
+			else{
+				fprintf(stderr, "Invalid policy value: %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "-S") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing interval value after %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			stats_interval = atoi(argv[i]);
+
+			if (stats_interval <= 0) {
+				fprintf(stderr, "Invalid interval value: %s\n\n", argv[i]);
+				print_usage_candump(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+		}
 		else if(strcmp(argv[i], "help") == 0){
 			print_usage_candump(argv[0], argv[1]);
 			return EXIT_FAILURE;
 		}
 		else{
-			ch.fd = 0;
-			ch.bitrate = CAN_BITRATE_DEFAULT;
-			ch.data_bitrate = CANFD_DATA_BITRATE_DEFAULT;
-			ch.state = 0;
-			channel_num = parse_canchannel(argv[i], &ch);
-			if(channel_num >= MAX_CHANNELS){
-				fprintf(stderr, "Invalid channel value: %d\n\n", channel_num);
+			if(capture_add_channel(argv[i]) != 0){
+				print_usage_candump(argv[0], argv[1]);
+				kv_cleanup_channels();
 				return EXIT_FAILURE;
 			}
-			kv_setup_channel(channel_num, &ch);
 		}
 	}
 
-    if (init_queue(&log_q, MAX_QUEUE_SIZE) != 0) {
-        fprintf(stderr, "Failed to initialize frame queue\n");
-        kv_cleanup_channels();
-        return 1;
-    }
+	if (ringpath != NULL && logpath != NULL) {
+		fprintf(stderr, "Error: -R cannot be used together with -o/-B\n\n");
+		print_usage_candump(argv[0], argv[1]);
+		kv_cleanup_channels();
+		return EXIT_FAILURE;
+	}
 
-	start_time = get_unix_time();
-	kv_sync_bus_on();
+	if (logpath == NULL && (rotate_size || rotate_period || compress || index)) {
+		fprintf(stderr, "Error: -s, -p, -z and -i need an output file (-o/-B)\n\n");
+		print_usage_candump(argv[0], argv[1]);
+		kv_cleanup_channels();
+		return EXIT_FAILURE;
+	}
+
+	if (index && compress) {
+		fprintf(stderr, "Error: compressed logs cannot be indexed (-i with -z)\n\n");
+		print_usage_candump(argv[0], argv[1]);
+		kv_cleanup_channels();
+		return EXIT_FAILURE;
+	}
+
+	if (capture_init() != 0) {
+		capture_stop();
+		return 1;
+	}
+
+	// a single channel is in timestamp order already
+	num_channels = 0;
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(channels[i].state){
+			num_channels++;
+		}
+	}
+	if (num_channels > 1 && merge_window > 0) {
+		merger_init(&merger, RING_SIZE, num_channels, (uint64_t)merge_window * 1000);
+	}
+
+	out = stdout;
+	if (ringpath != NULL) {
+		if (recorder_open(&recorder, ringpath, ringsize) != 0) {
+			capture_stop();
+			return 1;
+		}
+		out = NULL;
+
+#ifdef SIGBREAK
+		signal(SIGBREAK, recorder_signal_handler);
+#endif
+#ifdef SIGUSR1
+		signal(SIGUSR1, recorder_signal_handler);
+#endif
+	}
+	else if (logpath != NULL) {
+		// formatting, compression and disk I/O move to the writer thread
+		if (writer_open(&writer, logpath, binary, compress, rotate_size, rotate_period, index) != 0) {
+			capture_stop();
+			writer_close(&writer);
+			return 1;
+		}
+		out = NULL;
+	}
+
+	// one large userspace buffer for the output, flushed by size or latency.
+	// It stays alive until the process exits.
+	if (out != NULL) {
+		output_buffer = (char*)malloc(OUTPUT_BUFFER_SIZE);
+		if (output_buffer != NULL) {
+			setvbuf(out, output_buffer, _IOFBF, OUTPUT_BUFFER_SIZE);
+		}
+	}
+
+	start_time = capture_start_time;
 
 	// Run output thread
 	output_tp.timestamp_type = timestamp_type;
 	output_tp.start_time = start_time;
 	output_tp.verbose = verbose;
+	output_tp.latency = latency;
+	output_tp.stats_interval = stats_interval;
+	output_tp.out = out;
+	output_tp.writer = (logpath != NULL) ? &writer : NULL;
+	output_tp.recorder = (ringpath != NULL) ? &recorder : NULL;
+	output_tp.merger = (num_channels > 1 && merge_window > 0) ? &merger : NULL;
     output_thread_handle = CreateThread(
         NULL,
         0,
@@ -275,45 +1070,38 @@ int candump(int argc, char *argv[]){
 		goto err;
     }
 
-	// Run channel threads
-	for(i = 0; i < MAX_CHANNELS; i++){
-		if(channels[i].state){
-			channel_threads[i].thread_handle = CreateThread(
-				NULL,                  			// Default Security
-				0,                      		// Default Stack Size
-				channel_thread,         		// Thread Function
-				&channels[i],            		// Paremeters
-				0,                      		// Default Creation Flag
-				&channel_threads[i].thread_id  	// Thread ID
-			);
-			if(channel_threads[i].thread_handle == NULL){
-				fprintf(stderr, "Failed to create thread for channel %d\n", i);
-				stop_flag = 1;
-				goto err;
-			}
-		}
+	// Bus on and run channel threads
+	if (capture_start() != 0) {
+		stop_flag = 1;
+		WaitForSingleObject(output_thread_handle, INFINITE);
+		CloseHandle(output_thread_handle);
+		goto err;
 	}
 
 	// wait until exiting
     WaitForSingleObject(output_thread_handle, INFINITE);
+	CloseHandle(output_thread_handle);
 
-	// close threads
-	for(i = 0; i < MAX_CHANNELS; i++){
-		if(channels[i].state){
-			CloseHandle(channel_threads[i].thread_handle);
-		}
+	capture_join();
+
+	if (logpath != NULL) {
+		writer_close(&writer);
 	}
 
-	CloseHandle(output_thread_handle);
+	// a lossy capture must not go unnoticed, the counters are final now
+	print_channel_stats(stderr);
+	capture_stop();
 
-    kv_cleanup_channels();
-    destroy_queue(&log_q);
+	recorder_close(&recorder);
 
-	return EXIT_SUCCESS;
+	return writer.failed ? EXIT_FAILURE : EXIT_SUCCESS;
 
 err:
-    kv_cleanup_channels();
-    destroy_queue(&log_q);
+	capture_stop();
+	if (logpath != NULL) {
+		writer_close(&writer);
+	}
+	recorder_close(&recorder);
 
 	return EXIT_FAILURE;
 }
@@ -1,10 +1,5 @@
 #include "lib.h"
 
-#define LOG_TM_SIZE 21
-#define LOG_CH_SIZE 10
-#define LOG_FR_SIZE 256
-#define LOG_LN_SIZE (LOG_TM_SIZE + LOG_CH_SIZE + LOG_FR_SIZE)
-
 void print_usage_canplay(char *arg0, char *arg1)
 {
 	char prg[_MAX_FNAME];
@@ -13,13 +8,23 @@ void print_usage_canplay(char *arg0, char *arg1)
 	basename(arg0, prg, sizeof(prg));
 	cmd = arg1;
 
-	fprintf(stderr, "%s %s - replay a compact CAN frame logfile with Kvaser driver.\n\n", prg, cmd);
+	fprintf(stderr, "%s %s - replay a compact CAN frame logfile or binary capture with Kvaser driver.\n\n", prg, cmd);
 	fprintf(stderr, "Usage: %s %s [options] <channel> [<channel> ...]\n", prg, cmd);
 	fprintf(stderr, "Options:\n");
-	fprintf(stderr, "  -I <infile>                    (logfile to replay)\n");
+	fprintf(stderr, "  -I <infile>                    (logfile or binary capture (candump -o/-B) to replay, may be .zst)\n");
 	fprintf(stderr, "  -l <num>                       (process input file <num> times)\n");
 	fprintf(stderr, "                                 (use 'i' for infinite loop - default: 1)\n");
-	fprintf(stderr, "  -g <ms>                        (gap in milli seconds - default 1ms)\n");
+	fprintf(stderr, "  -x <factor>                    (replay <factor> times faster than recorded, e.g. 60 or 0.5\n");
+	fprintf(stderr, "                                 0 sends as fast as the bus accepts - default 1)\n");
+	fprintf(stderr, "  -s <us>                        (busy-wait the last <us> before each frame, 0 only sleeps\n");
+	fprintf(stderr, "                                 - default %dus)\n", SCHED_SPIN_DEFAULT);
+	fprintf(stderr, "  -R                             (run the per-channel transmit threads at real-time priority)\n");
+	fprintf(stderr, "  -j <threads>                   (threads parsing a text logfile - default: one per processor)\n");
+	fprintf(stderr, "  --start <sec>                  (replay from <sec> after the first frame of the logfile, e.g. 8220.5\n");
+	fprintf(stderr, "                                 jumps there directly with the index of kv index or candump -i)\n");
+	fprintf(stderr, "  --end <sec>                    (replay up to <sec> after the first frame of the logfile)\n");
+	fprintf(stderr, "  --max-load <percent>           (delay frames so that each channel's bus load stays below <percent>,\n");
+	fprintf(stderr, "                                 from the exact bit time of each frame)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Format of <channel>: <channel-num>{f|F}{_}{b|B<bitrate>}{d|D<data-bitrate>}\n");
 	fprintf(stderr, "  examples:\n");
@@ -27,49 +32,173 @@ void print_usage_canplay(char *arg0, char *arg1)
 	fprintf(stderr, "    0F                           (channel 0, CAN-FD)\n");
 	fprintf(stderr, "    0_b500K                      (channel 0, CAN-CC, bitrate 500K)\n");
 	fprintf(stderr, "    0Fb500Kd2M                   (channel 0, CAN-FD, arbitration bitrate 500K, data bitrate 2M)\n");
+	fprintf(stderr, "    sock:vcan0                   (SocketCAN interface vcan0 on the lowest free channel, Linux only)\n");
+	fprintf(stderr, "    sim:a/l40                    (simulated bus a with 40%% synthetic load, no hardware needed)\n");
 }
 
-int timeval_cmp(struct timeval *tv1, struct timeval *tv2){
-	if(tv1->tv_sec < tv2->tv_sec){
-		return -1;
-	}
-	else if(tv1->tv_sec > tv2->tv_sec){
-		return 1;
+#define REPLAY_START_LEAD 10000  // us from the last worker being ready to the first frame
+#define REPLAY_BATCH 64
+#define REPLAY_FLUSH_TIMEOUT 1000
+
+// Start barrier and time base shared by the transmit workers
+typedef struct {
+	CRITICAL_SECTION mutex;
+	CONDITION_VARIABLE cond;
+	int ready;
+	uint64_t start;         // 0 until every worker is ready
+} replay_sync;
+
+typedef struct {
+	replay_plan plan;       // frames of this channel only
+	replay_sync *sync;
+	int channel;
+	int count;
+	uint64_t period;        // us from the first to the last frame of the whole log
+	double speed;           // log time per real time, 0 for as fast as the bus takes it
+	double max_load;        // percent, 0 for no limit
+	uint64_t paced;         // ns, the bus budget allows the next frame from here
+	uint64_t spin;
+	int realtime;
+	uint64_t frames;
+	uint64_t unsent;        // not acknowledged in time (kv_send came back short)
+	int failed;             // kv_send failed, the worker gave up
+	uint64_t bus_time;      // ns the sent frames occupy the bus
+	uint64_t elapsed;       // us from the start to the last acknowledgement
+	histogram error;        // send time - (warped) log time, us
+	HANDLE thread;
+} replay_param;
+
+// Send time of a frame time us into the log, the log runs at speed times real time.
+static uint64_t replay_deadline(replay_param *rp, uint64_t start, uint64_t time){
+	uint64_t deadline;
+
+	deadline = rp->speed > 0 ? start + (rp->speed == 1.0 ? time : (uint64_t)((double)time / rp->speed)) : start;
+
+	// not before the previous frames took their share of the bus
+	if(rp->max_load > 0 && rp->paced / 1000 > deadline){
+		deadline = rp->paced / 1000;
 	}
 
-	return tv1->tv_usec - tv2->tv_usec;
+	return deadline;
 }
 
-void timeval_diff(struct timeval *tv1, struct timeval *tv2, struct timeval *diff){
-	diff->tv_sec = tv2->tv_sec - tv1->tv_sec;
-	diff->tv_usec = tv2->tv_usec - tv1->tv_usec;
-}
+/**
+ * Transmit worker of one channel: replay its frames count times (forever
+ * when negative), each at its deadline on the common time base. A full
+ * TX queue only delays this channel, loop n of every channel starts at
+ * start + n * period. Frames already due when the worker wakes up are
+ * queued together with kv_send. At speed 0 there are no deadlines, the
+ * frames go out as fast as kv_send takes them. With max_load a frame also
+ * waits until the frames before it, stretched by 100 / max_load, would
+ * have left the bus. Only frames kv_send took are counted, the worker
+ * stops when the channel fails.
+ *
+ */
+DWORD WINAPI canplay_replay(LPVOID param){
+	replay_param *rp = (replay_param *)param;
+	replay_sync *sync = rp->sync;
+	sched_timer timer;
+	replay_cursor cur;
+	can_channel *ch;
+	can_frame frame, batch[REPLAY_BATCH];
+	uint64_t times[REPLAY_BATCH], errors[REPLAY_BATCH];
+	uint64_t start, base, deadline, now;
+	int i, k, n, ret, sent, channel, timed;
+
+	if(rp->realtime && sched_set_realtime() != 0){
+		fprintf(stderr, "cannot raise the channel %d thread to real-time priority, continuing without\n", rp->channel);
+	}
 
-void timeval_add(struct timeval *tv1, struct timeval *tv2){
-	tv1->tv_sec += tv2->tv_sec;
-	tv1->tv_usec += tv2->tv_usec;
+	sched_timer_init(&timer, rp->spin);
 
-	if(tv1->tv_usec < 0){
-		tv1->tv_sec -= 1;
-		tv1->tv_usec += 1000000L;
+	EnterCriticalSection(&sync->mutex);
+	sync->ready++;
+	WakeAllConditionVariable(&sync->cond);
+	while(sync->start == 0){
+		SleepConditionVariableCS(&sync->cond, &sync->mutex, INFINITE);
 	}
+	start = sync->start;
+	LeaveCriticalSection(&sync->mutex);
+
+	ch = &channels[rp->channel];
+	timed = rp->speed > 0 || rp->max_load > 0;
+	rp->paced = start * 1000;
+	deadline = start;
+	now = sched_wait_until(&timer, start);
+
+	for(i = 0; (rp->count < 0 || i < rp->count) && !stop_flag && !rp->failed; i++){
+		replay_rewind(&cur);
+		base = (uint64_t)i * rp->period;
+		ret = replay_next(&rp->plan, &cur, &channel, &frame);
+
+		while(ret == 0){
+			if(timed){
+				now = sched_wait_until(&timer, replay_deadline(rp, start, base + cur.time));
+			}
+			if(stop_flag){
+				break;
+			}
 
-	if(tv1->tv_usec >= 1000000L){
-		tv1->tv_sec += 1;
-		tv1->tv_usec -= 1000000L;
+			// everything due by now in one write
+			n = 0;
+			while(ret == 0 && n < REPLAY_BATCH){
+				if(timed){
+					deadline = replay_deadline(rp, start, base + cur.time);
+					if(deadline > now){
+						break;
+					}
+					errors[n] = now - deadline;
+				}
+				memcpy(&batch[n], &frame, sizeof(can_frame));
+				times[n] = can_frame_time(&frame, ch->bitrate, ch->data_bitrate);
+				if(rp->max_load > 0){
+					if(deadline * 1000 > rp->paced){
+						rp->paced = deadline * 1000;
+					}
+					rp->paced += (uint64_t)(times[n] * 100.0 / rp->max_load);
+				}
+				n++;
+				ret = replay_next(&rp->plan, &cur, &channel, &frame);
+			}
+
+			sent = kv_send(rp->channel, batch, n);
+			if(sent < 0){
+				fprintf(stderr, "channel %d: sending failed, stopping its replay\n", rp->channel);
+				rp->failed = 1;
+				rp->unsent += n;
+				break;
+			}
+
+			// the rest of a short batch was not acknowledged in time and is lost
+			for(k = 0; k < sent; k++){
+				rp->bus_time += times[k];
+				if(timed){
+					hist_record(&rp->error, errors[k]);
+				}
+			}
+			rp->frames += sent;
+			rp->unsent += n - sent;
+		}
 	}
+
+	kv_flush(rp->channel, REPLAY_FLUSH_TIMEOUT);
+	rp->elapsed = get_monotonic_time() - start;
+
+	sched_timer_close(&timer);
+
+	return 0;
 }
 
 int canplay(int argc, char *argv[]){
-	int i, channel_num, count, gap, eof;
-	long sec, usec;
-	char buf[LOG_LN_SIZE], frbuf[LOG_FR_SIZE];
+	int i, ret, channel_num, count, realtime, workers, threads;
+	uint64_t spin, frames, elapsed, window_start, window_end;
+	double speed, sec, max_load;
 	char *filepath;
-	char *fret;
-	FILE *infile;
-	can_frame cf;
+	replay_plan plan, split[MAX_CHANNELS];
+	replay_param rp[MAX_CHANNELS];
+	replay_sync sync;
+	histogram error;
 	can_channel ch;
-	struct timeval base_tv, log_tv, diff_tv;
 
 	if(argc <= 2){
 		print_usage_canplay(argv[0], argv[1]);
@@ -77,8 +206,15 @@ int canplay(int argc, char *argv[]){
 	}
 
 	count = 1;	// infinite when a negative number
-	gap = 1;
+	spin = SCHED_SPIN_DEFAULT;
+	realtime = 0;
+	threads = 0;
+	window_start = 0;
+	window_end = 0;
+	speed = 1.0;
+	max_load = 0;
 	channel_num = -1;
+	filepath = NULL;
 
 	kv_initialize();
 
@@ -120,11 +256,92 @@ int canplay(int argc, char *argv[]){
 				return EXIT_FAILURE;
 			}
 
+			// frames are sent at their own time now, accepted for existing scripts
+			i++;
+		}
+		else if(strcmp(argv[i], "-s") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing spin value after %s\n\n", argv[i]);
+				print_usage_canplay(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			if(atoi(argv[i]) < 0){
+				fprintf(stderr, "Invalid spin value: %s\n\n", argv[i]);
+				print_usage_canplay(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+			spin = (uint64_t)atoi(argv[i]);
+		}
+		else if(strcmp(argv[i], "-x") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing factor value after %s\n\n", argv[i]);
+				print_usage_canplay(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			speed = atof(argv[i]);
+
+			if (speed < 0 || (speed == 0 && argv[i][0] != '0')) {
+				fprintf(stderr, "Invalid factor value: %s\n\n", argv[i]);
+				print_usage_canplay(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "-R") == 0){
+			realtime = 1;
+		}
+		else if(strcmp(argv[i], "-j") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing threads value after %s\n\n", argv[i]);
+				print_usage_canplay(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
 			i++;
-			gap = atoi(argv[i]);
+			threads = atoi(argv[i]);
 
-			if (gap < 0) {
-				fprintf(stderr, "Invalid gap value: %s\n\n", argv[i]);
+			if (threads <= 0 || threads > PARSE_MAX_THREADS) {
+				fprintf(stderr, "Invalid threads value: %s\n\n", argv[i]);
+				print_usage_canplay(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "--start") == 0 || strcmp(argv[i], "--end") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing sec value after %s\n\n", argv[i]);
+				print_usage_canplay(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			sec = atof(argv[i]);
+
+			if (sec < 0 || (sec == 0 && argv[i][0] != '0')) {
+				fprintf(stderr, "Invalid sec value: %s\n\n", argv[i]);
+				print_usage_canplay(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+			if(argv[i - 1][2] == 's'){
+				window_start = (uint64_t)(sec * 1000000.0);
+			}else{
+				window_end = (uint64_t)(sec * 1000000.0);
+			}
+		}
+		else if(strcmp(argv[i], "--max-load") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing percent value after %s\n\n", argv[i]);
+				print_usage_canplay(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			max_load = atof(argv[i]);
+
+			if (max_load <= 0 || max_load > 100) {
+				fprintf(stderr, "Invalid percent value: %s\n\n", argv[i]);
 				print_usage_canplay(argv[0], argv[1]);
 				return EXIT_FAILURE;
 			}
@@ -139,86 +356,144 @@ int canplay(int argc, char *argv[]){
 			ch.data_bitrate = CANFD_DATA_BITRATE_DEFAULT;
 			ch.state = 0;
 			channel_num = parse_canchannel(argv[i], &ch);
-			if(channel_num >= MAX_CHANNELS){
+			if(channel_num < 0 || channel_num >= MAX_CHANNELS){
 				fprintf(stderr, "Invalid channel value: %d\n\n", channel_num);
+				kv_cleanup_channels();
+				return EXIT_FAILURE;
+			}
+			if(kv_setup_channel(channel_num, &ch) != 0){
+				kv_cleanup_channels();
 				return EXIT_FAILURE;
 			}
-			kv_setup_channel(channel_num, &ch);
 		}
 	}
 
-	i = 0;
-	eof = 0;
-
-	if(fopen_s(&infile, filepath,"r") != 0){
-		fprintf(stderr, "cannot open: %s\n", filepath);
-		return 1;
+	if(filepath == NULL){
+		fprintf(stderr, "Error: Missing infile (-I)\n\n");
+		print_usage_canplay(argv[0], argv[1]);
+		kv_cleanup_channels();
+		return EXIT_FAILURE;
 	}
 
-	while(count < 0 || (i++ < count)){
-		// skip until first non-comment line
-		while ((fret = fgets(buf, 1024 - 1, infile)) != NULL && buf[0] != '(') {
-		}
-
-		if(!fret){
-			// nothing to read
-			return EXIT_SUCCESS;
-		}
-
-		if (sscanf_s(buf, "(%ld.%ld) %d %255s", &sec, &usec, &channel_num, frbuf, LOG_FR_SIZE-1) != 4) {
-			fprintf(stderr, "incorrect line format in logfile\n");
-			return 1;
-		}
-
-		log_tv.tv_sec = sec;
-		log_tv.tv_usec = usec;
-
-		gettimeofday(&base_tv);
-		timeval_diff(&base_tv, &log_tv, &diff_tv);
-		timeval_add(&base_tv, &diff_tv);
-
-		while(!eof){
-			while(timeval_cmp(&base_tv, &log_tv) >= 0){
-				parse_canframe(frbuf, &cf);
-				kv_write(channel_num, &cf);
+	if(window_end > 0 && window_end <= window_start){
+		fprintf(stderr, "Error: --end must be after --start\n\n");
+		print_usage_canplay(argv[0], argv[1]);
+		kv_cleanup_channels();
+		return EXIT_FAILURE;
+	}
 
-				// skip until next non-comment line
-				while ((fret = fgets(buf, 1024 - 1, infile)) != NULL && buf[0] != '(') {
-				}
+	// parse everything up front, replay only walks memory
+	if(replay_plan_load(&plan, filepath, threads, window_start, window_end) != 0){
+		kv_cleanup_channels();
+		return 1;
+	}
 
-				if(!fret){
-					eof = 1;
-					break;
-				}
+	ret = EXIT_SUCCESS;
 
-				if (sscanf_s(buf, "(%ld.%ld) %d %255s", &sec, &usec, &channel_num, frbuf, LOG_FR_SIZE-1) != 4) {
-					fprintf(stderr, "incorrect line format in logfile\n");
-					return 1;
-				}
+	// one transmit worker per channel
+	if(replay_plan_split(&plan, split) != 0){
+		fprintf(stderr, "out of memory\n");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
 
-				log_tv.tv_sec = sec;
-				log_tv.tv_usec = usec;
+	memset(rp, '\0', sizeof(rp));
+	for(i = 0; i < MAX_CHANNELS; i++){
+		rp[i].plan = split[i];
+		rp[i].sync = &sync;
+		rp[i].channel = i;
+		rp[i].count = count;
+		rp[i].period = plan.duration;
+		rp[i].speed = speed;
+		rp[i].max_load = max_load;
+		rp[i].spin = spin;
+		rp[i].realtime = realtime;
+		hist_init(&rp[i].error);
+	}
+	replay_plan_free(&plan);
 
-				if(stop_flag){
-					goto out;
-				}
+	InitializeCriticalSection(&sync.mutex);
+	InitializeConditionVariable(&sync.cond);
+	sync.ready = 0;
+	sync.start = 0;
+	workers = 0;
 
-			} // while(timeval_cmp(&base_tv, &log_tv) > 0)
+	for(i = 0; i < MAX_CHANNELS && !stop_flag; i++){
+		if(rp[i].plan.frames == 0){
+			continue;
+		}
+		if(!channels[i].state){
+			fprintf(stderr, "channel %d is not opened, skipping its %llu frames\n", i, (unsigned long long)rp[i].plan.frames);
+			continue;
+		}
 
-			Sleep(gap);
+		rp[i].thread = CreateThread(NULL, 0, canplay_replay, &rp[i], 0, NULL);
+		if(rp[i].thread == NULL){
+			fprintf(stderr, "Failed to create thread for channel %d\n", i);
+			stop_flag = 1;
+			break;
+		}
+		workers++;
+	}
 
-			gettimeofday(&base_tv);
-			timeval_add(&base_tv, &diff_tv);
+	// start all together once every worker is ready
+	EnterCriticalSection(&sync.mutex);
+	while(sync.ready < workers && !stop_flag){
+		SleepConditionVariableCS(&sync.cond, &sync.mutex, 100);
+	}
+	sync.start = get_monotonic_time() + REPLAY_START_LEAD;
+	WakeAllConditionVariable(&sync.cond);
+	LeaveCriticalSection(&sync.mutex);
+
+	frames = 0;
+	elapsed = 0;
+	hist_init(&error);
+
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(rp[i].thread){
+			WaitForSingleObject(rp[i].thread, INFINITE);
+			CloseHandle(rp[i].thread);
+			frames += rp[i].frames;
+			if(rp[i].elapsed > elapsed){
+				elapsed = rp[i].elapsed;
+			}
+			hist_merge(&error, &rp[i].error);
+			if(rp[i].failed){
+				ret = EXIT_FAILURE;
+			}
+		}
+		replay_plan_free(&rp[i].plan);
+	}
 
-		} // while(!eof)
+	DeleteCriticalSection(&sync.mutex);
 
-		rewind(infile);
-		eof = 0;
+	fprintf(stderr, "%llu frames sent in %.3fs, %.0f frames/s\n", (unsigned long long)frames,
+		elapsed / 1e6, elapsed ? frames * 1e6 / elapsed : 0.0);
+	if(speed > 0 || max_load > 0){
+		fprintf(stderr, "send time error against the %s (us):\n", max_load > 0 ? "schedule" : "log");
+		hist_print(stderr, &error, "us");
+	}
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(rp[i].frames == 0 && rp[i].unsent == 0){
+			continue;
+		}
 
-	} // while(count < 0 || (++i < count))
+		fprintf(stderr, "  channel %d: %llu frames, %.0f frames/s, bus load %.1f%%", i, (unsigned long long)rp[i].frames,
+			rp[i].elapsed ? rp[i].frames * 1e6 / rp[i].elapsed : 0.0,
+			rp[i].elapsed ? rp[i].bus_time / 10.0 / rp[i].elapsed : 0.0);
+		if(speed > 0 || max_load > 0){
+			fprintf(stderr, ", p99 %lluus, max %lluus", (unsigned long long)hist_percentile(&rp[i].error, 99.0),
+				(unsigned long long)rp[i].error.max);
+		}
+		if(rp[i].unsent){
+			fprintf(stderr, ", %llu not sent", (unsigned long long)rp[i].unsent);
+		}
+		fprintf(stderr, "\n");
+	}
 
 out:
+	replay_plan_free(&plan);
 	kv_cleanup_channels();
 
-	return EXIT_SUCCESS;
+	return ret;
 }
@@ -24,6 +24,8 @@ void print_usage_cansend(char *arg0, char *arg1)
 	fprintf(stderr, "    0F                           (channel 0, CAN-FD)\n");
 	fprintf(stderr, "    0_b500K                      (channel 0, CAN-CC, bitrate 500K)\n");
 	fprintf(stderr, "    0Fb500Kd2M                   (channel 0, CAN-FD, arbitration bitrate 500K, data bitrate 2M)\n");
+	fprintf(stderr, "    sock:vcan0                   (SocketCAN interface vcan0 on the lowest free channel, Linux only)\n");
+	fprintf(stderr, "    sim:a/l40                    (simulated bus a with 40%% synthetic load, no hardware needed)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Format of <can-frame>: <can-id>#{#}{<flag>}<data>\n");
 	fprintf(stderr, "  examples:\n");
@@ -132,7 +134,7 @@ int cansend(int argc, char *argv[]){
 		else{
 			if(channel_num < 0){
 				channel_num = parse_canchannel(argv[i], &ch);
-				if(channel_num >= MAX_CHANNELS){
+				if(channel_num < 0 || channel_num >= MAX_CHANNELS){
 					fprintf(stderr, "Invalid channel value: %d\n\n", channel_num);
 					return EXIT_FAILURE;
 				}
@@ -147,19 +149,22 @@ int cansend(int argc, char *argv[]){
 	pp_canframe(&cf);
 
 	kv_initialize();
-	kv_setup_channel(channel_num, &ch);
+	if(kv_setup_channel(channel_num, &ch) != 0){
+		return EXIT_FAILURE;
+	}
 
 	i = 0;
 	if(!repeat){
 		count = 1;
 	}
 
-	kv_write(channel_num, &cf);
+	kv_send(channel_num, &cf, 1);
 	while(!stop_flag && (count < 0 || (++i < count))){
 		Sleep(gap);
-		kv_write(channel_num, &cf);
+		kv_send(channel_num, &cf, 1);
 	}
 
+	kv_flush(channel_num, 1000);
 	kv_close_channel(channel_num);
 
 	return EXIT_SUCCESS;
@@ -0,0 +1,100 @@
+#include "lib.h"
+
+/**
+ * Device clock correlation
+ *
+ * The driver hands out 32-bit microsecond timestamps, which wrap after
+ * about 71 minutes. clock_extend widens them to 64 bits with serial
+ * number arithmetic, so timestamps slightly older than the newest one
+ * seen (e.g. a frame read after a timer sample) are extended correctly.
+ *
+ * clock_sample collects pairs of device time and host monotonic time,
+ * the host time taken as the midpoint around the device clock readout.
+ * Readouts that took much longer than the fastest one are dropped. A
+ * least squares line over the last CLOCK_SAMPLES pairs maps device time
+ * to host time, correcting both offset and drift.
+ *
+ */
+#define CLOCK_RTT_SLACK 50
+
+void clock_init(device_clock *c){
+	memset(c, '\0', sizeof(device_clock));
+	c->slope = 1.0;
+	c->min_rtt = UINT64_MAX;
+}
+
+uint64_t clock_extend(device_clock *c, uint32_t raw){
+	int32_t diff;
+
+	if(!c->started){
+		c->started = 1;
+		c->last = raw;
+		return raw;
+	}
+
+	diff = (int32_t)(raw - (uint32_t)c->last);
+	if(diff > 0){
+		c->last += diff;
+		return c->last;
+	}
+
+	// older than the newest one, but not from before the first
+	return c->last >= (uint64_t)(-(int64_t)diff) ? c->last + diff : 0;
+}
+
+void clock_sample(device_clock *c, uint64_t dev, uint64_t before, uint64_t after){
+	uint64_t rtt = after - before;
+	double sum_d, sum_h, sum_dd, sum_dh, d, h, n;
+	int i, idx, first;
+
+	if(rtt < c->min_rtt){
+		c->min_rtt = rtt;
+	}
+	if(rtt > 2 * c->min_rtt + CLOCK_RTT_SLACK){
+		// preempted or a slow bus round trip
+		return;
+	}
+
+	c->dev[c->next] = dev;
+	c->host[c->next] = before + rtt / 2;
+	c->next = (c->next + 1) % CLOCK_SAMPLES;
+	if(c->num < CLOCK_SAMPLES){
+		c->num++;
+	}
+
+	// relative to the oldest pair to keep the sums small
+	first = (c->next + CLOCK_SAMPLES - c->num) % CLOCK_SAMPLES;
+	c->dev_ref = c->dev[first];
+	c->host_ref = c->host[first];
+
+	sum_d = sum_h = sum_dd = sum_dh = 0;
+	for(i = 0; i < c->num; i++){
+		idx = (first + i) % CLOCK_SAMPLES;
+		d = (double)(int64_t)(c->dev[idx] - c->dev_ref);
+		h = (double)(int64_t)(c->host[idx] - c->host_ref);
+		sum_d += d;
+		sum_h += h;
+		sum_dd += d * d;
+		sum_dh += d * h;
+	}
+
+	n = c->num;
+	c->mean_dev = sum_d / n;
+	c->mean_host = sum_h / n;
+	if(c->num > 1 && sum_dd - sum_d * c->mean_dev > 0){
+		c->slope = (sum_dh - sum_d * c->mean_host) / (sum_dd - sum_d * c->mean_dev);
+	}
+}
+
+// Host monotonic time of a device timestamp, the device time unchanged without samples.
+uint64_t clock_to_host(device_clock *c, uint64_t dev){
+	double d;
+
+	if(c->num == 0){
+		return dev;
+	}
+
+	d = (double)(int64_t)(dev - c->dev_ref) - c->mean_dev;
+
+	return c->host_ref + (uint64_t)(int64_t)(c->mean_host + c->slope * d + 0.5);
+}
@@ -0,0 +1,393 @@
+#include "lib.h"
+
+/**
+ * Cyclic message scheduler
+ *
+ * Sends a table of periodic frames, each with its own period and phase,
+ * from one thread. A binary min-heap orders the messages by their next
+ * send time: the thread waits for the earliest (sched.c), takes every
+ * message due by then off the top and sends them in one kv_send. A
+ * message that missed whole periods (bus saturated) skips them instead
+ * of bursting.
+ *
+ */
+#define CYCLIC_BATCH 64
+#define CYCLIC_LEAD 10000       // us from setup to the first send
+
+typedef struct {
+	can_frame frame;
+	uint64_t period;        // us
+	uint64_t next;          // us after start
+	uint64_t sent;
+	uint64_t missed;
+} cyclic_msg;
+
+typedef struct {
+	cyclic_msg *msgs;
+	int num;
+	int max;
+	int *heap;              // indices into msgs, earliest next first
+} cyclic_table;
+
+void print_usage_cancyclic(char *arg0, char *arg1)
+{
+	char prg[_MAX_FNAME];
+	char *cmd;
+
+	basename(arg0, prg, sizeof(prg));
+	cmd = arg1;
+
+	fprintf(stderr, "%s %s - send periodic CAN frames with Kvaser driver.\n\n", prg, cmd);
+	fprintf(stderr, "Usage: %s %s [options] <channel> [<message> ...]\n", prg, cmd);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -T <file>                      (read messages from <file>, one per line, '#' starts a comment line)\n");
+	fprintf(stderr, "  -t <sec>                       (stop after <sec> seconds - default: until Ctrl+C)\n");
+	fprintf(stderr, "  -s <us>                        (busy-wait the last <us> before each send - default %dus)\n", SCHED_SPIN_DEFAULT);
+	fprintf(stderr, "  -R                             (run at real-time priority)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Format of <message>: <can-frame>@<period-ms>{+<phase-ms>}\n");
+	fprintf(stderr, "  examples:\n");
+	fprintf(stderr, "    123#1122334455667788@10      (can-id 0x123 every 10ms)\n");
+	fprintf(stderr, "    18FEF100#FF00@100+25         (29-bit can-id 0x18FEF100 every 100ms, 25ms after the start)\n");
+	fprintf(stderr, "    7E0##10011@2.5               (CAN-FD with BRS every 2.5ms)\n");
+}
+
+static void cyclic_swap(cyclic_table *t, int a, int b){
+	int tmp = t->heap[a];
+
+	t->heap[a] = t->heap[b];
+	t->heap[b] = tmp;
+}
+
+static int cyclic_before(cyclic_table *t, int a, int b){
+	return t->msgs[t->heap[a]].next < t->msgs[t->heap[b]].next;
+}
+
+// Restore the heap after the top message got a later next time.
+static void cyclic_sift_down(cyclic_table *t, int i){
+	int child;
+
+	for(;;){
+		child = 2 * i + 1;
+		if(child >= t->num){
+			break;
+		}
+		if(child + 1 < t->num && cyclic_before(t, child + 1, child)){
+			child++;
+		}
+		if(!cyclic_before(t, child, i)){
+			break;
+		}
+		cyclic_swap(t, i, child);
+		i = child;
+	}
+}
+
+// Add "<can-frame>@<period-ms>{+<phase-ms>}", returns 0 or -1.
+static int cyclic_add(cyclic_table *t, char *spec){
+	cyclic_msg *msgs, *m;
+	char *at, *plus;
+	double period, phase = 0;
+
+	at = strrchr(spec, '@');
+	if(at == NULL){
+		fprintf(stderr, "Missing period in message: %s\n", spec);
+		return -1;
+	}
+
+	period = atof(at + 1);
+	plus = strchr(at + 1, '+');
+	if(plus != NULL){
+		phase = atof(plus + 1);
+	}
+	if(period <= 0 || phase < 0){
+		fprintf(stderr, "Invalid period in message: %s\n", spec);
+		return -1;
+	}
+
+	if(t->num == t->max){
+		t->max = t->max ? t->max * 2 : 64;
+		msgs = (cyclic_msg*)realloc(t->msgs, t->max * sizeof(cyclic_msg));
+		if(msgs == NULL){
+			fprintf(stderr, "out of memory\n");
+			return -1;
+		}
+		t->msgs = msgs;
+	}
+
+	m = &t->msgs[t->num];
+	memset(m, '\0', sizeof(cyclic_msg));
+
+	*at = '\0';
+	if(!parse_canframe(spec, &m->frame)){
+		fprintf(stderr, "Invalid can-frame in message: %s\n", spec);
+		*at = '@';
+		return -1;
+	}
+	*at = '@';
+
+	m->period = (uint64_t)(period * 1000.0);
+	m->next = (uint64_t)(phase * 1000.0);
+	if(m->period == 0){
+		m->period = 1;
+	}
+	t->num++;
+
+	return 0;
+}
+
+// Messages of a table file, returns 0 or -1.
+static int cyclic_load(cyclic_table *t, const char *path){
+	char line[LOG_LINE_MAX];
+	FILE *fp;
+	size_t len;
+	int ret = 0, lineno = 0;
+
+	if(fopen_s(&fp, path, "r") != 0){
+		fprintf(stderr, "cannot open: %s\n", path);
+		return -1;
+	}
+
+	while(ret == 0 && fgets(line, sizeof(line), fp) != NULL){
+		lineno++;
+
+		len = strcspn(line, " \t\r\n");
+		line[len] = '\0';
+		if(len == 0 || line[0] == '#'){
+			continue;
+		}
+
+		ret = cyclic_add(t, line);
+		if(ret != 0){
+			fprintf(stderr, "%s:%d: bad message\n", path, lineno);
+		}
+	}
+
+	fclose(fp);
+
+	return ret;
+}
+
+int cancyclic(int argc, char *argv[]){
+	int i, n, ret, channel_num, realtime, failed;
+	uint64_t spin, duration, start, now, deadline, sent, unsent, missed, bus_time;
+	can_frame batch[CYCLIC_BATCH];
+	uint64_t errors[CYCLIC_BATCH];
+	int owners[CYCLIC_BATCH];   // message of each batch frame
+	cyclic_table table;
+	cyclic_msg *m;
+	histogram error;
+	sched_timer timer;
+	can_channel ch = {
+		.fd = 0,
+		.bitrate = CAN_BITRATE_DEFAULT,
+		.data_bitrate = CANFD_DATA_BITRATE_DEFAULT,
+		.state = 0
+	};
+	can_channel *chp;
+
+	if(argc <= 2){
+		print_usage_cancyclic(argv[0], argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	memset(&table, '\0', sizeof(table));
+	duration = 0;
+	spin = SCHED_SPIN_DEFAULT;
+	realtime = 0;
+	channel_num = -1;
+	ret = 0;
+
+	for(i = 2; i < argc && ret == 0; i++){
+		if(strcmp(argv[i], "-T") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing file value after %s\n\n", argv[i]);
+				print_usage_cancyclic(argv[0], argv[1]);
+				ret = -1;
+				break;
+			}
+
+			i++;
+			ret = cyclic_load(&table, argv[i]);
+		}
+		else if(strcmp(argv[i], "-t") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing sec value after %s\n\n", argv[i]);
+				print_usage_cancyclic(argv[0], argv[1]);
+				ret = -1;
+				break;
+			}
+
+			i++;
+			if (atof(argv[i]) <= 0) {
+				fprintf(stderr, "Invalid sec value: %s\n\n", argv[i]);
+				print_usage_cancyclic(argv[0], argv[1]);
+				ret = -1;
+				break;
+			}
+			duration = (uint64_t)(atof(argv[i]) * 1000000.0);
+		}
+		else if(strcmp(argv[i], "-s") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing spin value after %s\n\n", argv[i]);
+				print_usage_cancyclic(argv[0], argv[1]);
+				ret = -1;
+				break;
+			}
+
+			i++;
+			if(atoi(argv[i]) < 0){
+				fprintf(stderr, "Invalid spin value: %s\n\n", argv[i]);
+				print_usage_cancyclic(argv[0], argv[1]);
+				ret = -1;
+				break;
+			}
+			spin = (uint64_t)atoi(argv[i]);
+		}
+		else if(strcmp(argv[i], "-R") == 0){
+			realtime = 1;
+		}
+		else if(strcmp(argv[i], "help") == 0){
+			print_usage_cancyclic(argv[0], argv[1]);
+			ret = -1;
+		}
+		else if(channel_num < 0){
+			channel_num = parse_canchannel(argv[i], &ch);
+			if(channel_num < 0 || channel_num >= MAX_CHANNELS){
+				fprintf(stderr, "Invalid channel value: %d\n\n", channel_num);
+				ret = -1;
+			}
+		}
+		else{
+			ret = cyclic_add(&table, argv[i]);
+		}
+	}
+
+	if(ret == 0 && (channel_num < 0 || table.num == 0)){
+		fprintf(stderr, "Error: Missing %s\n\n", channel_num < 0 ? "channel" : "messages");
+		print_usage_cancyclic(argv[0], argv[1]);
+		ret = -1;
+	}
+
+	for(i = 0; ret == 0 && i < table.num; i++){
+		if((table.msgs[i].frame.flag & canFDMSG_FDF) && !ch.fd){
+			fprintf(stderr, "Error: CAN-FD frames need a CAN-FD channel (e.g. 0F)\n\n");
+			ret = -1;
+		}
+	}
+
+	if(ret == 0){
+		table.heap = (int*)malloc(table.num * sizeof(int));
+		if(table.heap == NULL){
+			fprintf(stderr, "out of memory\n");
+			ret = -1;
+		}
+	}
+
+	kv_initialize();
+	if(ret != 0 || kv_setup_channel(channel_num, &ch) != 0){
+		free(table.msgs);
+		free(table.heap);
+		return EXIT_FAILURE;
+	}
+	chp = &channels[channel_num];
+
+	// all messages at their phase, heapify bottom up
+	for(i = 0; i < table.num; i++){
+		table.heap[i] = i;
+	}
+	for(i = table.num / 2 - 1; i >= 0; i--){
+		cyclic_sift_down(&table, i);
+	}
+
+	sched_timer_init(&timer, spin);
+	if(realtime && sched_set_realtime() != 0){
+		fprintf(stderr, "cannot raise the thread priority, running at normal priority\n");
+	}
+
+	printf("%d messages on channel %d\n", table.num, channel_num);
+	fflush(stdout);
+
+	hist_init(&error);
+	sent = unsent = missed = bus_time = 0;
+	failed = 0;
+	start = get_monotonic_time() + CYCLIC_LEAD;
+
+	while(!stop_flag){
+		deadline = start + table.msgs[table.heap[0]].next;
+		if(duration && deadline >= start + duration){
+			break;
+		}
+
+		now = sched_wait_until(&timer, deadline);
+		if(stop_flag){
+			break;
+		}
+
+		// every message due by now goes into one batch
+		n = 0;
+		while(n < CYCLIC_BATCH && start + table.msgs[table.heap[0]].next <= now){
+			m = &table.msgs[table.heap[0]];
+
+			errors[n] = now - (start + m->next);
+			owners[n] = table.heap[0];
+			memcpy(&batch[n++], &m->frame, sizeof(can_frame));
+
+			m->next += m->period;
+			while(start + m->next <= now){
+				m->next += m->period;
+				m->missed++;
+				missed++;
+			}
+			cyclic_sift_down(&table, 0);
+		}
+
+		ret = kv_send(channel_num, batch, n);
+		if(ret < 0){
+			fprintf(stderr, "channel %d: sending failed, stopping\n", channel_num);
+			failed = 1;
+			unsent += n;
+			break;
+		}
+		// the rest of a short batch was not acknowledged in time and is lost
+		for(i = 0; i < ret; i++){
+			bus_time += can_frame_time(&batch[i], chp->bitrate, chp->data_bitrate);
+			hist_record(&error, errors[i]);
+			table.msgs[owners[i]].sent++;
+		}
+		sent += ret;
+		unsent += n - ret;
+	}
+
+	kv_flush(channel_num, 1000);
+	now = get_monotonic_time();
+	sched_timer_close(&timer);
+
+	if(now > start){
+		printf("%llu frames sent in %.3fs, %.0f frames/s, bus load %.1f%%, %llu periods missed",
+			(unsigned long long)sent, (now - start) / 1000000.0, sent * 1000000.0 / (now - start),
+			bus_time / 10.0 / (now - start), (unsigned long long)missed);
+		if(unsent){
+			printf(", %llu frames not sent", (unsigned long long)unsent);
+		}
+		printf("\n");
+	}
+	printf("        ID  PERIOD ms        SENT      MISSED\n");
+	for(i = 0; i < table.num; i++){
+		m = &table.msgs[i];
+		printf("  %*s%0*X %10.3f  %10llu  %10llu\n",
+			(m->frame.flag & canMSG_EXT) ? 0 : 5, "",
+			(m->frame.flag & canMSG_EXT) ? 8 : 3, m->frame.id,
+			m->period / 1000.0,
+			(unsigned long long)m->sent,
+			(unsigned long long)m->missed);
+	}
+	printf("send time error against the schedule (us):\n");
+	hist_print(stdout, &error, "us");
+
+	kv_close_channel(channel_num);
+	free(table.msgs);
+	free(table.heap);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,334 @@
+#include "lib.h"
+
+/**
+ * Channel table and driver dispatch
+ *
+ * Every open channel has a driver, chosen by the prefix of the channel
+ * spec (parse_canchannel). A plain channel number is a Kvaser channel.
+ *
+ *  0F            Kvaser channel 0 (kvaser.c)
+ *  sock:vcan0    SocketCAN interface vcan0 (socketcan.c, Linux only)
+ *  sim:a         simulated bus a, no hardware needed (sim.c)
+ *
+ * The kv_* functions are the interface for the commands. They take the
+ * channel number, map device timestamps to host monotonic time and keep
+ * the Kvaser driver the default.
+ *
+ */
+#define KV_TIMEOUT 100
+#define KV_TX_WINDOW 64         // frames in flight per channel with kv_send
+#define KV_ACK_BATCH 64
+
+can_channel channels[MAX_CHANNELS];
+
+static const can_driver *drivers[] = {
+#ifdef HAVE_CANLIB
+	&kvaser_driver,
+#endif
+#ifdef HAVE_SOCKETCAN
+	&socketcan_driver,
+#endif
+	&sim_driver,
+	NULL
+};
+
+// Driver by name, the first len characters of name; "kv" is the default driver.
+const can_driver *kv_find_driver(const char *name, size_t len){
+	int i;
+
+	for(i = 0; drivers[i] != NULL; i++){
+		if(strlen(drivers[i]->name) == len && strncmp(drivers[i]->name, name, len) == 0){
+			return drivers[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Lowest channel number not in use, -1 if all are taken.
+int kv_free_channel(void){
+	int i;
+
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(!channels[i].state){
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+int kv_initialize(void){
+	memset(channels, '\0', sizeof(can_channel) * MAX_CHANNELS);
+	return 0;
+}
+
+void kv_close_channel(int channel_num){
+	can_channel *ch = &channels[channel_num];
+
+	if (ch->state) {
+		if(ch->driver->bus_off){
+			ch->driver->bus_off(ch);
+		}
+		ch->driver->close(ch);
+		ch->state = 0;
+	}
+}
+
+void kv_cleanup_channels(void) {
+    int i;
+
+    for (i = 0; i < MAX_CHANNELS; i++) {
+		kv_close_channel(i);
+    }
+}
+
+can_channel *kv_channel_info(int channel_num){
+	return &channels[channel_num];
+}
+
+// Start all channels as close together as possible.
+void kv_sync_bus_on(){
+	int i;
+	can_channel *ch;
+    for (i = 0; i < MAX_CHANNELS; i++) {
+		ch = &channels[i];
+		if(ch->state && ch->driver->bus_off)
+			ch->driver->bus_off(ch);
+    }
+    for (i = 0; i < MAX_CHANNELS; i++) {
+		ch = &channels[i];
+		if(ch->state)
+			ch->driver->bus_on(ch);
+    }
+}
+
+int kv_setup_channel(int channel_num, can_channel *ch_param){
+	can_channel *ch;
+
+	if(channel_num < 0 || channel_num >= MAX_CHANNELS){
+		fprintf(stderr, "Invalid channel value: %d\n", channel_num);
+		return -1;
+	}
+
+	ch = kv_channel_info(channel_num);
+	if(ch->state){
+		fprintf(stderr, "channel %d is already in use\n", channel_num);
+		return -1;
+	}
+
+	memcpy(ch, ch_param, sizeof(can_channel));
+	ch->channel = channel_num;
+	ch->tx_pending = 0;
+	clock_init(&ch->clock);
+
+	if(ch->driver == NULL){
+		ch->driver = kv_find_driver("kv", 2);
+		if(ch->driver == NULL){
+			fprintf(stderr, "Kvaser channels are not available in this build\n");
+			return -1;
+		}
+	}
+
+	if(ch->driver->open(ch) != 0){
+		return -1;
+	}
+
+	if(ch->driver->configure(ch) != 0 || ch->driver->bus_on(ch) != 0){
+		ch->driver->close(ch);
+		return -1;
+	}
+
+	ch->state = 1;
+
+    return 0;
+}
+
+int kv_write_batch(int channel_num, can_frame *frames, int n){
+    can_channel* ch = NULL;
+
+	ch = kv_channel_info(channel_num);
+
+	if (!ch->state){
+        fprintf(stderr, "channel %d is not opened yet\n", channel_num);
+        return -1;
+	}
+
+	return ch->driver->write_batch(ch, frames, n, KV_TIMEOUT);
+}
+
+int kv_write(int channel_num, can_frame *cf){
+	return kv_write_batch(channel_num, cf, 1) == 1 ? 0 : -1;
+}
+
+/**
+ * Queue frames for transmission without waiting for the bus. Waits only
+ * when KV_TX_WINDOW frames are in flight or the driver's TX buffer is
+ * full, until acknowledgements make room. Drivers without send write
+ * with write_batch.
+ * Returns the number of frames queued, less than n when no frame was
+ * acknowledged within KV_TIMEOUT, or -1.
+ *
+ * A channel that sends this way should not be read by anyone else:
+ * waiting for acknowledgements consumes the frames it receives.
+ *
+ */
+int kv_send(int channel_num, can_frame *frames, int n){
+	can_channel *ch = kv_channel_info(channel_num);
+	can_log acks[KV_ACK_BATCH];
+	int ret, room, sent = 0;
+
+	if (!ch->state){
+		fprintf(stderr, "channel %d is not opened yet\n", channel_num);
+		return -1;
+	}
+
+	if(ch->driver->send == NULL){
+		return ch->driver->write_batch(ch, frames, n, KV_TIMEOUT);
+	}
+
+	while(sent < n){
+		room = KV_TX_WINDOW - ch->tx_pending;
+		if(room > 0){
+			ret = ch->driver->send(ch, &frames[sent], n - sent < room ? n - sent : room);
+			if(ret < 0){
+				break;
+			}
+			ch->tx_pending += ret;
+			sent += ret;
+			if(ret > 0){
+				continue;
+			}
+		}
+
+		// back-pressure: window or TX buffer full
+		ret = kv_tx_acks(channel_num, acks, KV_ACK_BATCH, KV_TIMEOUT);
+		if(ret < 0){
+			break;
+		}
+		if(ret == 0){
+			fprintf(stderr, "channel %d: no TX acknowledgement in %dms\n", channel_num, KV_TIMEOUT);
+			// the frames in flight are lost (bus off) or were never acknowledged
+			ch->tx_pending = 0;
+			break;
+		}
+	}
+
+	return sent > 0 ? sent : -1;
+}
+
+/**
+ * Wait for acknowledgements of frames queued with kv_send, up to
+ * timeout ms for the first one. The acks are the sent frames with their
+ * time on the bus (host time), other received frames are dropped.
+ * Returns the number of acks, 0 on timeout or -1 on error.
+ *
+ */
+int kv_tx_acks(int channel_num, can_log *acks, int max, DWORD timeout){
+	can_channel *ch = kv_channel_info(channel_num);
+	uint64_t now, deadline;
+	int i, n, k;
+
+	now = get_monotonic_time();
+	deadline = now + (uint64_t)timeout * 1000;
+
+	for(;;){
+		n = ch->driver->read_batch(ch, acks, max, (DWORD)((deadline - now + 999) / 1000));
+		if(n < 0){
+			return -1;
+		}
+
+		for(i = 0, k = 0; i < n; i++){
+			if(acks[i].frame.flag & canMSG_TXACK){
+				memcpy(&acks[k], &acks[i], sizeof(can_log));
+				acks[k].channel = channel_num;
+				acks[k].timestamp = clock_to_host(&ch->clock, acks[k].timestamp);
+				k++;
+			}
+		}
+
+		if(k > 0){
+			ch->tx_pending = ch->tx_pending > k ? ch->tx_pending - k : 0;
+			return k;
+		}
+
+		now = get_monotonic_time();
+		if(now >= deadline){
+			return 0;
+		}
+	}
+}
+
+// Wait until every frame queued with kv_send is acknowledged, returns 0 or -1 on timeout.
+int kv_flush(int channel_num, DWORD timeout){
+	can_channel *ch = kv_channel_info(channel_num);
+	can_log acks[KV_ACK_BATCH];
+	uint64_t now, deadline;
+
+	now = get_monotonic_time();
+	deadline = now + (uint64_t)timeout * 1000;
+
+	while(ch->state && ch->tx_pending > 0){
+		if(now >= deadline || kv_tx_acks(channel_num, acks, KV_ACK_BATCH, (DWORD)((deadline - now + 999) / 1000)) < 0){
+			fprintf(stderr, "channel %d: %d frames not acknowledged\n", channel_num, ch->tx_pending);
+			ch->tx_pending = 0;
+			return -1;
+		}
+		now = get_monotonic_time();
+	}
+
+	return 0;
+}
+
+/**
+ * Wait until frames arrive on the channel, then read everything pending
+ * (up to max) into logs.
+ * Timestamps are host monotonic time (us) via the channel's clock mapping.
+ * Returns the number of frames, 0 on timeout or -1 on error.
+ *
+ */
+int kv_read_batch(int channel_num, can_log *logs, int max){
+    can_channel* ch = &channels[channel_num];
+	int i, n;
+
+	n = ch->driver->read_batch(ch, logs, max, KV_TIMEOUT);
+
+	for(i = 0; i < n; i++){
+		logs[i].channel = channel_num;
+		logs[i].timestamp = clock_to_host(&ch->clock, logs[i].timestamp);
+	}
+
+	return n;
+}
+
+// Acceptance filter of the controller: pass frames with (id & mask) == (code & mask).
+int kv_set_filter(int channel_num, __u32 code, __u32 mask, int ext){
+    can_channel* ch = &channels[channel_num];
+
+	if(ch->driver->set_filter == NULL){
+		// filtered in software only
+		return 0;
+	}
+
+	return ch->driver->set_filter(ch, code, mask, ext);
+}
+
+// One device clock readout for the clock mapping, call from the reading thread only.
+int kv_sample_clock(int channel_num){
+    can_channel* ch = &channels[channel_num];
+	uint64_t time, before, after;
+
+	if(ch->driver->read_timer == NULL){
+		return 0;
+	}
+
+	before = get_monotonic_time();
+	if(ch->driver->read_timer(ch, &time) != 0){
+		return -1;
+	}
+	after = get_monotonic_time();
+
+	clock_sample(&ch->clock, time, before, after);
+
+	return 0;
+}
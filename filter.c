@@ -0,0 +1,201 @@
+#include "lib.h"
+
+/**
+ * CAN-ID filters, candump style
+ *
+ *  <id>:<mask>   matches when (frame-id & mask) == (id & mask)
+ *  <id>~<mask>   matches when it does not
+ *
+ * Ids with more than 3 hex digits are 29-bit ids. A rule only matches
+ * frames of its own id size, an inverted rule matches every frame of
+ * the other size. A frame passes when any rule of its channel matches,
+ * a channel without rules passes everything.
+ *
+ * filter_compile turns the rules into a 2048-bit table for 11-bit ids,
+ * a hash set for exact 29-bit ids and a short list for the remaining
+ * 29-bit rules.
+ *
+ */
+#define FILTER_EMPTY 0xFFFFFFFFU
+
+int filter_add(can_filter *f, const char *cs){
+	can_filter_rule *rule;
+	char *endptr;
+	unsigned long id, mask;
+
+	if(f->num_rules >= CAN_FILTER_MAX){
+		return -1;
+	}
+
+	id = strtoul(cs, &endptr, 16);
+	if(endptr == cs || (*endptr != ':' && *endptr != '~')){
+		return -1;
+	}
+
+	rule = &f->rules[f->num_rules];
+	rule->ext = (endptr - cs > 3) || id > CAN_SFF_MASK;
+	rule->inverted = (*endptr == '~');
+
+	cs = endptr + 1;
+	mask = strtoul(cs, &endptr, 16);
+	if(endptr == cs || *endptr != '\0'){
+		return -1;
+	}
+
+	rule->mask = (__u32)mask & (rule->ext ? CAN_EFF_MASK : CAN_SFF_MASK);
+	rule->id = (__u32)id & rule->mask;
+
+	f->num_rules++;
+
+	return 0;
+}
+
+static int filter_rule_match(can_filter_rule *rule, __u32 id, int ext){
+	int match = (rule->ext == ext) && ((id & rule->mask) == rule->id);
+
+	return rule->inverted ? !match : match;
+}
+
+static unsigned int filter_hash(can_filter *f, __u32 id){
+	return (id * 0x9E3779B1U) >> f->eff_shift;
+}
+
+void filter_destroy(can_filter *f){
+	free(f->eff_set);
+	f->eff_set = NULL;
+}
+
+int filter_compile(can_filter *f){
+	int i, exact;
+	unsigned int size, bits, h;
+	__u32 id;
+	can_filter_rule *rule;
+
+	memset(f->sff_bitmap, '\0', sizeof(f->sff_bitmap));
+	f->num_eff_rules = 0;
+	f->eff_all = 0;
+
+	for(id = 0; id <= CAN_SFF_MASK; id++){
+		for(i = 0; i < f->num_rules; i++){
+			if(filter_rule_match(&f->rules[i], id, 0)){
+				f->sff_bitmap[id >> 5] |= 1U << (id & 31);
+				break;
+			}
+		}
+	}
+
+	exact = 0;
+	for(i = 0; i < f->num_rules; i++){
+		rule = &f->rules[i];
+		if(rule->inverted && !rule->ext){
+			f->eff_all = 1;
+		}
+		else if(rule->ext && !rule->inverted && rule->mask == CAN_EFF_MASK){
+			exact++;
+		}
+		else if(rule->ext){
+			f->eff_rules[f->num_eff_rules++] = *rule;
+		}
+	}
+
+	// power of two, at most half full
+	bits = 1;
+	while((1U << bits) < (unsigned int)exact * 2){
+		bits++;
+	}
+	size = 1U << bits;
+	f->eff_shift = 32 - bits;
+	f->eff_mask = size - 1;
+
+	free(f->eff_set);
+	f->eff_set = (__u32*)malloc(sizeof(__u32) * size);
+	if(f->eff_set == NULL){
+		return -1;
+	}
+	memset(f->eff_set, 0xFF, sizeof(__u32) * size);
+
+	for(i = 0; i < f->num_rules; i++){
+		rule = &f->rules[i];
+		if(rule->ext && !rule->inverted && rule->mask == CAN_EFF_MASK){
+			h = filter_hash(f, rule->id);
+			while(f->eff_set[h] != FILTER_EMPTY && f->eff_set[h] != rule->id){
+				h = (h + 1) & f->eff_mask;
+			}
+			f->eff_set[h] = rule->id;
+		}
+	}
+
+	return 0;
+}
+
+int filter_match(can_filter *f, can_frame *cf){
+	__u32 id;
+	unsigned int h;
+	int i;
+
+	if(f->num_rules == 0){
+		return 1;
+	}
+
+	if(!(cf->flag & canMSG_EXT)){
+		id = (__u32)cf->id & CAN_SFF_MASK;
+		return (f->sff_bitmap[id >> 5] >> (id & 31)) & 1;
+	}
+
+	if(f->eff_all){
+		return 1;
+	}
+
+	id = (__u32)cf->id & CAN_EFF_MASK;
+	h = filter_hash(f, id);
+	while(f->eff_set[h] != FILTER_EMPTY){
+		if(f->eff_set[h] == id){
+			return 1;
+		}
+		h = (h + 1) & f->eff_mask;
+	}
+
+	for(i = 0; i < f->num_eff_rules; i++){
+		if(filter_rule_match(&f->eff_rules[i], id, 1)){
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * One code/mask per id size that lets through at least every frame the
+ * rules accept, for the acceptance filter of the controller. Returns 0
+ * and fills code/mask, or -1 when that size cannot be narrowed down.
+ *
+ */
+int filter_hw_mask(can_filter *f, int ext, __u32 *code, __u32 *mask){
+	int i, found = 0;
+	can_filter_rule *rule;
+
+	for(i = 0; i < f->num_rules; i++){
+		rule = &f->rules[i];
+
+		// an inverted rule lets through nearly everything
+		if(rule->inverted){
+			return -1;
+		}
+		if(rule->ext != ext){
+			continue;
+		}
+
+		if(!found){
+			*code = rule->id;
+			*mask = rule->mask;
+			found = 1;
+		}
+		else{
+			// keep only the bits all rules agree on
+			*mask &= rule->mask & ~(*code ^ rule->id);
+			*code &= *mask;
+		}
+	}
+
+	return found ? 0 : -1;
+}
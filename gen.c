@@ -0,0 +1,407 @@
+#include "lib.h"
+
+/**
+ * Traffic generator
+ *
+ * Frames are made from a template (parse_canframe) with random or
+ * incrementing can-ids, lengths and payloads, and sent from one thread.
+ * With a target rate or bus load every frame has a deadline, the
+ * scheduler (sched.c) waits for it and all frames due by then go out in
+ * one kv_send. Without a target frames go out as fast as the channel
+ * takes them.
+ *
+ */
+#define GEN_BATCH 64
+#define GEN_FIXED 0
+#define GEN_RANDOM 1
+#define GEN_INCREMENT 2
+
+typedef struct {
+	can_frame tmpl;
+	int id_mode;
+	int len_mode;
+	int data_mode;
+	uint64_t seed;
+	uint64_t counter;
+} gen_param;
+
+void print_usage_cangen(char *arg0, char *arg1)
+{
+	char prg[_MAX_FNAME];
+	char *cmd;
+
+	basename(arg0, prg, sizeof(prg));
+	cmd = arg1;
+
+	fprintf(stderr, "%s %s - generate CAN traffic at a given rate or bus load with Kvaser driver.\n\n", prg, cmd);
+	fprintf(stderr, "Usage: %s %s [options] <channel> [<can-frame>]\n", prg, cmd);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -I <mode>                      (can-id: r(andom)/i(ncrement)/f(ixed) - default 'r', 'f' with <can-frame>)\n");
+	fprintf(stderr, "  -L <mode>                      (length: r(andom)/i(ncrement)/f(ixed) - default 'r', 'f' with <can-frame>)\n");
+	fprintf(stderr, "  -D <mode>                      (payload: r(andom)/i(ncrement)/f(ixed) - default 'r', 'f' with <can-frame>)\n");
+	fprintf(stderr, "  -e                             (29-bit can-ids, without <can-frame>)\n");
+	fprintf(stderr, "  -f                             (CAN-FD frames, without <can-frame>)\n");
+	fprintf(stderr, "  -b                             (CAN-FD frames with bit rate switch, without <can-frame>)\n");
+	fprintf(stderr, "  -r <rate>                      (frames per second - default: as fast as the bus takes them)\n");
+	fprintf(stderr, "  -l <percent>                   (bus load in percent instead of -r, e.g. 80)\n");
+	fprintf(stderr, "  -n <count>                     (send <count> frames - default infinite)\n");
+	fprintf(stderr, "  -s <us>                        (busy-wait the last <us> before each frame - default %dus)\n", SCHED_SPIN_DEFAULT);
+	fprintf(stderr, "  -R                             (run at real-time priority)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Format of <channel>: <channel-num>{f|F}{_}{b|B<bitrate>}{d|D<data-bitrate>}\n");
+	fprintf(stderr, "  examples:\n");
+	fprintf(stderr, "    0                            (channel 0, CAN-CC)\n");
+	fprintf(stderr, "    0Fb500Kd2M                   (channel 0, CAN-FD, arbitration bitrate 500K, data bitrate 2M)\n");
+	fprintf(stderr, "    sock:vcan0                   (SocketCAN interface vcan0 on the lowest free channel, Linux only)\n");
+	fprintf(stderr, "    sim:a/l40                    (simulated bus a with 40%% synthetic load, no hardware needed)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Format of <can-frame>: <can-id>#{#}{<flag>}<data> (as in send), the fixed parts of the frames\n");
+	fprintf(stderr, "  examples:\n");
+	fprintf(stderr, "    -l 80 0 123#1122334455667788 -D i   (can-id 0x123, 8 byte counter, 80%% bus load)\n");
+	fprintf(stderr, "    -r 5000 0F 18DA00F1##1 -I i -L r    (CAN-FD with BRS, incrementing 29-bit can-ids from 0x18DA00F1)\n");
+}
+
+// xorshift64*, rand() has only 15 bits on Windows
+static uint64_t gen_random(gen_param *g){
+	g->seed ^= g->seed >> 12;
+	g->seed ^= g->seed << 25;
+	g->seed ^= g->seed >> 27;
+
+	return g->seed * 0x2545F4914F6CDD1DULL;
+}
+
+static int gen_mode(const char *arg){
+	switch(arg[0]){
+		case 'r':
+			return GEN_RANDOM;
+		case 'i':
+			return GEN_INCREMENT;
+		case 'f':
+			return GEN_FIXED;
+	}
+
+	return -1;
+}
+
+static void gen_frame(gen_param *g, can_frame *cf){
+	__u32 mask = (g->tmpl.flag & canMSG_EXT) ? CAN_EFF_MASK : CAN_SFF_MASK;
+	int fd = (g->tmpl.flag & canFDMSG_FDF) != 0;
+	uint64_t v;
+	int i;
+
+	cf->flag = g->tmpl.flag;
+
+	switch(g->id_mode){
+		case GEN_RANDOM:
+			cf->id = (__i32)(gen_random(g) & mask);
+			break;
+		case GEN_INCREMENT:
+			cf->id = (__i32)(((__u32)g->tmpl.id + g->counter) & mask);
+			break;
+		default:
+			cf->id = g->tmpl.id;
+	}
+
+	switch(g->len_mode){
+		case GEN_RANDOM:
+			v = gen_random(g);
+			cf->dlc = fd ? can_fd_dlc2len((unsigned char)(v & 0x0F)) : (__u32)(v % (CAN_MAX_DLEN + 1));
+			break;
+		case GEN_INCREMENT:
+			cf->dlc = fd ? can_fd_dlc2len((unsigned char)(g->counter & 0x0F)) : (__u32)(g->counter % (CAN_MAX_DLEN + 1));
+			break;
+		default:
+			cf->dlc = g->tmpl.dlc;
+	}
+
+	if(cf->flag & canMSG_RTR){
+		g->counter++;
+		return;
+	}
+
+	switch(g->data_mode){
+		case GEN_RANDOM:
+			for(i = 0; i < (int)cf->dlc; i += 8){
+				v = gen_random(g);
+				memcpy(&cf->msg[i], &v, cf->dlc - i < 8 ? cf->dlc - i : 8);
+			}
+			break;
+		case GEN_INCREMENT:
+			// little endian counter, like a sequence number
+			memset(cf->msg, '\0', cf->dlc);
+			for(i = 0, v = g->counter; i < (int)cf->dlc && i < 8; i++, v >>= 8){
+				cf->msg[i] = (__u8)v;
+			}
+			break;
+		default:
+			memcpy(cf->msg, g->tmpl.msg, cf->dlc);
+	}
+
+	g->counter++;
+}
+
+int cangen(int argc, char *argv[]){
+	int i, n, ret, channel_num, realtime, paced, template_given, failed;
+	int64_t count;
+	uint64_t spin, sent, unsent, bus_time, due, start, now, deadline, slot, last_report, last_sent, last_bus;
+	uint64_t times[GEN_BATCH], errors[GEN_BATCH];
+	double rate, load;
+	can_frame batch[GEN_BATCH];
+	gen_param g;
+	histogram error;
+	sched_timer timer;
+	can_channel ch = {
+		.fd = 0,
+		.bitrate = CAN_BITRATE_DEFAULT,
+		.data_bitrate = CANFD_DATA_BITRATE_DEFAULT,
+		.state = 0
+	};
+	can_channel *chp;
+
+	if(argc <= 2){
+		print_usage_cangen(argv[0], argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	memset(&g, '\0', sizeof(g));
+	g.id_mode = g.len_mode = g.data_mode = -1;
+	count = -1;	// infinite when a negative number
+	rate = 0;
+	load = 0;
+	spin = SCHED_SPIN_DEFAULT;
+	realtime = 0;
+	template_given = 0;
+	channel_num = -1;
+
+	for(i = 2; i < argc; i++){
+		if(strcmp(argv[i], "-I") == 0 || strcmp(argv[i], "-L") == 0 || strcmp(argv[i], "-D") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing mode value after %s\n\n", argv[i]);
+				print_usage_cangen(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			ret = gen_mode(argv[i]);
+
+			if (ret < 0) {
+				fprintf(stderr, "Invalid mode value: %s\n\n", argv[i]);
+				print_usage_cangen(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+			switch(argv[i - 1][1]){
+				case 'I':
+					g.id_mode = ret;
+					break;
+				case 'L':
+					g.len_mode = ret;
+					break;
+				default:
+					g.data_mode = ret;
+			}
+		}
+		else if(strcmp(argv[i], "-e") == 0){
+			g.tmpl.flag |= canMSG_EXT;
+		}
+		else if(strcmp(argv[i], "-f") == 0){
+			g.tmpl.flag |= canFDMSG_FDF;
+		}
+		else if(strcmp(argv[i], "-b") == 0){
+			g.tmpl.flag |= canFDMSG_FDF | canFDMSG_BRS;
+		}
+		else if(strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "-l") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing %s value after %s\n\n", argv[i][1] == 'r' ? "rate" : "percent", argv[i]);
+				print_usage_cangen(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			if (atof(argv[i]) <= 0 || (argv[i - 1][1] == 'l' && atof(argv[i]) > 100)) {
+				fprintf(stderr, "Invalid %s value: %s\n\n", argv[i - 1][1] == 'r' ? "rate" : "percent", argv[i]);
+				print_usage_cangen(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+			if(argv[i - 1][1] == 'r'){
+				rate = atof(argv[i]);
+				load = 0;
+			}else{
+				load = atof(argv[i]);
+				rate = 0;
+			}
+		}
+		else if(strcmp(argv[i], "-n") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing count value after %s\n\n", argv[i]);
+				print_usage_cangen(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			count = atoll(argv[i]);
+
+			if (count <= 0) {
+				fprintf(stderr, "Invalid count value: %s\n\n", argv[i]);
+				print_usage_cangen(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "-s") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing spin value after %s\n\n", argv[i]);
+				print_usage_cangen(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			if(atoi(argv[i]) < 0){
+				fprintf(stderr, "Invalid spin value: %s\n\n", argv[i]);
+				print_usage_cangen(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+			spin = (uint64_t)atoi(argv[i]);
+		}
+		else if(strcmp(argv[i], "-R") == 0){
+			realtime = 1;
+		}
+		else if(strcmp(argv[i], "help") == 0){
+			print_usage_cangen(argv[0], argv[1]);
+			return EXIT_FAILURE;
+		}
+		else{
+			if(channel_num < 0){
+				channel_num = parse_canchannel(argv[i], &ch);
+				if(channel_num < 0 || channel_num >= MAX_CHANNELS){
+					fprintf(stderr, "Invalid channel value: %d\n\n", channel_num);
+					return EXIT_FAILURE;
+				}
+			}
+			else{
+				if(!parse_canframe(argv[i], &g.tmpl)){
+					fprintf(stderr, "Invalid can-frame value: %s\n\n", argv[i]);
+					print_usage_cangen(argv[0], argv[1]);
+					return EXIT_FAILURE;
+				}
+				template_given = 1;
+			}
+		}
+	}
+
+	if(channel_num < 0){
+		fprintf(stderr, "Error: Missing channel\n\n");
+		print_usage_cangen(argv[0], argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	if((g.tmpl.flag & canFDMSG_FDF) && !ch.fd){
+		fprintf(stderr, "Error: CAN-FD frames need a CAN-FD channel (e.g. 0F)\n\n");
+		print_usage_cangen(argv[0], argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	// a template fixes everything not asked to vary
+	if(g.id_mode < 0){
+		g.id_mode = template_given ? GEN_FIXED : GEN_RANDOM;
+	}
+	if(g.len_mode < 0){
+		g.len_mode = template_given ? GEN_FIXED : GEN_RANDOM;
+	}
+	if(g.data_mode < 0){
+		g.data_mode = template_given ? GEN_FIXED : GEN_RANDOM;
+	}
+	g.seed = get_monotonic_time() | 1;
+
+	kv_initialize();
+	if(kv_setup_channel(channel_num, &ch) != 0){
+		return EXIT_FAILURE;
+	}
+	chp = &channels[channel_num];
+
+	sched_timer_init(&timer, spin);
+	if(realtime && sched_set_realtime() != 0){
+		fprintf(stderr, "cannot raise the thread priority, running at normal priority\n");
+	}
+
+	paced = rate > 0 || load > 0;
+	hist_init(&error);
+	sent = unsent = bus_time = due = 0;
+	failed = 0;
+	last_sent = last_bus = 0;
+	start = last_report = get_monotonic_time();
+
+	while(!stop_flag && (count < 0 || sent < (uint64_t)count)){
+		deadline = start + due / 1000;
+		now = paced ? sched_wait_until(&timer, deadline) : get_monotonic_time();
+		if(stop_flag){
+			break;
+		}
+
+		// every frame due by now, one batch without a target
+		n = 0;
+		do {
+			gen_frame(&g, &batch[n]);
+			times[n] = can_frame_time(&batch[n], chp->bitrate, chp->data_bitrate);
+			if(paced){
+				errors[n] = now - deadline;
+				slot = rate > 0 ? (uint64_t)(1000000000.0 / rate) : (uint64_t)((double)times[n] * 100.0 / load);
+				due += slot;
+				deadline = start + due / 1000;
+			}
+			n++;
+		} while(n < GEN_BATCH && (count < 0 || sent + n < (uint64_t)count) && (!paced || deadline <= now));
+
+		ret = kv_send(channel_num, batch, n);
+		if(ret < 0){
+			fprintf(stderr, "channel %d: sending failed, stopping\n", channel_num);
+			failed = 1;
+			unsent += n;
+			break;
+		}
+		// the rest of a short batch was not acknowledged in time and is lost
+		for(i = 0; i < ret; i++){
+			bus_time += times[i];
+			if(paced){
+				hist_record(&error, errors[i]);
+			}
+		}
+		sent += ret;
+		unsent += n - ret;
+
+		if(now - last_report >= 1000000){
+			printf("%8.1fs  %8.0f frames/s  bus load %5.1f%%\n", (now - start) / 1000000.0,
+				(sent - last_sent) * 1000000.0 / (now - last_report), (bus_time - last_bus) / 10.0 / (now - last_report));
+			fflush(stdout);
+			last_report = now;
+			last_sent = sent;
+			last_bus = bus_time;
+		}
+	}
+
+	kv_flush(channel_num, 1000);
+	now = get_monotonic_time();
+	sched_timer_close(&timer);
+
+	if(now > start){
+		printf("%llu frames sent in %.3fs, %.0f frames/s, bus load %.1f%%", (unsigned long long)sent, (now - start) / 1000000.0,
+			sent * 1000000.0 / (now - start), bus_time / 10.0 / (now - start));
+		if(rate > 0){
+			printf(" (target %.0f frames/s)", rate);
+		}
+		if(load > 0){
+			printf(" (target %.1f%%)", load);
+		}
+		if(unsent){
+			printf(", %llu frames not sent", (unsigned long long)unsent);
+		}
+		printf("\n");
+	}
+
+	if(paced){
+		printf("send time error against the schedule (us):\n");
+		hist_print(stdout, &error, "us");
+	}
+
+	kv_close_channel(channel_num);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
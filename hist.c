@@ -0,0 +1,162 @@
+#include "lib.h"
+
+/**
+ * Log-linear histogram of non-negative values (HDR style)
+ *
+ * Values below 2 * HIST_SUB are counted exactly, above that every power
+ * of two is split into HIST_SUB buckets, so a bucket is never wider than
+ * 1/HIST_SUB of its values (6%). Recording is a few shifts, the whole
+ * uint64_t range fits in HIST_BUCKETS counters.
+ *
+ */
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+static int hist_index(uint64_t v){
+	int msb = 0, shift;
+
+	if(v < 2 * HIST_SUB){
+		return (int)v;
+	}
+
+	while((v >> msb) > 1){
+		msb++;
+	}
+	shift = msb - HIST_SUB_BITS;
+
+	return (shift << HIST_SUB_BITS) + (int)(v >> shift);
+}
+
+// Highest value counted in bucket i.
+static uint64_t hist_bucket_max(int i){
+	int shift;
+
+	if(i < 2 * HIST_SUB){
+		return (uint64_t)i;
+	}
+
+	shift = (i >> HIST_SUB_BITS) - 1;
+
+	return (((uint64_t)(i - (shift << HIST_SUB_BITS)) + 1) << shift) - 1;
+}
+
+void hist_init(histogram *h){
+	memset(h, '\0', sizeof(histogram));
+	h->min = UINT64_MAX;
+}
+
+void hist_record(histogram *h, uint64_t v){
+	h->counts[hist_index(v)]++;
+	h->total++;
+	h->sum += (double)v;
+	if(v < h->min){
+		h->min = v;
+	}
+	if(v > h->max){
+		h->max = v;
+	}
+}
+
+void hist_merge(histogram *h, const histogram *other){
+	int i;
+
+	for(i = 0; i < HIST_BUCKETS; i++){
+		h->counts[i] += other->counts[i];
+	}
+	h->total += other->total;
+	h->sum += other->sum;
+	if(other->min < h->min){
+		h->min = other->min;
+	}
+	if(other->max > h->max){
+		h->max = other->max;
+	}
+}
+
+// Smallest value that percent % of the recorded values do not exceed (within a bucket).
+uint64_t hist_percentile(const histogram *h, double percent){
+	uint64_t rank, seen = 0;
+	int i;
+
+	if(h->total == 0){
+		return 0;
+	}
+
+	rank = (uint64_t)(percent / 100.0 * (double)h->total + 0.5);
+	if(rank < 1){
+		rank = 1;
+	}
+
+	for(i = 0; i < HIST_BUCKETS; i++){
+		seen += h->counts[i];
+		if(seen >= rank){
+			return hist_bucket_max(i) < h->max ? hist_bucket_max(i) : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+// Values counted in the buckets within [lo, hi], both on bucket boundaries.
+static uint64_t hist_count(const histogram *h, uint64_t lo, uint64_t hi){
+	uint64_t count = 0;
+	int i;
+
+	for(i = hist_index(lo); i < HIST_BUCKETS && hist_bucket_max(i) <= hi; i++){
+		count += h->counts[i];
+	}
+
+	return count;
+}
+
+// Percentiles and one bar per power of two, values in unit (e.g. "us").
+void hist_print(FILE *stream, const histogram *h, const char *unit){
+	static const double percents[] = {50.0, 90.0, 99.0, 99.9, 99.99};
+	uint64_t counts[65], peak = 0, lo;
+	int i, k, groups, first = -1, bar;
+
+	if(h->total == 0){
+		fprintf(stream, "  no samples\n");
+		return;
+	}
+
+	fprintf(stream, "  count %llu  min %llu%s  mean %.1f%s  max %llu%s\n",
+		(unsigned long long)h->total, (unsigned long long)h->min, unit,
+		h->sum / (double)h->total, unit, (unsigned long long)h->max, unit);
+
+	fprintf(stream, " ");
+	for(i = 0; i < (int)(sizeof(percents) / sizeof(percents[0])); i++){
+		fprintf(stream, " p%g %llu%s", percents[i], (unsigned long long)hist_percentile(h, percents[i]), unit);
+	}
+	fprintf(stream, "\n");
+
+	// groups [0], [1], [2, 3], [4, 7], ... up to the one holding max
+	for(groups = 0; groups <= 64; groups++){
+		lo = groups == 0 ? 0 : (uint64_t)1 << (groups - 1);
+		if(lo > h->max){
+			break;
+		}
+		counts[groups] = hist_count(h, lo, groups == 0 ? 0 : lo + (lo - 1));
+		if(counts[groups] > peak){
+			peak = counts[groups];
+		}
+		if(first < 0 && counts[groups] > 0){
+			first = groups;
+		}
+	}
+
+	for(k = first; k < groups; k++){
+		lo = k == 0 ? 0 : (uint64_t)1 << (k - 1);
+
+		bar = (int)(counts[k] * 40 / peak);
+		if(counts[k] > 0 && bar == 0){
+			bar = 1;
+		}
+
+		fprintf(stream, "  %10llu - %-10llu%-3s %10llu ", (unsigned long long)lo,
+			(unsigned long long)(k == 0 ? 0 : lo + (lo - 1)), unit, (unsigned long long)counts[k]);
+		for(i = 0; i < bar; i++){
+			fputc('#', stream);
+		}
+		fputc('\n', stream);
+	}
+}
@@ -0,0 +1,311 @@
+#include "lib.h"
+
+/**
+ * Sparse time index of a log file
+ *
+ * <log>.idx lets canplay start in the middle of a large log without
+ * parsing everything before. It holds an entry every frames frames or
+ * every period us, whichever comes first, and always one for the first
+ * frame. It is written by candump -i or afterwards by kv index.
+ *
+ *  header : index_header, "KVIX" <version> 0 0 0
+ *  entry  : index_entry, timestamps ascending
+ *
+ * Offsets are into the uncompressed file, compressed logs have no index.
+ * The header records the log's size and last write time, an index that
+ * does not match its log (rewritten, truncated) is ignored.
+ *
+ */
+static const char index_magic[8] = {'K', 'V', 'I', 'X', 2, 0, 0, 0};
+
+void print_usage_canindex(char *arg0, char *arg1)
+{
+	char prg[_MAX_FNAME];
+	char *cmd;
+
+	basename(arg0, prg, sizeof(prg));
+	cmd = arg1;
+
+	fprintf(stderr, "%s %s - build the time index of logfiles for canplay --start/--end.\n\n", prg, cmd);
+	fprintf(stderr, "Usage: %s %s [options] <logfile> [<logfile> ...]\n", prg, cmd);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -n <frames>                    (an index entry every <frames> frames - default %d)\n", INDEX_FRAMES_DEFAULT);
+	fprintf(stderr, "  -t <ms>                        (or every <ms> of log time - default %dms)\n", INDEX_PERIOD_DEFAULT / 1000);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  The index of <logfile> is written to <logfile>%s\n", INDEX_SUFFIX);
+}
+
+void index_init(index_state *ix, uint64_t frames, uint64_t period){
+	memset(ix, '\0', sizeof(index_state));
+	ix->frames = frames;
+	ix->period = period;
+}
+
+/**
+ * Count the next frame of the log. Returns 1 when an index entry belongs
+ * before it, e then holds its timestamp and counts, the caller fills in
+ * the offset; 0 otherwise.
+ *
+ */
+int index_next(index_state *ix, can_log *log, index_entry *e){
+	int due;
+
+	due = ix->entries == 0 || ix->since >= ix->frames || log->timestamp >= ix->last_ts + ix->period;
+
+	if(due){
+		e->timestamp = log->timestamp;
+		e->offset = 0;
+		e->base_ts = 0;
+		memcpy(e->counts, ix->counts, sizeof(e->counts));
+		ix->since = 0;
+		ix->last_ts = log->timestamp;
+		ix->entries++;
+	}
+
+	ix->since++;
+	if(log->channel >= 0 && log->channel < MAX_CHANNELS){
+		ix->counts[log->channel]++;
+	}
+
+	return due;
+}
+
+// Size and last write time of the log at path as an index header records them. Returns 0 or -1.
+int index_log_stamp(const char *path, uint64_t *size, uint64_t *mtime){
+	HANDLE file;
+	LARGE_INTEGER li;
+	FILETIME ft;
+	int ret = -1;
+
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE){
+		return -1;
+	}
+
+	if(GetFileSizeEx(file, &li) && GetFileTime(file, NULL, NULL, &ft)){
+		*size = (uint64_t)li.QuadPart;
+		*mtime = (uint64_t)ft.dwHighDateTime << 32 | ft.dwLowDateTime;
+		ret = 0;
+	}
+
+	CloseHandle(file);
+
+	return ret;
+}
+
+// log_size 0 while the log is still being written, the entries are checked against the log only then.
+int index_write_header(FILE *fp, uint64_t frames, uint64_t period, uint64_t log_size, uint64_t log_mtime){
+	index_header hdr;
+
+	memset(&hdr, '\0', sizeof(hdr));
+	memcpy(hdr.magic, index_magic, sizeof(index_magic));
+	hdr.channels = MAX_CHANNELS;
+	hdr.entry_size = sizeof(index_entry);
+	hdr.frames = frames;
+	hdr.period = period;
+	hdr.log_size = log_size;
+	hdr.log_mtime = log_mtime;
+
+	return fwrite(&hdr, sizeof(hdr), 1, fp) == 1 ? 0 : -1;
+}
+
+int index_write_entry(FILE *fp, index_entry *e){
+	return fwrite(e, sizeof(index_entry), 1, fp) == 1 ? 0 : -1;
+}
+
+// One pass over the log at path, writes <path>.idx. Returns 0 or -1.
+int index_build(const char *path, uint64_t frames, uint64_t period){
+	char idxpath[_MAX_PATH + 8];
+	log_reader reader;
+	index_state ix;
+	index_entry e;
+	can_log log;
+	uint64_t total = 0, size, mtime;
+	FILE *fp;
+	int ret;
+
+	if(log_reader_open(&reader, path) != 0){
+		fprintf(stderr, "cannot open: %s\n", path);
+		return -1;
+	}
+
+	if(reader.compressed){
+		fprintf(stderr, "%s: compressed logs cannot be indexed\n", path);
+		log_reader_close(&reader);
+		return -1;
+	}
+
+	snprintf(idxpath, sizeof(idxpath), "%s%s", path, INDEX_SUFFIX);
+	if(fopen_s(&fp, idxpath, "wb") != 0){
+		fprintf(stderr, "cannot open: %s\n", idxpath);
+		log_reader_close(&reader);
+		return -1;
+	}
+
+	if(index_log_stamp(path, &size, &mtime) != 0){
+		size = mtime = 0;
+	}
+
+	index_init(&ix, frames, period);
+	ret = index_write_header(fp, frames, period, size, mtime);
+
+	while(ret == 0 && !stop_flag){
+		ret = log_reader_next(&reader, &log);
+		if(ret != 0){
+			break;
+		}
+
+		if(index_next(&ix, &log, &e)){
+			e.offset = reader.offset;
+			e.base_ts = reader.offset_ts;
+			ret = index_write_entry(fp, &e);
+		}
+		total++;
+	}
+
+	if(ret < 0){
+		fprintf(stderr, "%s: incorrect line format in logfile after %llu frames\n", path, (unsigned long long)total);
+	}
+
+	log_reader_close(&reader);
+	if(fclose(fp) != 0 || ret < 0 || stop_flag){
+		remove(idxpath);
+		return -1;
+	}
+
+	printf("%s: %llu frames, %llu index entries\n", idxpath, (unsigned long long)total, (unsigned long long)ix.entries);
+
+	return 0;
+}
+
+// The frame at e's offset is the one e was made for.
+static int index_check(log_reader *reader, index_entry *e){
+	can_log log;
+
+	return log_reader_seek(reader, e->offset, e->base_ts) == 0 && log_reader_next(reader, &log) == 0
+		&& log.timestamp == e->timestamp;
+}
+
+/**
+ * Find the index entry of the log at path to start reading from for
+ * time us after the log's first frame: the last one not later than that.
+ * The log's first timestamp goes to first_ts.
+ * Returns 0, or 1 if the log has no index or one that does not match it
+ * (warned about), the log is then read from the start.
+ *
+ */
+int index_lookup(const char *path, uint64_t time, index_entry *e, uint64_t *first_ts){
+	char idxpath[_MAX_PATH + 8];
+	const char *stale = NULL;
+	index_header hdr;
+	index_entry first, next;
+	log_reader reader;
+	uint64_t size, mtime;
+	FILE *fp;
+
+	snprintf(idxpath, sizeof(idxpath), "%s%s", path, INDEX_SUFFIX);
+	if(fopen_s(&fp, idxpath, "rb") != 0){
+		return 1;
+	}
+
+	if(fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, index_magic, sizeof(index_magic)) != 0
+		|| hdr.channels != MAX_CHANNELS || hdr.entry_size != sizeof(index_entry)
+		|| fread(&first, sizeof(index_entry), 1, fp) != 1){
+		stale = "is not an index of this version";
+	}
+	else if(hdr.log_size != 0 && (index_log_stamp(path, &size, &mtime) != 0 || size != hdr.log_size || mtime != hdr.log_mtime)){
+		stale = "was written for another version of the log";
+	}
+	else{
+		memcpy(e, &first, sizeof(index_entry));
+		while(fread(&next, sizeof(next), 1, fp) == 1 && next.timestamp <= first.timestamp + time){
+			memcpy(e, &next, sizeof(index_entry));
+		}
+	}
+
+	fclose(fp);
+
+	// also catches a log rewritten within the same size and time
+	if(stale == NULL && log_reader_open(&reader, path) == 0){
+		if(!index_check(&reader, &first) || !index_check(&reader, e)){
+			stale = "does not match the frames of the log";
+		}
+		log_reader_close(&reader);
+	}
+
+	if(stale != NULL){
+		fprintf(stderr, "%s %s, reading the log from the start (rebuild the index with kv index)\n", idxpath, stale);
+		return 1;
+	}
+
+	*first_ts = first.timestamp;
+
+	return 0;
+}
+
+int canindex(int argc, char *argv[]){
+	int i, failed, files;
+	uint64_t frames, period;
+
+	if(argc <= 2){
+		print_usage_canindex(argv[0], argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	frames = INDEX_FRAMES_DEFAULT;
+	period = INDEX_PERIOD_DEFAULT;
+	failed = 0;
+	files = 0;
+
+	for(i = 2; i < argc; i++){
+		if(strcmp(argv[i], "-n") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing frames value after %s\n\n", argv[i]);
+				print_usage_canindex(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			if (atoi(argv[i]) <= 0) {
+				fprintf(stderr, "Invalid frames value: %s\n\n", argv[i]);
+				print_usage_canindex(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+			frames = (uint64_t)atoi(argv[i]);
+		}
+		else if(strcmp(argv[i], "-t") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing ms value after %s\n\n", argv[i]);
+				print_usage_canindex(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			if (atoi(argv[i]) <= 0) {
+				fprintf(stderr, "Invalid ms value: %s\n\n", argv[i]);
+				print_usage_canindex(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+			period = (uint64_t)atoi(argv[i]) * 1000;
+		}
+		else if(strcmp(argv[i], "help") == 0){
+			print_usage_canindex(argv[0], argv[1]);
+			return EXIT_FAILURE;
+		}
+		else{
+			// options apply to the files after them
+			files++;
+			if(index_build(argv[i], frames, period) != 0){
+				failed++;
+			}
+		}
+	}
+
+	if(files == 0){
+		fprintf(stderr, "Error: Missing logfile\n\n");
+		print_usage_canindex(argv[0], argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -12,7 +12,13 @@ void print_usage(char *arg0)
 	fprintf(stderr, "Command:\n");
 	fprintf(stderr, "  dump    dump CAN bus traffic.\n");
 	fprintf(stderr, "  send    send CAN frames.\n");
+	fprintf(stderr, "  gen     generate CAN traffic at a given rate or bus load.\n");
+	fprintf(stderr, "  cyclic  send a table of periodic CAN frames.\n");
+	fprintf(stderr, "  latency measure frame latency between two channels.\n");
 	fprintf(stderr, "  play    replay a compact CAN frame logfile to CAN devices.\n");
+	fprintf(stderr, "  stat    show live per-ID statistics.\n");
+	fprintf(stderr, "  bench   run micro benchmarks without CAN devices.\n");
+	fprintf(stderr, "  index   build the time index of logfiles for replay.\n");
 }
 
 void signal_handler(int sig) {
@@ -41,9 +47,27 @@ int main(int argc, char *argv[])
 		else if(strcmp(argv[i], "send") == 0){
 			return cansend(argc, argv);
 		}
+		else if(strcmp(argv[i], "gen") == 0){
+			return cangen(argc, argv);
+		}
+		else if(strcmp(argv[i], "cyclic") == 0){
+			return cancyclic(argc, argv);
+		}
+		else if(strcmp(argv[i], "latency") == 0){
+			return canlatency(argc, argv);
+		}
 		else if(strcmp(argv[i], "play") == 0){
 			return canplay(argc, argv);
 		}
+		else if(strcmp(argv[i], "stat") == 0){
+			return canstat(argc, argv);
+		}
+		else if(strcmp(argv[i], "bench") == 0){
+			return canbench(argc, argv);
+		}
+		else if(strcmp(argv[i], "index") == 0){
+			return canindex(argc, argv);
+		}
 		else{
 			print_usage(argv[0]);
 			return EXIT_FAILURE;
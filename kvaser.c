@@ -1,9 +1,13 @@
 #include "lib.h"
 
-#define KV_TIMEOUT 100
-
-can_channel channels[MAX_CHANNELS];
-
+/**
+ * Kvaser driver (canlib), the default for plain channel numbers
+ *
+ * The Kvaser channel number is the channel number of the tool. The
+ * device clock runs at 1us and wraps at 32 bits, see clock_extend.
+ * TX acknowledgements are on, sent frames come back flagged canMSG_TXACK.
+ *
+ */
 void print_kvaser_error(const char* function, canStatus status) {
     char error_text[256];
 
@@ -14,84 +18,41 @@ void print_kvaser_error(const char* function, canStatus status) {
     }
 }
 
-int kv_initialize(void){
-	canInitializeLibrary();
-	memset(channels, '\0', sizeof(can_channel) * MAX_CHANNELS);
-	return 0;
-}
-
-void kv_close_channel(int channel_num){
-    canStatus status;
-	if (channels[channel_num].state) {
-		status = canBusOff(channels[channel_num].handle);
-		if (status != canOK) {
-			print_kvaser_error("canBusOff", status);
-		}
-
-		status = canClose(channels[channel_num].handle);
-		if (status != canOK) {
-			print_kvaser_error("canClose", status);
-		}
+static int kvaser_open(can_channel *ch){
+	static int initialized = 0;
+    int flags = canOPEN_ACCEPT_VIRTUAL;
 
-		channels[channel_num].state = 0;
+	if(!initialized){
+		canInitializeLibrary();
+		initialized = 1;
 	}
-}
-
-void kv_cleanup_channels(void) {
-    int i;
-
-    for (i = 0; i < MAX_CHANNELS; i++) {
-		kv_close_channel(i);
-    }
-}
-
-can_channel *kv_channel_info(int channel_num){
-	return &channels[channel_num];
-}
-
-void kv_sync_bus_on(){
-	int i;
-	can_channel *ch;
-    for (i = 0; i < MAX_CHANNELS; i++) {
-		ch = &channels[i];
-		if(ch->state)
-			canBusOff(ch->handle);
-    }
-    for (i = 0; i < MAX_CHANNELS; i++) {
-		ch = &channels[i];
-		if(ch->state)
-			canBusOn(ch->handle);
-    }
-}
-
-int kv_setup_channel(int channel_num, can_channel *ch_param){
-    canStatus status;
-	can_channel *ch;
-	int bitrate;
-	int dbitrate;
-
-	ch = kv_channel_info(channel_num);
-	memcpy(ch, ch_param, sizeof(can_channel));
 
-    int flags = canOPEN_ACCEPT_VIRTUAL;
     if (ch->fd) {
         flags |= canOPEN_CAN_FD;
     }
 
-    ch->handle = canOpenChannel(channel_num, flags);
+    ch->handle = canOpenChannel(ch->channel, flags);
     if (ch->handle < 0) {
         print_kvaser_error("canOpenChannel", ch->handle);
         return -1;
     }
 
+	return 0;
+}
+
+static int kvaser_configure(can_channel *ch){
+    canStatus status;
+	int bitrate;
+	int dbitrate;
+
 	//
 	// Set timestamp clock resolution
 	//
 	DWORD resolution = 1;	// 1 microsecond
+	DWORD txack = 1;
 	status = canIoCtl(ch->handle, canIOCTL_SET_TIMER_SCALE, &resolution, sizeof(resolution));
 	if (status) {
         print_kvaser_error("canIoCtl", status);
-		kv_close_channel(channel_num);
 		return -1;
 	}
 
@@ -102,14 +63,12 @@ int kv_setup_channel(int channel_num, can_channel *ch_param){
 			case  500000 : bitrate = canFD_BITRATE_500K_80P; break;
 			default:
 				fprintf(stderr, "Unsupported arbitration bitrate: %d\n", ch->bitrate);
-				kv_close_channel(channel_num);
 				return -1;
 		}
 
         status = canSetBusParams(ch->handle, bitrate, 0, 0, 0, 0, 0);
         if (status != canOK) {
             print_kvaser_error("canSetBusParams (arbitration)", status);
-			kv_close_channel(channel_num);
             return -1;
         }
 
@@ -120,14 +79,12 @@ int kv_setup_channel(int channel_num, can_channel *ch_param){
 			case 1000000 : dbitrate = canFD_BITRATE_1M_80P; break;
 			default:
 				fprintf(stderr, "Unsupported data bitrate: %d\n", ch->data_bitrate);
-				kv_close_channel(channel_num);
 				return -1;
 		}
 
         status = canSetBusParamsFd(ch->handle, dbitrate, 0, 0, 0);
         if (status != canOK) {
             print_kvaser_error("canSetBusParamsFd", status);
-			kv_close_channel(channel_num);
             return -1;
         }
     } else {
@@ -138,67 +95,195 @@ int kv_setup_channel(int channel_num, can_channel *ch_param){
 			case  125000 : bitrate = canBITRATE_125K; break;
 			default:
 				fprintf(stderr, "Unsupported bitrate: %d\n", ch->bitrate);
-				kv_close_channel(channel_num);
 				return -1;
 		}
 
         status = canSetBusParams(ch->handle, canBITRATE_500K, 0, 0, 0, 0, 0);
         if (status != canOK) {
             print_kvaser_error("canSetBusParams", status);
-			kv_close_channel(channel_num);
             return -1;
         }
     }
 
+	// acks for kv_send
+	status = canIoCtl(ch->handle, canIOCTL_SET_TXACK, &txack, sizeof(txack));
+	if (status != canOK) {
+        print_kvaser_error("canIoCtl", status);
+		return -1;
+	}
+
+#ifdef _WIN32
+	// receive notification for kvaser_read_batch
+	status = canIoCtl(ch->handle, canIOCTL_GET_EVENTHANDLE, &ch->event, sizeof(ch->event));
+	if (status != canOK) {
+        print_kvaser_error("canIoCtl", status);
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+static int kvaser_bus_on(can_channel *ch){
+    canStatus status;
+
     status = canBusOn(ch->handle);
     if (status != canOK) {
         print_kvaser_error("canBusOn", status);
-		kv_close_channel(channel_num);
         return -1;
     }
 
-	ch->state = 1;
+	return 0;
+}
+
+static int kvaser_bus_off(can_channel *ch){
+    canStatus status;
+
+	status = canBusOff(ch->handle);
+	if (status != canOK) {
+		print_kvaser_error("canBusOff", status);
+		return -1;
+	}
 
-    return 0;
+	return 0;
 }
 
-int kv_write(int channel_num, can_frame *cf){
+static void kvaser_close(can_channel *ch){
     canStatus status;
-    can_channel* ch = NULL;
 
-	ch = kv_channel_info(channel_num);
+	status = canClose(ch->handle);
+	if (status != canOK) {
+		print_kvaser_error("canClose", status);
+	}
+}
 
-	if (!ch->state){
-        fprintf(stderr, "channel %d is not opened yet\n", channel_num);
-        return -1;
+static int kvaser_write_batch(can_channel *ch, can_frame *frames, int n, DWORD timeout){
+    canStatus status;
+	int i;
+
+	for(i = 0; i < n; i++){
+		status = canWriteWait(ch->handle, frames[i].id, frames[i].msg, frames[i].dlc, frames[i].flag, timeout);
+
+		if (status != canOK) {
+			print_kvaser_error("canWriteWait", status);
+			return i > 0 ? i : -1;
+		}
+	}
+
+	return n;
+}
+
+// Queue into the TX buffer without waiting, returns the number queued until it is full.
+static int kvaser_send(can_channel *ch, can_frame *frames, int n){
+    canStatus status;
+	int i;
+
+	for(i = 0; i < n; i++){
+		status = canWrite(ch->handle, frames[i].id, frames[i].msg, frames[i].dlc, frames[i].flag);
+
+		if (status == canERR_TXBUFOFL) {
+			break;
+		}
+		if (status != canOK) {
+			print_kvaser_error("canWrite", status);
+			return i > 0 ? i : -1;
+		}
 	}
 
-	status = canWriteWait(ch->handle, cf->id, cf->msg, cf->dlc, cf->flag, KV_TIMEOUT);
+	return i;
+}
+
+// Everything pending (up to max) with non-blocking canRead calls, waits for the first frame.
+static int kvaser_read_batch(can_channel *ch, can_log *logs, int max, DWORD timeout){
+    canStatus status;
+	long id;
+	unsigned int dlc, flag;
+	unsigned long time;
+	uint64_t now, deadline;
+	DWORD left;
+	int n = 0;
+
+	deadline = get_monotonic_time() + (uint64_t)timeout * 1000;
+
+	for(;;){
+		while(n < max){
+			status = canRead(ch->handle, &id, logs[n].frame.msg, &dlc, &flag, &time);
+			if(status != canOK){
+				break;
+			}
+
+			logs[n].timestamp = clock_extend(&ch->clock, time);
+			logs[n].frame.id = id;
+			logs[n].frame.dlc = dlc;
+			logs[n].frame.flag = flag;
+			n++;
+		}
 
+		if(n > 0){
+			return n;
+		}
+		if(status != canERR_NOMSG){
+			print_kvaser_error("canRead", status);
+			return -1;
+		}
+
+		// a wake-up without a frame only waits for the rest of timeout
+		now = get_monotonic_time();
+		if(now >= deadline){
+			return 0;
+		}
+		left = timeout == INFINITE ? INFINITE : (DWORD)((deadline - now + 999) / 1000);
+
+#ifdef _WIN32
+		// the event is auto-reset, a frame arriving after the drain signals it again
+		if(WaitForSingleObject(ch->event, left) != WAIT_OBJECT_0){
+			return 0;
+		}
+#else
+		if(canReadSync(ch->handle, left) != canOK){
+			return 0;
+		}
+#endif
+	}
+}
+
+static int kvaser_set_filter(can_channel *ch, __u32 code, __u32 mask, int ext){
+    canStatus status;
+
+	status = canSetAcceptanceFilter(ch->handle, code, mask, ext);
     if (status != canOK) {
-        print_kvaser_error("canWriteWait", status);
+        print_kvaser_error("canSetAcceptanceFilter", status);
         return -1;
     }
 
 	return 0;
 }
 
-int kv_read(int channel_num, long *id, void *msg, unsigned int *dlc, unsigned int *flag, unsigned long *time){
+static int kvaser_read_timer(can_channel *ch, uint64_t *time){
     canStatus status;
-    can_channel* ch = NULL;
-
-	ch = kv_channel_info(channel_num);
-	if (!ch->state){
-        fprintf(stderr, "channel %d is not opened yet\n", channel_num);
-        return -1;
-	}
-
-	status = canReadWait(ch->handle, id, msg, dlc, flag, time, KV_TIMEOUT);
+	unsigned long raw;
 
+	status = canReadTimer(ch->handle, &raw);
     if (status != canOK) {
-        //print_kvaser_error("canWriteWait", status);
+        print_kvaser_error("canReadTimer", status);
         return -1;
     }
 
+	*time = clock_extend(&ch->clock, raw);
+
 	return 0;
 }
+
+const can_driver kvaser_driver = {
+	"kv",
+	kvaser_open,
+	kvaser_configure,
+	kvaser_bus_on,
+	kvaser_bus_off,
+	kvaser_read_batch,
+	kvaser_write_batch,
+	kvaser_send,
+	kvaser_read_timer,
+	kvaser_set_filter,
+	kvaser_close
+};
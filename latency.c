@@ -0,0 +1,444 @@
+#include "lib.h"
+
+/**
+ * Latency between two channels on the same bus
+ *
+ * Sends sequence-numbered frames on one channel and receives them on the
+ * other. Every frame gives two latencies:
+ *
+ *  bus   RX timestamp - TX acknowledgement timestamp, device times mapped
+ *        to host time (clock.c), what the interfaces add
+ *  host  kv_read_batch returning the frame - kv_send called, what the
+ *        drivers, the host stack and the scheduler add on top
+ *
+ * The receiving channel is read by its own thread as in candump, the
+ * sending thread paces the frames (sched.c) and reads the acknowledgements.
+ * Both fill in a ring of slots indexed by sequence number, a frame still
+ * missing when its slot comes round again is lost.
+ *
+ */
+#define LATENCY_SLOTS 4096
+#define LATENCY_BATCH 64
+#define LATENCY_LEAD 10000      // us from setup to the first frame
+#define LATENCY_DRAIN 100       // ms to wait for the last frames
+#define LATENCY_FRAMES_DEFAULT 1000
+#define LATENCY_GAP_DEFAULT 1000
+
+#define LATENCY_SENT 1
+#define LATENCY_ACKED 2
+#define LATENCY_RECEIVED 4
+
+typedef struct {
+	__u32 seq;
+	int state;              // LATENCY_*
+	uint64_t write_time;    // host, before kv_send
+	uint64_t ack_time;      // device, mapped to host
+	uint64_t rx_time;       // device, mapped to host
+	uint64_t read_time;     // host, after kv_read_batch
+} latency_slot;
+
+typedef struct {
+	latency_slot slots[LATENCY_SLOTS];
+	CRITICAL_SECTION mutex;
+	can_frame tmpl;
+	int rx_channel;
+	volatile int done;
+	uint64_t received;
+	uint64_t lost;
+	uint64_t unexpected;    // matching frames with no sequence number sent
+	uint64_t early;         // received before the TX acknowledgement
+	histogram bus;
+	histogram host;
+} latency_state;
+
+void print_usage_canlatency(char *arg0, char *arg1)
+{
+	char prg[_MAX_FNAME];
+	char *cmd;
+
+	basename(arg0, prg, sizeof(prg));
+	cmd = arg1;
+
+	fprintf(stderr, "%s %s - measure frame latency between two channels with Kvaser driver.\n\n", prg, cmd);
+	fprintf(stderr, "Usage: %s %s [options] <tx-channel> <rx-channel> [<can-frame>]\n", prg, cmd);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -n <count>                     (send <count> frames - default %d)\n", LATENCY_FRAMES_DEFAULT);
+	fprintf(stderr, "  -g <us>                        (gap between frames - default %dus)\n", LATENCY_GAP_DEFAULT);
+	fprintf(stderr, "  -s <us>                        (busy-wait the last <us> before each frame - default %dus)\n", SCHED_SPIN_DEFAULT);
+	fprintf(stderr, "  -R                             (run at real-time priority)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Format of <channel>: <channel-num>{f|F}{_}{b|B<bitrate>}{d|D<data-bitrate>}\n");
+	fprintf(stderr, "  examples:\n");
+	fprintf(stderr, "    0 1                          (from channel 0 to channel 1)\n");
+	fprintf(stderr, "    0Fb500Kd2M 1Fb500Kd2M        (CAN-FD, arbitration bitrate 500K, data bitrate 2M)\n");
+	fprintf(stderr, "    sim:a sim:a                  (two nodes of simulated bus a, no hardware needed)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Format of <can-frame>: <can-id>#{#}{<flag>}<data> (as in send) with at least 4 bytes of data,\n");
+	fprintf(stderr, "  the first 4 carry the sequence number - default 7FF#0000000000000000\n");
+}
+
+// Little endian sequence number in the first 4 bytes, as gen -D i.
+static void latency_put_seq(can_frame *cf, __u32 seq){
+	int i;
+
+	for(i = 0; i < 4; i++, seq >>= 8){
+		cf->msg[i] = (__u8)seq;
+	}
+}
+
+static __u32 latency_get_seq(const can_frame *cf){
+	return (__u32)cf->msg[0] | (__u32)cf->msg[1] << 8 | (__u32)cf->msg[2] << 16 | (__u32)cf->msg[3] << 24;
+}
+
+// Add what the slot just got, record the latencies it completes. Caller holds the mutex.
+static void latency_update(latency_state *ls, latency_slot *s, int state){
+	int old = s->state;
+
+	s->state |= state;
+
+	if(!(old & LATENCY_RECEIVED) && (s->state & LATENCY_RECEIVED)){
+		ls->received++;
+		hist_record(&ls->host, s->read_time > s->write_time ? s->read_time - s->write_time : 0);
+	}
+
+	if((old & (LATENCY_ACKED | LATENCY_RECEIVED)) != (LATENCY_ACKED | LATENCY_RECEIVED)
+		&& (s->state & (LATENCY_ACKED | LATENCY_RECEIVED)) == (LATENCY_ACKED | LATENCY_RECEIVED)){
+		if(s->rx_time < s->ack_time){
+			ls->early++;
+		}
+		hist_record(&ls->bus, s->rx_time > s->ack_time ? s->rx_time - s->ack_time : 0);
+	}
+}
+
+static int latency_match(latency_state *ls, const can_frame *cf){
+	return cf->id == ls->tmpl.id && (cf->flag & canMSG_EXT) == (ls->tmpl.flag & canMSG_EXT)
+		&& !(cf->flag & (canMSG_RTR | canMSG_ERROR_FRAME)) && cf->dlc >= 4;
+}
+
+// Frames of a TX acknowledgement batch or a read, time is the host time of the read.
+static void latency_frames(latency_state *ls, can_log *logs, int n, int state, uint64_t time){
+	latency_slot *s;
+	__u32 seq;
+	int i;
+
+	EnterCriticalSection(&ls->mutex);
+
+	for(i = 0; i < n; i++){
+		if(!latency_match(ls, &logs[i].frame)){
+			continue;
+		}
+
+		seq = latency_get_seq(&logs[i].frame);
+		s = &ls->slots[seq % LATENCY_SLOTS];
+		if(!(s->state & LATENCY_SENT) || s->seq != seq || (s->state & state)){
+			if(state == LATENCY_RECEIVED){
+				ls->unexpected++;
+			}
+			continue;
+		}
+
+		if(state == LATENCY_RECEIVED){
+			s->rx_time = logs[i].timestamp;
+			s->read_time = time;
+		}else{
+			s->ack_time = logs[i].timestamp;
+		}
+		latency_update(ls, s, state);
+	}
+
+	LeaveCriticalSection(&ls->mutex);
+}
+
+// Receiving channel, read as in candump's channel thread.
+DWORD WINAPI latency_rx_thread(LPVOID param){
+	latency_state *ls = (latency_state *)param;
+	can_log logs[LATENCY_BATCH];
+	uint64_t now, next_sample;
+	int n;
+
+	kv_sample_clock(ls->rx_channel);
+	next_sample = get_monotonic_time() + CLOCK_SAMPLE_INTERVAL;
+
+	while(!stop_flag && !ls->done){
+		now = get_monotonic_time();
+		if(now >= next_sample){
+			kv_sample_clock(ls->rx_channel);
+			next_sample = now + CLOCK_SAMPLE_INTERVAL;
+		}
+
+		n = kv_read_batch(ls->rx_channel, logs, LATENCY_BATCH);
+		if(n < 0){
+			// driver error, do not spin on it
+			Sleep(10);
+			continue;
+		}
+		if(n > 0){
+			latency_frames(ls, logs, n, LATENCY_RECEIVED, get_monotonic_time());
+		}
+	}
+
+	return 0;
+}
+
+// Acknowledgements of the frames in flight on the sending channel.
+static void latency_acks(latency_state *ls, int tx_channel, DWORD timeout){
+	can_log acks[LATENCY_BATCH];
+	int n;
+
+	while(channels[tx_channel].tx_pending > 0){
+		n = kv_tx_acks(tx_channel, acks, LATENCY_BATCH, timeout);
+		if(n <= 0){
+			break;
+		}
+		latency_frames(ls, acks, n, LATENCY_ACKED, get_monotonic_time());
+	}
+}
+
+int canlatency(int argc, char *argv[]){
+	int i, ret, tx_channel, rx_channel, realtime, channel_num, failed;
+	uint64_t count, gap, spin, sent, start, now, next_sample, last_report, last_sent, last_received;
+	latency_state *ls;
+	latency_slot *s;
+	can_frame frame;
+	sched_timer timer;
+	HANDLE thread;
+	can_channel ch;
+
+	if(argc <= 3){
+		print_usage_canlatency(argv[0], argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	ls = (latency_state*)calloc(1, sizeof(latency_state));
+	if(ls == NULL){
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	ls->tmpl.id = CAN_SFF_MASK;
+	ls->tmpl.dlc = CAN_MAX_DLEN;
+	count = LATENCY_FRAMES_DEFAULT;
+	gap = LATENCY_GAP_DEFAULT;
+	spin = SCHED_SPIN_DEFAULT;
+	realtime = 0;
+	tx_channel = rx_channel = -1;
+	ret = 0;
+
+	// channels are set up as they come, sim:<bus> takes the lowest free one
+	kv_initialize();
+
+	for(i = 2; i < argc && ret == 0; i++){
+		if(strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "-g") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing %s value after %s\n\n", argv[i][1] == 'n' ? "count" : "us", argv[i]);
+				print_usage_canlatency(argv[0], argv[1]);
+				ret = -1;
+				break;
+			}
+
+			i++;
+			if (atoll(argv[i]) <= 0) {
+				fprintf(stderr, "Invalid %s value: %s\n\n", argv[i - 1][1] == 'n' ? "count" : "us", argv[i]);
+				print_usage_canlatency(argv[0], argv[1]);
+				ret = -1;
+				break;
+			}
+			if(argv[i - 1][1] == 'n'){
+				count = (uint64_t)atoll(argv[i]);
+			}else{
+				gap = (uint64_t)atoll(argv[i]);
+			}
+		}
+		else if(strcmp(argv[i], "-s") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing spin value after %s\n\n", argv[i]);
+				print_usage_canlatency(argv[0], argv[1]);
+				ret = -1;
+				break;
+			}
+
+			i++;
+			if(atoi(argv[i]) < 0){
+				fprintf(stderr, "Invalid spin value: %s\n\n", argv[i]);
+				print_usage_canlatency(argv[0], argv[1]);
+				ret = -1;
+				break;
+			}
+			spin = (uint64_t)atoi(argv[i]);
+		}
+		else if(strcmp(argv[i], "-R") == 0){
+			realtime = 1;
+		}
+		else if(strcmp(argv[i], "help") == 0){
+			print_usage_canlatency(argv[0], argv[1]);
+			ret = -1;
+		}
+		else if(rx_channel < 0){
+			ch.fd = 0;
+			ch.bitrate = CAN_BITRATE_DEFAULT;
+			ch.data_bitrate = CANFD_DATA_BITRATE_DEFAULT;
+			ch.state = 0;
+			channel_num = parse_canchannel(argv[i], &ch);
+			if(channel_num < 0 || channel_num >= MAX_CHANNELS){
+				fprintf(stderr, "Invalid channel value: %d\n\n", channel_num);
+				ret = -1;
+				break;
+			}
+			if(kv_setup_channel(channel_num, &ch) != 0){
+				ret = -1;
+				break;
+			}
+
+			if(tx_channel < 0){
+				tx_channel = channel_num;
+			}else{
+				rx_channel = channel_num;
+			}
+		}
+		else{
+			if(!parse_canframe(argv[i], &ls->tmpl) || ls->tmpl.dlc < 4 || (ls->tmpl.flag & canMSG_RTR)){
+				fprintf(stderr, "Invalid can-frame value: %s\n\n", argv[i]);
+				print_usage_canlatency(argv[0], argv[1]);
+				ret = -1;
+			}
+		}
+	}
+
+	if(ret == 0 && rx_channel < 0){
+		fprintf(stderr, "Error: Missing %s channel\n\n", tx_channel < 0 ? "tx" : "rx");
+		print_usage_canlatency(argv[0], argv[1]);
+		ret = -1;
+	}
+
+	if(ret == 0 && (ls->tmpl.flag & canFDMSG_FDF) && (!channels[tx_channel].fd || !channels[rx_channel].fd)){
+		fprintf(stderr, "Error: CAN-FD frames need CAN-FD channels (e.g. 0F 1F)\n\n");
+		ret = -1;
+	}
+
+	if(ret != 0){
+		kv_cleanup_channels();
+		free(ls);
+		return EXIT_FAILURE;
+	}
+
+	InitializeCriticalSection(&ls->mutex);
+	ls->rx_channel = rx_channel;
+	hist_init(&ls->bus);
+	hist_init(&ls->host);
+
+	thread = CreateThread(NULL, 0, latency_rx_thread, ls, 0, NULL);
+	if(thread == NULL){
+		fprintf(stderr, "Failed to create thread for channel %d\n", rx_channel);
+		DeleteCriticalSection(&ls->mutex);
+		kv_cleanup_channels();
+		free(ls);
+		return EXIT_FAILURE;
+	}
+
+	sched_timer_init(&timer, spin);
+	if(realtime && sched_set_realtime() != 0){
+		fprintf(stderr, "cannot raise the thread priority, running at normal priority\n");
+	}
+
+	printf("%llu frames from channel %d to channel %d, one every %lluus\n", (unsigned long long)count,
+		tx_channel, rx_channel, (unsigned long long)gap);
+	fflush(stdout);
+
+	memcpy(&frame, &ls->tmpl, sizeof(can_frame));
+	kv_sample_clock(tx_channel);
+	sent = last_sent = last_received = 0;
+	failed = 0;
+	start = get_monotonic_time() + LATENCY_LEAD;
+	last_report = start;
+	next_sample = start + CLOCK_SAMPLE_INTERVAL;
+
+	while(!stop_flag && sent < count){
+		now = sched_wait_until(&timer, start + sent * gap);
+		if(stop_flag){
+			break;
+		}
+
+		// this thread reads the sending channel, keep its clock mapping current
+		if(now >= next_sample){
+			kv_sample_clock(tx_channel);
+			next_sample = now + CLOCK_SAMPLE_INTERVAL;
+		}
+
+		latency_put_seq(&frame, (__u32)sent);
+
+		EnterCriticalSection(&ls->mutex);
+		s = &ls->slots[sent % LATENCY_SLOTS];
+		if((s->state & LATENCY_SENT) && !(s->state & LATENCY_RECEIVED)){
+			ls->lost++;
+		}
+		memset(s, '\0', sizeof(latency_slot));
+		s->seq = (__u32)sent;
+		s->state = LATENCY_SENT;
+		s->write_time = get_monotonic_time();
+		LeaveCriticalSection(&ls->mutex);
+
+		// marked before kv_send, the receiving thread may see the frame first
+		if(kv_send(tx_channel, &frame, 1) != 1){
+			EnterCriticalSection(&ls->mutex);
+			s->state = 0;
+			LeaveCriticalSection(&ls->mutex);
+			fprintf(stderr, "channel %d: sending failed, stopping\n", tx_channel);
+			failed = 1;
+			break;
+		}
+		sent++;
+
+		// whatever is acknowledged by now, the timestamps do not depend on when they are read
+		latency_acks(ls, tx_channel, 0);
+
+		if(now - last_report >= 1000000){
+			EnterCriticalSection(&ls->mutex);
+			printf("%8.1fs  %8llu sent  %8llu received  bus p99 %5lluus  host p99 %5lluus\n", (now - start) / 1000000.0,
+				(unsigned long long)(sent - last_sent), (unsigned long long)(ls->received - last_received),
+				(unsigned long long)hist_percentile(&ls->bus, 99.0), (unsigned long long)hist_percentile(&ls->host, 99.0));
+			last_received = ls->received;
+			LeaveCriticalSection(&ls->mutex);
+			fflush(stdout);
+			last_report = now;
+			last_sent = sent;
+		}
+	}
+
+	// the last frames still on their way
+	latency_acks(ls, tx_channel, LATENCY_DRAIN);
+	Sleep(LATENCY_DRAIN);
+	ls->done = 1;
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	sched_timer_close(&timer);
+
+	for(i = 0; i < LATENCY_SLOTS; i++){
+		s = &ls->slots[i];
+		if((s->state & LATENCY_SENT) && !(s->state & LATENCY_RECEIVED)){
+			ls->lost++;
+		}
+	}
+
+	printf("%llu frames sent, %llu received, %llu lost", (unsigned long long)sent,
+		(unsigned long long)ls->received, (unsigned long long)ls->lost);
+	if(ls->unexpected){
+		printf(", %llu unexpected", (unsigned long long)ls->unexpected);
+	}
+	printf("\n");
+
+	printf("TX acknowledgement to RX, device timestamps (us):\n");
+	hist_print(stdout, &ls->bus, "us");
+	if(ls->early){
+		printf("  %llu frames stamped on RX before their TX acknowledgement, counted as 0us (clock mapping)\n",
+			(unsigned long long)ls->early);
+	}
+	printf("kv_send to kv_read_batch, host (us):\n");
+	hist_print(stdout, &ls->host, "us");
+
+	DeleteCriticalSection(&ls->mutex);
+	kv_close_channel(rx_channel);
+	kv_close_channel(tx_channel);
+	free(ls);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
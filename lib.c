@@ -17,7 +17,8 @@ uint64_t get_unix_time(){
     FILETIME    file_time;
     uint64_t    time;
 
-	GetSystemTimeAsFileTime(&file_time);
+	// precise: sub-microsecond instead of the 1-16ms system tick
+	GetSystemTimePreciseAsFileTime(&file_time);
     time =  ((uint64_t)file_time.dwLowDateTime )      ;
     time += ((uint64_t)file_time.dwHighDateTime) << 32;
 	time -= EPOCH;
@@ -58,6 +59,20 @@ int gettimeofday_ms(struct timeval * tp){
     return 0;
 }
 
+uint64_t get_monotonic_time(){
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER counter;
+
+	if(freq.QuadPart == 0){
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&counter);
+
+	// counter -> 1us, split to avoid overflow of counter * 1000000
+	return (uint64_t)(counter.QuadPart / freq.QuadPart) * 1000000ULL
+		+ (uint64_t)(counter.QuadPart % freq.QuadPart) * 1000000ULL / freq.QuadPart;
+}
+
 int parse_bitrate(const char* cs){
 	char* endptr;
 	long bitrate;
@@ -102,15 +117,49 @@ int parse_bitrate(const char* cs){
  *  0F            channel 0 (FD)
  *  0_b500000     channel 0, bitrate 500K
  *  0f_B500KD2M   channel 0 (FD), bitrate 500K, data-bitrate 2M
+ *  kv:0F         same as 0F
+ *  sock:vcan0    SocketCAN interface vcan0 on the lowest free channel
+ *  sim:a/b250K   simulated bus a at 250K on the lowest free channel
+ *  sim:a/l30     simulated bus a with 30% synthetic load
+ *
+ * Returns the channel number, -1 for an unknown driver prefix.
  *
  */
 int parse_canchannel(const char* cs, can_channel *ch){
 	char *endptr, *tmp;
+	const char *sep;
 	long channel_num;
 	char substr[MAX_BITRATE_STRING_LEN];
 	int len, br;
 
-	channel_num = strtol(cs, &endptr, 10);
+	ch->driver = NULL;
+	ch->ifname[0] = '\0';
+
+	ch->load = 0;
+
+	// <driver>:<device>{/<options>}
+	sep = strchr(cs, ':');
+	if(sep != NULL){
+		ch->driver = kv_find_driver(cs, (size_t)(sep - cs));
+		if(ch->driver == NULL){
+			fprintf(stderr, "Unknown driver: %.*s\n", (int)(sep - cs), cs);
+			return -1;
+		}
+		cs = sep + 1;
+	}
+
+	if(ch->driver != NULL && ch->driver != kv_find_driver("kv", 2)){
+		len = (int)strcspn(cs, "/");
+		strncpy_s(ch->ifname, sizeof(ch->ifname), cs, len);
+		endptr = (char *)cs + len;
+		if(*endptr == '/'){
+			endptr++;
+		}
+		channel_num = kv_free_channel();
+	}
+	else{
+		channel_num = strtol(cs, &endptr, 10);
+	}
 
 	if(*endptr == 'f' || *endptr == 'F'){
 		ch->fd = 1;
@@ -124,7 +173,7 @@ int parse_canchannel(const char* cs, can_channel *ch){
 		if(*endptr == 'b' || *endptr == 'B'){
 			tmp = ++endptr;
 			len = 0;
-			while(*tmp != '\0' && *tmp != 'd' && *tmp != 'D'){
+			while(*tmp != '\0' && *tmp != 'd' && *tmp != 'D' && *tmp != 'l' && *tmp != 'L'){
 				len++;
 				tmp++;
 			}
@@ -141,7 +190,7 @@ int parse_canchannel(const char* cs, can_channel *ch){
 		else if(*endptr == 'd' || *endptr == 'D'){
 			tmp = ++endptr;
 			len = 0;
-			while(*tmp != '\0' && *tmp != 'b' && *tmp != 'B'){
+			while(*tmp != '\0' && *tmp != 'b' && *tmp != 'B' && *tmp != 'l' && *tmp != 'L'){
 				len++;
 				tmp++;
 			}
@@ -155,6 +204,10 @@ int parse_canchannel(const char* cs, can_channel *ch){
 				endptr += len;
 			}
 		}
+		else if(*endptr == 'l' || *endptr == 'L'){
+			// synthetic load in percent, simulated buses only
+			ch->load = (int)strtol(endptr + 1, &endptr, 10);
+		}
 		else{
 			endptr++;
 		}
@@ -199,80 +252,105 @@ void pp_canchannel(int channel_num, can_channel *ch)
 		);
 }
 
-const char* format_can_id(unsigned long id, unsigned int flag) {
-    static char id_buffer[16];
-
-    if (flag & canMSG_EXT) {
-        // extended (29bit)
-        snprintf(id_buffer, sizeof(id_buffer), "%08lX", id & 0x1FFFFFFF);
-    } else {
-        // standard (11bit)
-        snprintf(id_buffer, sizeof(id_buffer), "%03lX", id & 0x7FF);
-    }
-
-    return id_buffer;
+static const char dec_digits2[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+// zero padded decimal with a fixed number of digits
+static void put_dec_fixed(char *buf, uint32_t value, int width){
+	while(width >= 2){
+		width -= 2;
+		memcpy(&buf[width], &dec_digits2[(value % 100) * 2], 2);
+		value /= 100;
+	}
+	if(width){
+		buf[0] = '0' + (value % 10);
+	}
 }
 
-const char* format_msg(const unsigned char* msg, unsigned char dlc) {
-    static char buffer[CANFD_MAX_DLEN * 2 + 1];
-    int i;
+// decimal without padding, returns the number of characters written
+static int put_dec(char *buf, int value){
+	char tmp[12];
+	int len = 0, neg = 0, n;
+	uint32_t v = (uint32_t)value;
 
-    if (dlc == 0) {
-        buffer[0] = '\0';
-        return buffer;
-    }
+	if(value < 0){
+		neg = 1;
+		v = 0U - v;
+	}
 
-    // clip when DLC exceeds
-    if (dlc > CANFD_MAX_DLEN) {
-        dlc = CANFD_MAX_DLEN;
-    }
+	do {
+		tmp[len++] = '0' + (v % 10);
+		v /= 10;
+	} while(v);
 
-    // convert to HEX
-    for (i = 0; i < dlc; i++) {
-        snprintf(&buffer[i * 2], 3, "%02X", msg[i]);
-    }
-    buffer[dlc * 2] = '\0';
+	n = 0;
+	if(neg){
+		buf[n++] = '-';
+	}
+	while(len){
+		buf[n++] = tmp[--len];
+	}
 
-    return buffer;
+	return n;
 }
 
-void fprint_log(FILE *stream, can_log *log, int verbose){
-	int flag;
+/**
+ * Format one compact log line into buf (at least LOG_LINE_MAX bytes).
+ * Returns the length of the line including '\n', no terminating zero.
+ *
+ * (0000000123.456789) 0 123#1122334455667788
+ *
+ */
+int sprint_log(char *buf, can_log *log, int verbose){
+	int n = 0;
+	unsigned int flag = log->frame.flag;
 
 	// microsecond
-    fprintf(stream, "(%010d.%06d) ",
-           (int)(log->timestamp / 1000000L),
-           (int)(log->timestamp % 1000000L));
+	buf[n++] = '(';
+	put_dec_fixed(&buf[n], (uint32_t)(log->timestamp / 1000000L), 10);
+	n += 10;
+	buf[n++] = '.';
+	put_dec_fixed(&buf[n], (uint32_t)(log->timestamp % 1000000L), 6);
+	n += 6;
+	buf[n++] = ')';
+	buf[n++] = ' ';
 
-    fprintf(stream, "%d ", log->channel);
+	n += put_dec(&buf[n], log->channel);
+	buf[n++] = ' ';
 
-    const char* id_str = format_can_id(log->frame.id, log->frame.flag);
-    fprintf(stream, "%s#", id_str);
+	n += sprint_canframe(&buf[n], &log->frame);
 
-	if(log->frame.flag & canFDMSG_FDF /* && (frame->flag & canMSG_RTR) == 0 */) {
-		flag = CANFD_FDF;
-		if(log->frame.flag & canFDMSG_BRS){
-			flag |= CANFD_BRS;
-		}
-		if(log->frame.flag & canFDMSG_ESI){
-			flag |= CANFD_ESI;
-		}
-		fprintf(stream, "#%d", flag);
+	if(verbose){
+		buf[n++] = ' ';
+		buf[n++] = '[';
+		buf[n++] = (flag & canMSG_EXT)        ? 'x' : ' ';
+		buf[n++] = (flag & canMSG_RTR)        ? 'R' : ' ';
+		buf[n++] = (flag & canMSGERR_OVERRUN) ? 'o' : ' ';
+		buf[n++] = (flag & canMSG_NERR)       ? 'N' : ' '; // TJA 1053/1054 transceivers only
+		buf[n++] = (flag & canFDMSG_FDF)      ? 'F' : ' ';
+		buf[n++] = (flag & canFDMSG_BRS)      ? 'B' : ' ';
+		buf[n++] = (flag & canFDMSG_ESI)      ? 'E' : ' ';
+		buf[n++] = ']';
 	}
 
-    const char* data_str = format_msg(log->frame.msg, log->frame.dlc);
-    fprintf(stream, "%s", data_str);
+	buf[n++] = '\n';
 
-	if(verbose){
-		fprintf(stream, " [%c%c%c%c%c%c%c]",
-		  (log->frame.flag & canMSG_EXT)        ? 'x' : ' ',
-		  (log->frame.flag & canMSG_RTR)        ? 'R' : ' ',
-		  (log->frame.flag & canMSGERR_OVERRUN) ? 'o' : ' ',
-		  (log->frame.flag & canMSG_NERR)       ? 'N' : ' ', // TJA 1053/1054 transceivers only
-		  (log->frame.flag & canFDMSG_FDF)      ? 'F' : ' ',
-		  (log->frame.flag & canFDMSG_BRS)      ? 'B' : ' ',
-		  (log->frame.flag & canFDMSG_ESI)      ? 'E' : ' ');
-	}
+	return n;
+}
+
+void fprint_log(FILE *stream, can_log *log, int verbose){
+	char buf[LOG_LINE_MAX];
+	int len;
 
-    fprintf(stream, "\n");
+	len = sprint_log(buf, log, verbose);
+	fwrite(buf, 1, len, stream);
 }
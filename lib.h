@@ -1,18 +1,34 @@
 #ifndef LIB_H
 #define LIB_H
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include "posix/compat.h"
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <signal.h>
+#ifdef _WIN32
 #include <mmsystem.h>
+#include <conio.h>
+#endif
 #include <stdint.h>
+#ifdef HAVE_CANLIB
 #include <canlib.h>  // KVASER SDK
+#else
+#include "posix/canflags.h"
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include "linux/can.h"
 
+#ifdef _WIN32
 #pragma comment(lib, "winmm.lib")
+#endif
 
 typedef __int8  __i8;
 typedef __int32 __i32;
@@ -23,6 +39,7 @@ typedef unsigned __int32 __u32;
 #define CAN_BITRATE_DEFAULT 500000
 #define CANFD_DATA_BITRATE_DEFAULT 2000000
 #define MAX_CHANNELS 16
+#define LOG_LINE_MAX 256
 
 extern volatile int stop_flag;
 
@@ -39,40 +56,582 @@ typedef struct {
 	can_frame frame;
 } can_log;
 
+// Device to host clock mapping of a channel, see clock.c
+#define CLOCK_SAMPLES 32
+#define CLOCK_SAMPLE_INTERVAL 1000000
+
+typedef struct {
+	int started;
+	uint64_t last;          // newest extended timestamp
+	uint64_t dev[CLOCK_SAMPLES];
+	uint64_t host[CLOCK_SAMPLES];
+	int num;
+	int next;
+	uint64_t min_rtt;
+	// fit: host = host_ref + mean_host + slope * (dev - dev_ref - mean_dev)
+	uint64_t dev_ref;
+	uint64_t host_ref;
+	double mean_dev;
+	double mean_host;
+	double slope;
+} device_clock;
+
+struct can_driver;
+
 typedef struct {
 	int channel;
     int fd;
 	int bitrate;
 	int data_bitrate;
 	int state;
+	const struct can_driver *driver;
+	char ifname[32];    // device name for drivers other than Kvaser
+	int load;           // synthetic bus load in percent, sim only
+	int tx_pending;     // frames queued with kv_send, not acknowledged yet
     CanHandle handle;
+	int sock;
+	HANDLE event;       // signaled by the driver when frames arrive
+	device_clock clock;
 } can_channel;
 
+/**
+ * Backend of a channel, see driver.c
+ *
+ * Timestamps from read_batch and read_timer are 64-bit device time in
+ * microseconds, mapped to host time by the channel's device_clock.
+ * read_batch also returns the channel's own frames once they are on the
+ * bus, flagged canMSG_TXACK. send queues frames without waiting for the
+ * bus and takes as many as the driver's TX buffer has room for.
+ * Optional operations are NULL.
+ *
+ */
+typedef struct can_driver {
+	const char *name;       // prefix of the channel spec, e.g. "sock" for sock:vcan0
+	int (*open)(can_channel *ch);
+	int (*configure)(can_channel *ch);
+	int (*bus_on)(can_channel *ch);
+	int (*bus_off)(can_channel *ch);
+	int (*read_batch)(can_channel *ch, can_log *logs, int max, DWORD timeout);
+	int (*write_batch)(can_channel *ch, can_frame *frames, int n, DWORD timeout);
+	int (*send)(can_channel *ch, can_frame *frames, int n);
+	int (*read_timer)(can_channel *ch, uint64_t *time);
+	int (*set_filter)(can_channel *ch, __u32 code, __u32 mask, int ext);
+	void (*close)(can_channel *ch);
+} can_driver;
+
+#ifdef HAVE_CANLIB
+extern const can_driver kvaser_driver;
+#endif
+#ifdef HAVE_SOCKETCAN
+extern const can_driver socketcan_driver;
+#endif
+extern const can_driver sim_driver;
+
 extern can_channel channels[MAX_CHANNELS];
 
+#define CACHE_LINE_SIZE 64
+
+// Binary capture format, see logfile.c
+#define BINLOG_VERSION 1
+#define BINLOG_HEADER_SIZE 8
+#define BINLOG_RECORD_MAX 96
+
+// Sequential reader for compact text logs and binary captures
+#define READER_BUFFER_SIZE (256 * 1024)
+
+typedef struct {
+	FILE *fp;
+	int binary;
+	int compressed;
+	int eof;
+	uint64_t last_ts;
+	char *buf;
+	size_t pos;
+	size_t len;
+	uint64_t base;          // offset of buf in the (uncompressed) log
+	uint64_t offset;        // offset of the last frame returned
+	uint64_t offset_ts;     // binary: time the delta of that frame is based on
+#ifdef HAVE_ZSTD
+	ZSTD_DStream *dstream;
+	char *zbuf;
+	size_t zpos;
+	size_t zlen;
+	size_t zsize;
+#endif
+} log_reader;
+
+// Parallel parser for large compact text logs, see parse.c
+#define PARSE_MAX_THREADS 64
+#define PARSE_MAX_CHUNKS (PARSE_MAX_THREADS * 2)
+
+typedef struct {
+	can_log *logs;
+	int num;
+	int max;
+	uint64_t offset;        // in the file
+	size_t len;
+	uint64_t error;         // offset of the broken line
+	int state;
+} parse_chunk;
+
+typedef struct {
+	HANDLE file;
+	HANDLE mapping;
+	const char *data;
+	uint64_t size;
+	uint64_t next_offset;   // start of the next chunk to cut
+	uint64_t next_seq;
+	uint64_t consume_seq;
+	uint64_t error;
+	int held;               // chunk consume_seq - 1 is still with the caller
+	int stop;
+	int started;
+	int num_chunks;
+	parse_chunk chunks[PARSE_MAX_CHUNKS];
+	int num_threads;
+	HANDLE threads[PARSE_MAX_THREADS];
+	CRITICAL_SECTION mutex;
+	CONDITION_VARIABLE work;
+	CONDITION_VARIABLE done;
+} log_parser;
+
+// Sparse time index of a log (<log>.idx), see index.c
+#define INDEX_SUFFIX ".idx"
+#define INDEX_FRAMES_DEFAULT 10000
+#define INDEX_PERIOD_DEFAULT 1000000    // us
+
+typedef struct {
+	char magic[8];
+	uint32_t channels;
+	uint32_t entry_size;
+	uint64_t frames;        // an entry every frames frames
+	uint64_t period;        // or every period us
+	uint64_t log_size;      // of the indexed log, 0 while it is still being written
+	uint64_t log_mtime;     // FILETIME of its last write
+} index_header;
+
+typedef struct {
+	uint64_t timestamp;     // of the frame at offset
+	uint64_t offset;        // byte offset of the frame in the log
+	uint64_t base_ts;       // binary: time the frame's delta is based on
+	uint64_t counts[MAX_CHANNELS];  // frames per channel before offset
+} index_entry;
+
+typedef struct {
+	uint64_t frames;
+	uint64_t period;
+	uint64_t since;         // frames since the last entry
+	uint64_t last_ts;       // time of the last entry
+	uint64_t entries;
+	uint64_t counts[MAX_CHANNELS];
+} index_state;
+
+// Log parsed into memory for replay, see replay.c
+#define REPLAY_BLOCK_SIZE (1024 * 1024)
+
+typedef struct {
+	size_t used;
+	char data[REPLAY_BLOCK_SIZE];
+} replay_block;
+
+typedef struct {
+	replay_block **blocks;
+	int num_blocks;
+	int max_blocks;
+	uint64_t start_ts;      // timestamp of the first frame
+	uint64_t duration;      // us from the first to the last frame
+	uint64_t frames;
+} replay_plan;
+
+typedef struct {
+	int block;
+	size_t pos;
+	uint64_t time;          // us after the first frame
+} replay_cursor;
+
+// Stuff bits counted by can_frame_bits, see bustime.c
+#define CAN_STUFF_NONE 0
+#define CAN_STUFF_EXACT 1
+
+// Log-linear histogram, see hist.c
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	double sum;
+} histogram;
+
+// Deadline waits, see sched.c
+#ifdef _WIN32
+#define SCHED_SPIN_DEFAULT 1500
+#else
+#define SCHED_SPIN_DEFAULT 200
+#endif
+
+typedef struct {
+	HANDLE timer;
+	uint64_t spin;          // us before a deadline to stop sleeping and busy-wait
+} sched_timer;
+
+// Log file writer, see writer.c
+#define WRITER_CHUNK_SIZE (256 * 1024)
+#define WRITER_CHUNKS 16
+#define WRITER_ZSTD_LEVEL 3
+#define WRITER_MARKS 64         // index entries per chunk at most
+
+// same values as ZSTD_EndDirective
+#define WRITER_MODE_CONTINUE 0
+#define WRITER_MODE_FLUSH 1
+#define WRITER_MODE_END 2
+
+typedef struct {
+	char *data;
+	size_t len;
+	int flush;
+	uint64_t base_ts;
+	uint64_t frames[MAX_CHANNELS];  // in the chunk
+	// index entries, offsets within the chunk
+	uint64_t first_ts;
+	uint64_t counts[MAX_CHANNELS];  // frames before the chunk
+	index_entry *marks;
+	int num_marks;
+} writer_chunk;
+
+typedef struct {
+	char path[_MAX_PATH];
+	int binary;
+	int compress;
+	uint64_t rotate_size;
+	uint64_t rotate_period;
+	int index;              // write <file>.idx along
+	// owned by the writer thread
+	FILE *fp;
+	FILE *index_fp;
+	char file_path[_MAX_PATH + 16];         // of fp
+	uint64_t index_base[MAX_CHANNELS];      // frames before the current file
+	int file_index;
+	uint64_t file_bytes;
+	uint64_t next_rotate;
+	int failed;             // a write failed, later chunks are dropped
+	volatile uint64_t dropped[MAX_CHANNELS];       // frames of chunks not written
+	// owned by the output thread
+	writer_chunk *current;
+	uint64_t last_ts;
+	index_state marker;
+	// chunk exchange
+	writer_chunk chunks[WRITER_CHUNKS];
+	writer_chunk *free[WRITER_CHUNKS];
+	int num_free;
+	writer_chunk *full[WRITER_CHUNKS];
+	int full_head;
+	int num_full;
+	int done;
+	CRITICAL_SECTION mutex;
+	CONDITION_VARIABLE not_empty;
+	CONDITION_VARIABLE not_full;
+	HANDLE thread;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *cctx;
+	char *zbuf;
+	size_t zsize;
+#endif
+} log_writer;
+
+// Flight recorder, see recorder.c
+#define RECORDER_MAX_TRIGGERS 16
+#define RECORDER_OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+	__u32 id;
+	__u32 mask;
+	__u8 data[CANFD_MAX_DLEN];
+	int len;
+} recorder_match_rule;
+
+typedef struct {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t reserved;
+	uint64_t capacity;
+	uint64_t head;
+} recorder_header;
+
+typedef struct {
+	char path[_MAX_PATH];
+	HANDLE file;
+	HANDLE mapping;
+	char *base;
+	uint64_t size;
+	recorder_header *hdr;
+	can_log *records;
+	uint64_t pre;
+	uint64_t post;
+	recorder_match_rule triggers[RECORDER_MAX_TRIGGERS];
+	int num_triggers;
+	int triggered;
+	uint64_t trigger_time;
+	int dumps;
+	// frozen window, written out by the dump thread
+	HANDLE dump_thread;
+	can_log *dump_logs;
+	uint64_t dump_count;
+	char dump_path[_MAX_PATH + 16];
+} flight_recorder;
+
+// Thread-Safe Queue
+typedef struct {
+    can_log* buffer;
+    int head;
+    int tail;
+    int count;
+    int size;
+    CRITICAL_SECTION mutex;
+    CONDITION_VARIABLE not_empty;
+    CONDITION_VARIABLE not_full;
+} log_queue;
+
+// Lock-free single-producer/single-consumer ring
+typedef struct {
+	// producer side
+	volatile unsigned int head;
+	unsigned int tail_cache;
+	char pad0[CACHE_LINE_SIZE - 2 * sizeof(unsigned int)];
+	// consumer side
+	volatile unsigned int tail;
+	unsigned int head_cache;
+	char pad1[CACHE_LINE_SIZE - 2 * sizeof(unsigned int)];
+	// read-only after init
+	can_log *buffer;
+	unsigned int mask;
+	int overwrite;      // set before first use when the producer calls spsc_ring_push_overwrite
+} spsc_ring;
+
+// Live per-ID statistics, see stat.c
+#define STAT_EMPTY 0xFFFFFFFFU
+
+typedef struct {
+	__u32 id;               // key of the EFF table, STAT_EMPTY if unused
+	__u32 flag;
+	uint64_t count;
+	uint64_t last_count;    // count at the previous redraw
+	uint64_t last_ts;
+	uint32_t period;        // us, moving average
+	uint32_t jitter;        // us, moving average of |delta - period|
+	__u8 dlc;
+	__u8 data[8];
+} id_stat;
+
+typedef struct {
+	id_stat *sff;           // direct, indexed by 11-bit id
+	id_stat *eff;           // open addressing
+	unsigned int eff_mask;
+	unsigned int eff_used;
+	uint64_t bus_time;      // ns on the bus since the previous redraw
+	uint64_t frames;
+} stat_table;
+
+// CAN-ID filters of one channel, see filter.c
+#define CAN_FILTER_MAX 64
+
+typedef struct {
+	__u32 id;
+	__u32 mask;
+	int ext;
+	int inverted;
+} can_filter_rule;
+
+typedef struct {
+	int num_rules;
+	can_filter_rule rules[CAN_FILTER_MAX];
+	// compiled
+	__u32 sff_bitmap[(CAN_SFF_MASK + 1) / 32];
+	__u32 *eff_set;
+	unsigned int eff_mask;
+	int eff_shift;
+	int eff_all;
+	int num_eff_rules;
+	can_filter_rule eff_rules[CAN_FILTER_MAX];
+} can_filter;
+
+// Per-channel FIFOs merged by timestamp, see merge.c
+typedef struct {
+	can_log *logs;
+	uint64_t *arrival;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int mask;
+} merge_fifo;
+
+typedef struct {
+	merge_fifo fifos[MAX_CHANNELS];
+	int heap[MAX_CHANNELS];
+	int heap_len;
+	int channels;
+	uint64_t window;
+} log_merger;
+
+// Overflow of a ring, frames kept in a temporary file until the ring has drained
+typedef struct {
+	FILE *fp;
+	char path[_MAX_PATH];
+	CRITICAL_SECTION mutex;
+	volatile int active;
+	fpos_t start;
+	fpos_t read_pos;
+	fpos_t write_pos;
+	uint64_t written;
+	uint64_t read;
+} spill_file;
+
 
 void basename(const char *path, char *fname, size_t len);
 uint64_t get_unix_time();
 int gettimeofday(struct timeval * tp);
 int gettimeofday_ms(struct timeval * tp);
+uint64_t get_monotonic_time();
 
 int parse_bitrate(const char* cs);
 int parse_canchannel(const char *cs, can_channel *ch);
 int parse_canframe(char *cs, can_frame *cf);
+int hexstring2data(char *arg, unsigned char *data, int maxdlen);
+unsigned char can_fd_dlc2len(unsigned char dlc);
+unsigned char can_fd_len2dlc(unsigned char len);
+int put_hex_data(char *buf, const __u8 *data, int len);
+int sprint_canframe(char *buf, can_frame *cf);
 
 void pp_canframe(can_frame *cf);
 void pp_canchannel(int channel_num, can_channel *ch);
+int sprint_log(char *buf, can_log *log, int verbose);
 void fprint_log(FILE *stream, can_log *log, int verbose);
 
+int init_queue(log_queue* queue, int size);
+void destroy_queue(log_queue* queue);
+int enqueue_frame(log_queue* queue, const can_log* frame);
+int dequeue_frame(log_queue* queue, can_log* frame);
+int dequeue_frames(log_queue* queue, can_log* frames, int max, DWORD timeout);
+
+int spsc_ring_init(spsc_ring *ring, unsigned int size);
+void spsc_ring_destroy(spsc_ring *ring);
+int spsc_ring_push(spsc_ring *ring, const can_log *log);
+int spsc_ring_push_overwrite(spsc_ring *ring, const can_log *log);
+int spsc_ring_pop(spsc_ring *ring, can_log *log);
+int spsc_ring_pop_batch(spsc_ring *ring, can_log *logs, int max);
+unsigned int spsc_ring_count(spsc_ring *ring);
+
+void clock_init(device_clock *c);
+uint64_t clock_extend(device_clock *c, uint32_t raw);
+void clock_sample(device_clock *c, uint64_t dev, uint64_t before, uint64_t after);
+uint64_t clock_to_host(device_clock *c, uint64_t dev);
+
+int filter_add(can_filter *f, const char *cs);
+int filter_compile(can_filter *f);
+void filter_destroy(can_filter *f);
+int filter_match(can_filter *f, can_frame *cf);
+int filter_hw_mask(can_filter *f, int ext, __u32 *code, __u32 *mask);
+
+int merger_init(log_merger *m, unsigned int size, int channels, uint64_t window);
+void merger_destroy(log_merger *m);
+unsigned int merger_space(log_merger *m, int ch);
+int merger_push(log_merger *m, can_log *log, uint64_t now);
+int merger_pop(log_merger *m, can_log *log, uint64_t now, int force);
+uint64_t merger_due(log_merger *m, uint64_t now);
+
+int spill_open(spill_file *sp);
+void spill_close(spill_file *sp);
+int spill_write(spill_file *sp, const can_log *log);
+int spill_read(spill_file *sp, can_log *logs, int max);
+
+void binlog_get_header(__u8 *buf);
+int binlog_write_header(FILE *fp);
+int binlog_check_header(const __u8 *buf);
+int binlog_encode(__u8 *buf, can_log *log, uint64_t *last_ts);
+int binlog_decode(const __u8 *body, int len, can_log *log, uint64_t *last_ts);
+int binlog_write(FILE *fp, can_log *log, uint64_t *last_ts);
+
+int log_reader_open(log_reader *reader, const char *path);
+void log_reader_rewind(log_reader *reader);
+void log_reader_close(log_reader *reader);
+int log_reader_next(log_reader *reader, can_log *log);
+int log_reader_seek(log_reader *reader, uint64_t offset, uint64_t last_ts);
+
+int log_parser_open(log_parser *lp, const char *path, int threads, uint64_t offset);
+void log_parser_close(log_parser *lp);
+int log_parser_next(log_parser *lp, can_log **logs);
+
+int replay_plan_load(replay_plan *plan, const char *path, int threads, uint64_t start, uint64_t end);
+void replay_plan_free(replay_plan *plan);
+int replay_plan_split(replay_plan *plan, replay_plan *out);
+void replay_rewind(replay_cursor *cur);
+int replay_next(replay_plan *plan, replay_cursor *cur, int *channel, can_frame *cf);
+
+void index_init(index_state *ix, uint64_t frames, uint64_t period);
+int index_next(index_state *ix, can_log *log, index_entry *e);
+int index_log_stamp(const char *path, uint64_t *size, uint64_t *mtime);
+int index_write_header(FILE *fp, uint64_t frames, uint64_t period, uint64_t log_size, uint64_t log_mtime);
+int index_write_entry(FILE *fp, index_entry *e);
+int index_build(const char *path, uint64_t frames, uint64_t period);
+int index_lookup(const char *path, uint64_t time, index_entry *e, uint64_t *first_ts);
+
+void can_frame_bits(can_frame *cf, int stuffing, int *nominal, int *data);
+uint64_t can_frame_time(can_frame *cf, int bitrate, int data_bitrate);
+
+void hist_init(histogram *h);
+void hist_record(histogram *h, uint64_t v);
+void hist_merge(histogram *h, const histogram *other);
+uint64_t hist_percentile(const histogram *h, double percent);
+void hist_print(FILE *stream, const histogram *h, const char *unit);
+
+int sched_timer_init(sched_timer *t, uint64_t spin);
+void sched_timer_close(sched_timer *t);
+uint64_t sched_wait_until(sched_timer *t, uint64_t deadline);
+int sched_set_realtime(void);
+
+int writer_open(log_writer *w, const char *path, int binary, int compress, uint64_t rotate_size, uint64_t rotate_period, int index);
+void writer_write_log(log_writer *w, can_log *log, int verbose);
+void writer_flush(log_writer *w);
+void writer_close(log_writer *w);
+
+int recorder_open(flight_recorder *fr, const char *path, uint64_t size);
+void recorder_close(flight_recorder *fr);
+int recorder_add_trigger(flight_recorder *fr, const char *cs);
+void recorder_trigger(flight_recorder *fr, uint64_t time);
+void recorder_write(flight_recorder *fr, can_log *log);
+void recorder_poll(flight_recorder *fr, uint64_t now);
+
+int capture_add_channel(const char *arg);
+int capture_init();
+int capture_start();
+int capture_read(can_log *logs, int max, DWORD timeout);
+void capture_join();
+void capture_stop();
+
 int candump(int argc, char *argv[]);
 int cansend(int argc, char *argv[]);
 int canplay(int argc, char *argv[]);
+int canbench(int argc, char *argv[]);
+int canindex(int argc, char *argv[]);
+int cangen(int argc, char *argv[]);
+int cancyclic(int argc, char *argv[]);
+int canlatency(int argc, char *argv[]);
+int canstat(int argc, char *argv[]);
 
+const can_driver *kv_find_driver(const char *name, size_t len);
+int kv_free_channel(void);
 int kv_initialize(void);
 int kv_setup_channel(int channel_num, can_channel *ch_param);
 void kv_sync_bus_on();
 int kv_write(int channel_num, can_frame *cf);
-int kv_read(int channel_num, long *id, void *msg, unsigned int *dlc, unsigned int *flag, unsigned long *time);
+int kv_write_batch(int channel_num, can_frame *frames, int n);
+int kv_send(int channel_num, can_frame *frames, int n);
+int kv_tx_acks(int channel_num, can_log *acks, int max, DWORD timeout);
+int kv_flush(int channel_num, DWORD timeout);
+int kv_read_batch(int channel_num, can_log *logs, int max);
+int kv_sample_clock(int channel_num);
+int kv_set_filter(int channel_num, __u32 code, __u32 mask, int ext);
 void kv_close_channel(int channel_num);
 void kv_cleanup_channels(void);
 
@@ -44,9 +44,14 @@
  */
 
 #include <string.h>
-#include "linux/can.h"
+#include "can.h"
 #include "../lib.h"
 
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+
 #define CANID_DELIM '#'
 #define CC_DLC_DELIM '_'
 #define XL_HDR_DELIM ':'
@@ -75,6 +80,81 @@ static inline void _put_id(char *buf, int end_offset, __u32 id)
 #define put_sff_id(buf, id) _put_id(buf, 2, id)
 #define put_eff_id(buf, id) _put_id(buf, 7, id)
 
+#ifdef HAVE_SSE2
+/* hex encode 16 bytes into 32 upper case characters */
+static inline void put_hex_block16(char *buf, const __u8 *data)
+{
+	const __m128i nmask = _mm_set1_epi8(0x0F);
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i ascii0 = _mm_set1_epi8('0');
+	const __m128i alpha = _mm_set1_epi8('A' - '0' - 10);
+	__m128i in, hi, lo;
+
+	in = _mm_loadu_si128((const __m128i *)data);
+	hi = _mm_and_si128(_mm_srli_epi16(in, 4), nmask);
+	lo = _mm_and_si128(in, nmask);
+
+	/* '0' + n, plus the gap to 'A' for n > 9 */
+	hi = _mm_add_epi8(_mm_add_epi8(hi, ascii0), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), alpha));
+	lo = _mm_add_epi8(_mm_add_epi8(lo, ascii0), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), alpha));
+
+	_mm_storeu_si128((__m128i *)buf, _mm_unpacklo_epi8(hi, lo));
+	_mm_storeu_si128((__m128i *)(buf + 16), _mm_unpackhi_epi8(hi, lo));
+}
+#endif
+
+/* hex encode len bytes, returns the number of characters written */
+int put_hex_data(char *buf, const __u8 *data, int len)
+{
+	int i = 0;
+
+#ifdef HAVE_SSE2
+	for (; i + 16 <= len; i += 16)
+		put_hex_block16(buf + 2 * i, data + i);
+#endif
+	for (; i < len; i++)
+		put_hex_byte(buf + 2 * i, data[i]);
+
+	return 2 * len;
+}
+
+int sprint_canframe(char *buf, can_frame *cf)
+{
+	/* <can-id>#{#<flags>}<data> without terminating zero */
+
+	int offset;
+	int len = cf->dlc;
+
+	if (cf->flag & canMSG_EXT) {
+		put_eff_id(buf, cf->id & CAN_EFF_MASK);
+		offset = 8;
+	} else {
+		put_sff_id(buf, cf->id & CAN_SFF_MASK);
+		offset = 3;
+	}
+	buf[offset++] = CANID_DELIM;
+
+	if (cf->flag & canFDMSG_FDF) {
+		int flags = CANFD_FDF;
+
+		if (cf->flag & canFDMSG_BRS)
+			flags |= CANFD_BRS;
+		if (cf->flag & canFDMSG_ESI)
+			flags |= CANFD_ESI;
+
+		buf[offset++] = CANID_DELIM;
+		buf[offset++] = hex_asc_upper_lo(flags);
+	}
+
+	/* clip when DLC exceeds */
+	if (len > CANFD_MAX_DLEN)
+		len = CANFD_MAX_DLEN;
+
+	offset += put_hex_data(buf + offset, cf->msg, len);
+
+	return offset;
+}
+
 /* CAN DLC to real data length conversion helpers */
 
 static const unsigned char dlc2len[] = {0, 1, 2, 3, 4, 5, 6, 7,
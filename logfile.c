@@ -0,0 +1,426 @@
+#include "lib.h"
+
+/**
+ * Binary capture format
+ *
+ *  header : "KVCB" <version> 0 0 0
+ *  record : <len> <body>
+ *    len    u8, number of body bytes
+ *    body   varint  timestamp delta to previous record (zigzag, us)
+ *           u8      channel
+ *           u8      BINLOG_F_* flags
+ *           u16/u32 can-id, little endian (u32 with BINLOG_F_EXT)
+ *           u8      dlc, only with BINLOG_F_RTR
+ *           ...     payload, the rest of the body
+ *
+ * A classic 8-byte frame with a small delta takes 15 bytes.
+ *
+ */
+static const __u8 binlog_magic[BINLOG_HEADER_SIZE] = {'K', 'V', 'C', 'B', BINLOG_VERSION, 0, 0, 0};
+
+#define BINLOG_F_EXT     0x01
+#define BINLOG_F_RTR     0x02
+#define BINLOG_F_FDF     0x04
+#define BINLOG_F_BRS     0x08
+#define BINLOG_F_ESI     0x10
+#define BINLOG_F_OVERRUN 0x20
+#define BINLOG_F_NERR    0x40
+
+static int put_varint(__u8 *buf, uint64_t v){
+	int n = 0;
+
+	while(v >= 0x80){
+		buf[n++] = (__u8)(v | 0x80);
+		v >>= 7;
+	}
+	buf[n++] = (__u8)v;
+
+	return n;
+}
+
+static int get_varint(const __u8 *buf, int len, uint64_t *v){
+	int n = 0, shift = 0;
+
+	*v = 0;
+	while(n < len && shift < 64){
+		*v |= (uint64_t)(buf[n] & 0x7F) << shift;
+		if((buf[n++] & 0x80) == 0){
+			return n;
+		}
+		shift += 7;
+	}
+
+	return -1;
+}
+
+void binlog_get_header(__u8 *buf){
+	memcpy(buf, binlog_magic, BINLOG_HEADER_SIZE);
+}
+
+int binlog_write_header(FILE *fp){
+	if(fwrite(binlog_magic, 1, BINLOG_HEADER_SIZE, fp) != BINLOG_HEADER_SIZE){
+		return -1;
+	}
+	return 0;
+}
+
+int binlog_check_header(const __u8 *buf){
+	return memcmp(buf, binlog_magic, BINLOG_HEADER_SIZE) == 0;
+}
+
+// Encode one record into buf (at least BINLOG_RECORD_MAX bytes), returns its size.
+int binlog_encode(__u8 *buf, can_log *log, uint64_t *last_ts){
+	int n = 1;
+	int64_t delta;
+	__u8 flags = 0;
+	unsigned int flag = log->frame.flag;
+	unsigned int dlc = log->frame.dlc;
+
+	delta = (int64_t)(log->timestamp - *last_ts);
+	*last_ts = log->timestamp;
+
+	// zigzag so a frame from a slightly late channel stays small
+	n += put_varint(&buf[n], ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+	buf[n++] = (__u8)log->channel;
+
+	if(flag & canMSG_EXT)        flags |= BINLOG_F_EXT;
+	if(flag & canMSG_RTR)        flags |= BINLOG_F_RTR;
+	if(flag & canFDMSG_FDF)      flags |= BINLOG_F_FDF;
+	if(flag & canFDMSG_BRS)      flags |= BINLOG_F_BRS;
+	if(flag & canFDMSG_ESI)      flags |= BINLOG_F_ESI;
+	if(flag & canMSGERR_OVERRUN) flags |= BINLOG_F_OVERRUN;
+	if(flag & canMSG_NERR)       flags |= BINLOG_F_NERR;
+	buf[n++] = flags;
+
+	buf[n++] = (__u8)(log->frame.id);
+	buf[n++] = (__u8)(log->frame.id >> 8);
+	if(flags & BINLOG_F_EXT){
+		buf[n++] = (__u8)(log->frame.id >> 16);
+		buf[n++] = (__u8)(log->frame.id >> 24);
+	}
+
+	if(dlc > CANFD_MAX_DLEN){
+		dlc = CANFD_MAX_DLEN;
+	}
+
+	if(flags & BINLOG_F_RTR){
+		buf[n++] = (__u8)dlc;
+	}
+	else{
+		memcpy(&buf[n], log->frame.msg, dlc);
+		n += dlc;
+	}
+
+	buf[0] = (__u8)(n - 1);
+
+	return n;
+}
+
+// Decode one record body of len bytes, returns 0 or -1 for a broken record.
+int binlog_decode(const __u8 *body, int len, can_log *log, uint64_t *last_ts){
+	int n, ret, idlen;
+	uint64_t zz;
+	__u8 flags;
+
+	ret = get_varint(body, len, &zz);
+	if(ret < 0 || ret + 4 > len){
+		return -1;
+	}
+	n = ret;
+
+	*last_ts += (uint64_t)((int64_t)(zz >> 1) ^ -(int64_t)(zz & 1));
+	log->timestamp = *last_ts;
+	log->channel = body[n++];
+	flags = body[n++];
+
+	idlen = (flags & BINLOG_F_EXT) ? 4 : 2;
+	if(n + idlen > len){
+		return -1;
+	}
+	log->frame.id = body[n] | (body[n + 1] << 8);
+	if(idlen == 4){
+		log->frame.id |= ((__u32)body[n + 2] << 16) | ((__u32)body[n + 3] << 24);
+	}
+	n += idlen;
+
+	log->frame.flag = 0;
+	if(flags & BINLOG_F_EXT)     log->frame.flag |= canMSG_EXT;
+	if(flags & BINLOG_F_RTR)     log->frame.flag |= canMSG_RTR;
+	if(flags & BINLOG_F_FDF)     log->frame.flag |= canFDMSG_FDF;
+	if(flags & BINLOG_F_BRS)     log->frame.flag |= canFDMSG_BRS;
+	if(flags & BINLOG_F_ESI)     log->frame.flag |= canFDMSG_ESI;
+	if(flags & BINLOG_F_OVERRUN) log->frame.flag |= canMSGERR_OVERRUN;
+	if(flags & BINLOG_F_NERR)    log->frame.flag |= canMSG_NERR;
+
+	if(flags & BINLOG_F_RTR){
+		if(n >= len){
+			return -1;
+		}
+		log->frame.dlc = body[n];
+	}
+	else{
+		if(len - n > CANFD_MAX_DLEN){
+			return -1;
+		}
+		log->frame.dlc = len - n;
+		memcpy(log->frame.msg, &body[n], len - n);
+	}
+
+	return 0;
+}
+
+int binlog_write(FILE *fp, can_log *log, uint64_t *last_ts){
+	__u8 buf[BINLOG_RECORD_MAX];
+	int len;
+
+	len = binlog_encode(buf, log, last_ts);
+	if(fwrite(buf, 1, len, fp) != (size_t)len){
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Sequential reader for compact text logs and binary captures, both
+ * optionally zstd compressed (candump -z). The format is detected from
+ * the first bytes of the file, the input is read in large blocks.
+ *
+ */
+static const __u8 zstd_magic[4] = {0x28, 0xB5, 0x2F, 0xFD};
+
+// Move the unread rest to the front and append more input, returns bytes added or -1.
+static int log_reader_fill(log_reader *reader){
+	size_t n;
+
+	if(reader->pos > 0){
+		memmove(reader->buf, reader->buf + reader->pos, reader->len - reader->pos);
+		reader->base += reader->pos;
+		reader->len -= reader->pos;
+		reader->pos = 0;
+	}
+
+	if(reader->eof || reader->len == READER_BUFFER_SIZE){
+		return 0;
+	}
+
+#ifdef HAVE_ZSTD
+	if(reader->compressed){
+		ZSTD_outBuffer out = {reader->buf, READER_BUFFER_SIZE, reader->len};
+		ZSTD_inBuffer in;
+		size_t ret;
+
+		while(out.pos == reader->len){
+			if(reader->zpos == reader->zlen){
+				reader->zlen = fread(reader->zbuf, 1, reader->zsize, reader->fp);
+				reader->zpos = 0;
+				if(reader->zlen == 0){
+					reader->eof = 1;
+					break;
+				}
+			}
+
+			in.src = reader->zbuf;
+			in.size = reader->zlen;
+			in.pos = reader->zpos;
+			ret = ZSTD_decompressStream(reader->dstream, &out, &in);
+			reader->zpos = in.pos;
+
+			if(ZSTD_isError(ret)){
+				fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(ret));
+				return -1;
+			}
+		}
+
+		n = out.pos - reader->len;
+		reader->len = out.pos;
+
+		return (int)n;
+	}
+#endif
+
+	n = fread(reader->buf + reader->len, 1, READER_BUFFER_SIZE - reader->len, reader->fp);
+	if(n == 0){
+		reader->eof = 1;
+	}
+	reader->len += n;
+
+	return (int)n;
+}
+
+int log_reader_open(log_reader *reader, const char *path){
+	__u8 magic[sizeof(zstd_magic)];
+
+	memset(reader, '\0', sizeof(log_reader));
+
+	if(fopen_s(&reader->fp, path, "rb") != 0){
+		return -1;
+	}
+
+	// one spare byte to terminate the last text line
+	reader->buf = (char*)malloc(READER_BUFFER_SIZE + 1);
+	if(reader->buf == NULL){
+		log_reader_close(reader);
+		return -1;
+	}
+
+	if(fread(magic, 1, sizeof(magic), reader->fp) == sizeof(magic)
+		&& memcmp(magic, zstd_magic, sizeof(magic)) == 0){
+#ifdef HAVE_ZSTD
+		reader->compressed = 1;
+		reader->dstream = ZSTD_createDStream();
+		reader->zsize = ZSTD_DStreamInSize();
+		reader->zbuf = (char*)malloc(reader->zsize);
+		if(reader->dstream == NULL || reader->zbuf == NULL){
+			log_reader_close(reader);
+			return -1;
+		}
+#else
+		fprintf(stderr, "%s is compressed, this build has no zstd support\n", path);
+		log_reader_close(reader);
+		return -1;
+#endif
+	}
+
+	log_reader_rewind(reader);
+
+	return 0;
+}
+
+void log_reader_rewind(log_reader *reader){
+	fseek(reader->fp, 0, SEEK_SET);
+	reader->pos = 0;
+	reader->len = 0;
+	reader->eof = 0;
+	reader->last_ts = 0;
+	reader->base = 0;
+
+#ifdef HAVE_ZSTD
+	if(reader->compressed){
+		ZSTD_DCtx_reset(reader->dstream, ZSTD_reset_session_only);
+		reader->zpos = 0;
+		reader->zlen = 0;
+	}
+#endif
+
+	log_reader_fill(reader);
+
+	reader->binary = reader->len >= BINLOG_HEADER_SIZE && binlog_check_header((__u8*)reader->buf);
+	if(reader->binary){
+		reader->pos = BINLOG_HEADER_SIZE;
+	}
+}
+
+void log_reader_close(log_reader *reader){
+	if(reader->fp){
+		fclose(reader->fp);
+		reader->fp = NULL;
+	}
+
+	free(reader->buf);
+	reader->buf = NULL;
+
+#ifdef HAVE_ZSTD
+	if(reader->dstream){
+		ZSTD_freeDStream(reader->dstream);
+		reader->dstream = NULL;
+	}
+	free(reader->zbuf);
+	reader->zbuf = NULL;
+#endif
+}
+
+// Returns 0 with the next frame in log, 1 at end of file, -1 for a broken line/record.
+int log_reader_next(log_reader *reader, can_log *log){
+	char frbuf[LOG_LINE_MAX];
+	char *line, *nl;
+	long sec, usec;
+	size_t len;
+
+	if(reader->binary){
+		if(reader->pos == reader->len && log_reader_fill(reader) <= 0){
+			return reader->pos == reader->len ? 1 : -1;
+		}
+
+		len = (__u8)reader->buf[reader->pos];
+		if(reader->len - reader->pos < 1 + len){
+			log_reader_fill(reader);
+			if(reader->len - reader->pos < 1 + len){
+				return -1;
+			}
+		}
+
+		reader->offset = reader->base + reader->pos;
+		reader->offset_ts = reader->last_ts;
+		reader->pos += 1 + len;
+
+		return binlog_decode((__u8*)reader->buf + reader->pos - len, (int)len, log, &reader->last_ts);
+	}
+
+	for(;;){
+		line = reader->buf + reader->pos;
+		nl = (char*)memchr(line, '\n', reader->len - reader->pos);
+
+		if(nl == NULL){
+			if(!reader->eof){
+				// a line longer than the whole buffer
+				if(reader->pos == 0 && reader->len == READER_BUFFER_SIZE){
+					return -1;
+				}
+				if(log_reader_fill(reader) < 0){
+					return -1;
+				}
+				continue;
+			}
+
+			if(reader->pos == reader->len){
+				return 1;
+			}
+
+			// last line without '\n'
+			nl = reader->buf + reader->len;
+		}
+
+		*nl = '\0';
+		reader->pos = nl - reader->buf + (nl < reader->buf + reader->len ? 1 : 0);
+
+		// skip until next non-comment line
+		if(line[0] != '('){
+			continue;
+		}
+
+#ifdef _WIN32
+		if(sscanf_s(line, "(%ld.%ld) %d %255s", &sec, &usec, &log->channel, frbuf, (unsigned)sizeof(frbuf)) != 4){
+#else
+		if(sscanf_s(line, "(%ld.%ld) %d %255s", &sec, &usec, &log->channel, frbuf) != 4){
+#endif
+			return -1;
+		}
+
+		log->timestamp = (uint64_t)sec * 1000000 + usec;
+		parse_canframe(frbuf, &log->frame);
+		reader->offset = reader->base + (line - reader->buf);
+
+		return 0;
+	}
+}
+
+/**
+ * Continue reading at offset, the start of a frame (e.g. from the index).
+ * Binary captures also need the time that frame's delta is based on.
+ * Returns 0 or -1 (compressed logs cannot seek).
+ *
+ */
+int log_reader_seek(log_reader *reader, uint64_t offset, uint64_t last_ts){
+	if(reader->compressed || _fseeki64(reader->fp, (long long)offset, SEEK_SET) != 0){
+		return -1;
+	}
+
+	reader->pos = 0;
+	reader->len = 0;
+	reader->eof = 0;
+	reader->base = offset;
+	reader->last_ts = last_ts;
+
+	return log_reader_fill(reader) < 0 ? -1 : 0;
+}
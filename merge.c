@@ -0,0 +1,170 @@
+#include "lib.h"
+
+/**
+ * Timestamp ordered merge of the per-channel streams
+ *
+ * Every channel delivers its frames in timestamp order, so only the
+ * fronts of the channel FIFOs have to be compared. A min-heap over the
+ * channels with a non-empty FIFO yields the oldest front.
+ *
+ * The front can be emitted once every channel has something queued, or
+ * once it has waited <window> us since it arrived: a frame of another
+ * channel with an older timestamp is expected to have shown up by then.
+ *
+ */
+
+static uint64_t merger_key(log_merger *m, int ch){
+	merge_fifo *f = &m->fifos[ch];
+
+	return f->logs[f->head & f->mask].timestamp;
+}
+
+static int merger_less(log_merger *m, int a, int b){
+	uint64_t ka = merger_key(m, a), kb = merger_key(m, b);
+
+	return ka < kb || (ka == kb && a < b);
+}
+
+static void merger_sift_up(log_merger *m, int i){
+	int parent, ch = m->heap[i];
+
+	while(i > 0){
+		parent = (i - 1) / 2;
+		if(!merger_less(m, ch, m->heap[parent])){
+			break;
+		}
+		m->heap[i] = m->heap[parent];
+		i = parent;
+	}
+	m->heap[i] = ch;
+}
+
+static void merger_sift_down(log_merger *m, int i){
+	int child, ch = m->heap[i];
+
+	for(;;){
+		child = 2 * i + 1;
+		if(child >= m->heap_len){
+			break;
+		}
+		if(child + 1 < m->heap_len && merger_less(m, m->heap[child + 1], m->heap[child])){
+			child++;
+		}
+		if(!merger_less(m, m->heap[child], ch)){
+			break;
+		}
+		m->heap[i] = m->heap[child];
+		i = child;
+	}
+	m->heap[i] = ch;
+}
+
+int merger_init(log_merger *m, unsigned int size, int channels, uint64_t window){
+	unsigned int capacity = 1;
+	int i;
+
+	while(capacity < size){
+		capacity <<= 1;
+	}
+
+	memset(m, '\0', sizeof(log_merger));
+	m->channels = channels;
+	m->window = window;
+
+	for(i = 0; i < MAX_CHANNELS; i++){
+		m->fifos[i].mask = capacity - 1;
+	}
+
+	return 0;
+}
+
+void merger_destroy(log_merger *m){
+	int i;
+
+	for(i = 0; i < MAX_CHANNELS; i++){
+		free(m->fifos[i].logs);
+		free(m->fifos[i].arrival);
+		m->fifos[i].logs = NULL;
+		m->fifos[i].arrival = NULL;
+	}
+}
+
+// Free slots of the channel FIFO, pop no more than this from its ring.
+unsigned int merger_space(log_merger *m, int ch){
+	merge_fifo *f = &m->fifos[ch];
+
+	return f->mask + 1 - (f->tail - f->head);
+}
+
+int merger_push(log_merger *m, can_log *log, uint64_t now){
+	merge_fifo *f = &m->fifos[log->channel];
+
+	if(f->logs == NULL){
+		// allocated on first use, only for channels that deliver
+		f->logs = (can_log*)malloc(sizeof(can_log) * (f->mask + 1));
+		f->arrival = (uint64_t*)malloc(sizeof(uint64_t) * (f->mask + 1));
+		if(f->logs == NULL || f->arrival == NULL){
+			return -1;
+		}
+	}
+
+	if(f->tail - f->head > f->mask){
+		return -1;
+	}
+
+	memcpy(&f->logs[f->tail & f->mask], log, sizeof(can_log));
+	f->arrival[f->tail & f->mask] = now;
+	f->tail++;
+
+	if(f->tail - f->head == 1){
+		m->heap[m->heap_len] = log->channel;
+		merger_sift_up(m, m->heap_len++);
+	}
+
+	return 0;
+}
+
+// Take the oldest frame if it is safe to emit, force drains regardless.
+// Returns 0 with the frame in log, -1 if nothing can be emitted yet.
+int merger_pop(log_merger *m, can_log *log, uint64_t now, int force){
+	merge_fifo *f;
+	int ch;
+
+	if(m->heap_len == 0){
+		return -1;
+	}
+
+	ch = m->heap[0];
+	f = &m->fifos[ch];
+
+	if(!force && m->heap_len < m->channels && now - f->arrival[f->head & f->mask] < m->window){
+		return -1;
+	}
+
+	memcpy(log, &f->logs[f->head & f->mask], sizeof(can_log));
+	f->head++;
+
+	if(f->tail == f->head){
+		m->heap[0] = m->heap[--m->heap_len];
+	}
+	if(m->heap_len > 0){
+		merger_sift_down(m, 0);
+	}
+
+	return 0;
+}
+
+// Microseconds until the oldest frame is due, 0 if one is due now or none queued.
+uint64_t merger_due(log_merger *m, uint64_t now){
+	merge_fifo *f;
+	uint64_t waited;
+
+	if(m->heap_len == 0 || m->heap_len >= m->channels){
+		return 0;
+	}
+
+	f = &m->fifos[m->heap[0]];
+	waited = now - f->arrival[f->head & f->mask];
+
+	return waited >= m->window ? 0 : m->window - waited;
+}
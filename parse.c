@@ -0,0 +1,343 @@
+#include "lib.h"
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define PARSE_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/**
+ * Parallel parser for compact text logs
+ *
+ * The file is memory-mapped and cut into chunks of about
+ * PARSE_CHUNK_SIZE bytes that end at a newline. A pool of worker threads
+ * parses the chunks into can_log arrays, log_parser_next hands them out
+ * in file order. At most PARSE_SLOTS_PER_THREAD chunks per worker are
+ * parsed or waiting, so memory stays bounded for any file size.
+ *
+ * Lines are split with a 16-byte SSE2 newline scan. Each line is parsed
+ * by hand up to the frame, the frame by parse_canframe, which finds the
+ * '#' at its fixed position. Binary and compressed captures are left to
+ * log_reader.
+ *
+ */
+#define PARSE_CHUNK_SIZE (4 * 1024 * 1024)
+#define PARSE_SLOTS_PER_THREAD (PARSE_MAX_CHUNKS / PARSE_MAX_THREADS)
+#define PARSE_LOGS_MIN 4096
+
+#define PARSE_FREE 0
+#define PARSE_BUSY 1
+#define PARSE_DONE 2
+#define PARSE_ERROR 3
+
+static int parse_ctz(unsigned int v){
+#ifdef _MSC_VER
+	unsigned long i;
+
+	_BitScanForward(&i, v);
+	return (int)i;
+#else
+	return __builtin_ctz(v);
+#endif
+}
+
+// First '\n' in [p, end), end if there is none.
+static const char *parse_find_newline(const char *p, const char *end){
+	const char *nl;
+#ifdef PARSE_SSE2
+	const __m128i newline = _mm_set1_epi8('\n');
+	int mask;
+
+	while(end - p >= 16){
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), newline));
+		if(mask){
+			return p + parse_ctz((unsigned int)mask);
+		}
+		p += 16;
+	}
+#endif
+
+	nl = (const char *)memchr(p, '\n', end - p);
+
+	return nl ? nl : end;
+}
+
+static const char *parse_number(const char *p, const char *end, long *v){
+	const char *start = p;
+
+	*v = 0;
+	while(p < end && *p >= '0' && *p <= '9'){
+		*v = *v * 10 + (*p++ - '0');
+	}
+
+	return p > start ? p : NULL;
+}
+
+// "(<sec>.<usec>) <channel> <frame>...", returns 0 or -1.
+static int parse_line(const char *p, const char *end, can_log *log){
+	char frbuf[LOG_LINE_MAX];
+	const char *frame;
+	long sec, usec, channel;
+
+	if((p = parse_number(p + 1, end, &sec)) == NULL || p == end || *p++ != '.'){
+		return -1;
+	}
+	if((p = parse_number(p, end, &usec)) == NULL || p == end || *p++ != ')'){
+		return -1;
+	}
+	while(p < end && *p == ' '){
+		p++;
+	}
+	if((p = parse_number(p, end, &channel)) == NULL){
+		return -1;
+	}
+	while(p < end && *p == ' '){
+		p++;
+	}
+
+	frame = p;
+	while(p < end && *p != ' ' && *p != '\r' && *p != '\t'){
+		p++;
+	}
+	if(p == frame || p - frame >= LOG_LINE_MAX){
+		return -1;
+	}
+
+	memcpy(frbuf, frame, p - frame);
+	frbuf[p - frame] = '\0';
+
+	log->timestamp = (uint64_t)sec * 1000000 + usec;
+	log->channel = (int)channel;
+	parse_canframe(frbuf, &log->frame);
+
+	return 0;
+}
+
+static int parse_chunk_text(const char *p, const char *end, parse_chunk *chunk){
+	const char *nl;
+	can_log *logs;
+
+	chunk->num = 0;
+
+	for(; p < end; p = nl + 1){
+		nl = parse_find_newline(p, end);
+
+		// skip until next non-comment line
+		if(*p != '('){
+			continue;
+		}
+
+		if(chunk->num == chunk->max){
+			logs = (can_log *)realloc(chunk->logs, sizeof(can_log) * (chunk->max ? chunk->max * 2 : PARSE_LOGS_MIN));
+			if(logs == NULL){
+				return -1;
+			}
+			chunk->logs = logs;
+			chunk->max = chunk->max ? chunk->max * 2 : PARSE_LOGS_MIN;
+		}
+
+		if(parse_line(p, nl, &chunk->logs[chunk->num]) != 0){
+			chunk->error = (uint64_t)(p - (end - chunk->len)) + chunk->offset;
+			return -1;
+		}
+		chunk->num++;
+	}
+
+	return 0;
+}
+
+static DWORD WINAPI parse_worker(LPVOID param){
+	log_parser *lp = (log_parser *)param;
+	parse_chunk *chunk;
+	const char *end;
+	int ret;
+
+	EnterCriticalSection(&lp->mutex);
+	for(;;){
+		while(!lp->stop && lp->next_offset < lp->size && lp->chunks[lp->next_seq % lp->num_chunks].state != PARSE_FREE){
+			SleepConditionVariableCS(&lp->work, &lp->mutex, INFINITE);
+		}
+		if(lp->stop || lp->next_offset >= lp->size){
+			break;
+		}
+
+		// cut the next chunk after a newline
+		chunk = &lp->chunks[lp->next_seq++ % lp->num_chunks];
+		chunk->offset = lp->next_offset;
+		end = lp->data + lp->size;
+		if(lp->size - lp->next_offset > PARSE_CHUNK_SIZE){
+			end = parse_find_newline(lp->data + lp->next_offset + PARSE_CHUNK_SIZE, end);
+			end += end < lp->data + lp->size ? 1 : 0;
+		}
+		chunk->len = (size_t)(end - (lp->data + chunk->offset));
+		chunk->state = PARSE_BUSY;
+		lp->next_offset += chunk->len;
+		LeaveCriticalSection(&lp->mutex);
+
+		ret = parse_chunk_text(lp->data + chunk->offset, end, chunk);
+
+		EnterCriticalSection(&lp->mutex);
+		chunk->state = ret == 0 ? PARSE_DONE : PARSE_ERROR;
+		WakeAllConditionVariable(&lp->done);
+	}
+	LeaveCriticalSection(&lp->mutex);
+
+	return 0;
+}
+
+/**
+ * Map the log at path and start threads parser threads (0 for one per
+ * processor) at offset, the start of a line. Returns 0, 1 if the file is
+ * not a plain text log (binary or compressed, read those with
+ * log_reader) or -1.
+ *
+ */
+int log_parser_open(log_parser *lp, const char *path, int threads, uint64_t offset){
+	static const __u8 zstd_magic[4] = {0x28, 0xB5, 0x2F, 0xFD};
+	SYSTEM_INFO info;
+	LARGE_INTEGER size;
+	int i;
+
+	memset(lp, '\0', sizeof(log_parser));
+
+	lp->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(lp->file == INVALID_HANDLE_VALUE){
+		lp->file = NULL;
+		return -1;
+	}
+
+	if(!GetFileSizeEx(lp->file, &size)){
+		log_parser_close(lp);
+		return -1;
+	}
+	lp->size = (uint64_t)size.QuadPart;
+
+	if(lp->size > 0){
+		lp->mapping = CreateFileMappingA(lp->file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if(lp->mapping == NULL){
+			log_parser_close(lp);
+			return -1;
+		}
+
+		lp->data = (const char *)MapViewOfFile(lp->mapping, FILE_MAP_READ, 0, 0, 0);
+		if(lp->data == NULL){
+			log_parser_close(lp);
+			return -1;
+		}
+
+		if((lp->size >= BINLOG_HEADER_SIZE && binlog_check_header((const __u8 *)lp->data))
+			|| (lp->size >= sizeof(zstd_magic) && memcmp(lp->data, zstd_magic, sizeof(zstd_magic)) == 0)){
+			log_parser_close(lp);
+			return 1;
+		}
+	}
+
+	lp->next_offset = offset < lp->size ? offset : lp->size;
+
+	if(threads <= 0){
+		GetSystemInfo(&info);
+		threads = (int)info.dwNumberOfProcessors;
+	}
+	lp->num_threads = threads < PARSE_MAX_THREADS ? threads : PARSE_MAX_THREADS;
+	lp->num_chunks = lp->num_threads * PARSE_SLOTS_PER_THREAD;
+
+	InitializeCriticalSection(&lp->mutex);
+	InitializeConditionVariable(&lp->work);
+	InitializeConditionVariable(&lp->done);
+	lp->started = 1;
+
+	for(i = 0; i < lp->num_threads; i++){
+		lp->threads[i] = CreateThread(NULL, 0, parse_worker, lp, 0, NULL);
+		if(lp->threads[i] == NULL){
+			fprintf(stderr, "Failed to create parser thread\n");
+			log_parser_close(lp);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void log_parser_close(log_parser *lp){
+	int i;
+
+	if(lp->started){
+		EnterCriticalSection(&lp->mutex);
+		lp->stop = 1;
+		WakeAllConditionVariable(&lp->work);
+		LeaveCriticalSection(&lp->mutex);
+
+		for(i = 0; i < lp->num_threads; i++){
+			if(lp->threads[i]){
+				WaitForSingleObject(lp->threads[i], INFINITE);
+				CloseHandle(lp->threads[i]);
+			}
+		}
+
+		DeleteCriticalSection(&lp->mutex);
+	}
+
+	for(i = 0; i < lp->num_chunks; i++){
+		free(lp->chunks[i].logs);
+	}
+
+	if(lp->data){
+		UnmapViewOfFile(lp->data);
+	}
+	if(lp->mapping){
+		CloseHandle(lp->mapping);
+	}
+	if(lp->file){
+		CloseHandle(lp->file);
+	}
+
+	memset(lp, '\0', sizeof(log_parser));
+}
+
+/**
+ * Frames of the next chunk in file order, valid until the next call.
+ * Returns the number of frames, 0 at the end of the file or -1 for a
+ * broken line (its file offset is in lp->error).
+ *
+ */
+int log_parser_next(log_parser *lp, can_log **logs){
+	parse_chunk *chunk;
+
+	EnterCriticalSection(&lp->mutex);
+
+	for(;;){
+		if(lp->held){
+			// the previous chunk can take new work
+			lp->chunks[(lp->consume_seq - 1) % lp->num_chunks].state = PARSE_FREE;
+			lp->held = 0;
+			WakeAllConditionVariable(&lp->work);
+		}
+
+		if(lp->consume_seq == lp->next_seq && lp->next_offset >= lp->size){
+			LeaveCriticalSection(&lp->mutex);
+			return 0;
+		}
+
+		chunk = &lp->chunks[lp->consume_seq % lp->num_chunks];
+		while(chunk->state != PARSE_DONE && chunk->state != PARSE_ERROR){
+			SleepConditionVariableCS(&lp->done, &lp->mutex, INFINITE);
+		}
+
+		if(chunk->state == PARSE_ERROR){
+			lp->error = chunk->error;
+			LeaveCriticalSection(&lp->mutex);
+			return -1;
+		}
+
+		lp->consume_seq++;
+		lp->held = 1;
+
+		// chunks of comments only
+		if(chunk->num > 0){
+			*logs = chunk->logs;
+			LeaveCriticalSection(&lp->mutex);
+			return chunk->num;
+		}
+	}
+}
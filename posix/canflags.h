@@ -0,0 +1,32 @@
+#ifndef POSIX_CANFLAGS_H
+#define POSIX_CANFLAGS_H
+
+/**
+ * Message flags of the Kvaser SDK for builds without canlib.h
+ *
+ * can_frame.flag uses the canlib encoding with every driver, the values
+ * are the ones of canlib.h so logs stay the same across builds.
+ *
+ */
+
+typedef int CanHandle;
+
+#define canMSG_MASK             0x00ff
+#define canMSG_RTR              0x0001
+#define canMSG_STD              0x0002
+#define canMSG_EXT              0x0004
+#define canMSG_WAKEUP           0x0008
+#define canMSG_NERR             0x0010
+#define canMSG_ERROR_FRAME      0x0020
+#define canMSG_TXACK            0x0040
+#define canMSG_TXRQ             0x0080
+
+#define canMSGERR_HW_OVERRUN    0x0200
+#define canMSGERR_SW_OVERRUN    0x0400
+#define canMSGERR_OVERRUN       0x0600
+
+#define canFDMSG_FDF            0x010000
+#define canFDMSG_BRS            0x020000
+#define canFDMSG_ESI            0x040000
+
+#endif // POSIX_CANFLAGS_H
@@ -0,0 +1,703 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "compat.h"
+
+/**
+ * Win32 compatibility layer for POSIX systems, see compat.h
+ *
+ */
+#define COMPAT_THREAD 1
+#define COMPAT_EVENT 2
+#define COMPAT_FILE 3
+#define COMPAT_MAPPING 4
+
+#define COMPAT_MAX_VIEWS 16
+
+// 100ns intervals from 1601-01-01 to 1970-01-01
+#define FILETIME_EPOCH 116444736000000000ULL
+
+typedef struct {
+	int type;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int signaled;
+	int manual_reset;
+	// threads only
+	pthread_t thread;
+	LPTHREAD_START_ROUTINE start;
+	LPVOID param;
+	int joined;
+	int refs;           // the thread itself and the handle
+} compat_object;
+
+typedef struct {
+	int type;
+	int fd;
+	size_t size;
+	int writable;       // mappings only
+} compat_file;
+
+typedef struct {
+	void *base;
+	size_t size;
+} compat_view;
+
+static compat_view views[COMPAT_MAX_VIEWS];
+static pthread_mutex_t views_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void compat_deadline(struct timespec *ts, DWORD ms){
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+	if(ts->tv_nsec >= 1000000000L){
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static void compat_cond_init(pthread_cond_t *cond){
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static compat_object *compat_object_new(int type){
+	compat_object *obj = (compat_object *)calloc(1, sizeof(compat_object));
+
+	if(obj == NULL){
+		return NULL;
+	}
+	obj->type = type;
+	pthread_mutex_init(&obj->mutex, NULL);
+	compat_cond_init(&obj->cond);
+
+	return obj;
+}
+
+static void compat_object_release(compat_object *obj){
+	int refs;
+
+	pthread_mutex_lock(&obj->mutex);
+	refs = --obj->refs;
+	pthread_mutex_unlock(&obj->mutex);
+
+	if(refs == 0){
+		pthread_cond_destroy(&obj->cond);
+		pthread_mutex_destroy(&obj->mutex);
+		free(obj);
+	}
+}
+
+static void *compat_thread_start(void *param){
+	compat_object *obj = (compat_object *)param;
+
+	obj->start(obj->param);
+
+	pthread_mutex_lock(&obj->mutex);
+	obj->signaled = 1;
+	pthread_cond_broadcast(&obj->cond);
+	pthread_mutex_unlock(&obj->mutex);
+
+	compat_object_release(obj);
+
+	return NULL;
+}
+
+HANDLE CreateThread(void *attr, size_t stack_size, LPTHREAD_START_ROUTINE start, LPVOID param, DWORD flags, DWORD *thread_id){
+	compat_object *obj = compat_object_new(COMPAT_THREAD);
+
+	if(obj == NULL){
+		return NULL;
+	}
+	obj->start = start;
+	obj->param = param;
+	obj->manual_reset = 1;
+	obj->refs = 2;
+
+	if(pthread_create(&obj->thread, NULL, compat_thread_start, obj) != 0){
+		obj->refs = 1;
+		compat_object_release(obj);
+		return NULL;
+	}
+
+	if(thread_id){
+		*thread_id = (DWORD)(uintptr_t)obj;
+	}
+
+	return obj;
+}
+
+BOOL SetThreadPriority(HANDLE thread, int priority){
+	compat_object *obj = (compat_object *)thread;
+	struct sched_param param;
+	pthread_t id;
+	int policy = SCHED_OTHER;
+
+	if(thread == GetCurrentThread()){
+		id = pthread_self();
+	}
+	else if(obj != NULL && obj->type == COMPAT_THREAD){
+		id = obj->thread;
+	}
+	else{
+		return FALSE;
+	}
+
+	memset(&param, '\0', sizeof(param));
+	if(priority > THREAD_PRIORITY_HIGHEST){
+		// below the kernel's own real-time threads
+		policy = SCHED_FIFO;
+		param.sched_priority = sched_get_priority_max(SCHED_FIFO) / 2 + priority;
+	}
+
+	return pthread_setschedparam(id, policy, &param) == 0;
+}
+
+void Sleep(DWORD ms){
+	struct timespec ts;
+
+	if(ms == 0){
+		sched_yield();
+		return;
+	}
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+	while(nanosleep(&ts, &ts) != 0 && errno == EINTR){
+		;
+	}
+}
+
+HANDLE CreateEventA(void *attr, BOOL manual_reset, BOOL initial_state, const char *name){
+	compat_object *obj = compat_object_new(COMPAT_EVENT);
+
+	if(obj == NULL){
+		return NULL;
+	}
+	obj->manual_reset = manual_reset;
+	obj->signaled = initial_state;
+	obj->refs = 1;
+
+	return obj;
+}
+
+BOOL SetEvent(HANDLE event){
+	compat_object *obj = (compat_object *)event;
+
+	pthread_mutex_lock(&obj->mutex);
+	obj->signaled = 1;
+	if(obj->manual_reset){
+		pthread_cond_broadcast(&obj->cond);
+	}else{
+		pthread_cond_signal(&obj->cond);
+	}
+	pthread_mutex_unlock(&obj->mutex);
+
+	return TRUE;
+}
+
+BOOL ResetEvent(HANDLE event){
+	compat_object *obj = (compat_object *)event;
+
+	pthread_mutex_lock(&obj->mutex);
+	obj->signaled = 0;
+	pthread_mutex_unlock(&obj->mutex);
+
+	return TRUE;
+}
+
+DWORD WaitForSingleObject(HANDLE handle, DWORD ms){
+	compat_object *obj = (compat_object *)handle;
+	struct timespec deadline;
+	int err = 0;
+
+	if(obj == NULL || (obj->type != COMPAT_THREAD && obj->type != COMPAT_EVENT)){
+		errno = EINVAL;
+		return WAIT_FAILED;
+	}
+
+	if(ms != INFINITE){
+		compat_deadline(&deadline, ms);
+	}
+
+	pthread_mutex_lock(&obj->mutex);
+	while(!obj->signaled && err == 0){
+		if(ms == INFINITE){
+			pthread_cond_wait(&obj->cond, &obj->mutex);
+		}else{
+			err = pthread_cond_timedwait(&obj->cond, &obj->mutex, &deadline);
+		}
+	}
+	if(!obj->signaled){
+		pthread_mutex_unlock(&obj->mutex);
+		return WAIT_TIMEOUT;
+	}
+	if(!obj->manual_reset){
+		obj->signaled = 0;
+	}
+	pthread_mutex_unlock(&obj->mutex);
+
+	if(obj->type == COMPAT_THREAD && !obj->joined){
+		pthread_join(obj->thread, NULL);
+		obj->joined = 1;
+	}
+
+	return WAIT_OBJECT_0;
+}
+
+DWORD WaitForMultipleObjects(DWORD count, const HANDLE *handles, BOOL wait_all, DWORD ms){
+	DWORD i, ret;
+
+	if(!wait_all){
+		// not needed by this tool
+		errno = EINVAL;
+		return WAIT_FAILED;
+	}
+
+	for(i = 0; i < count; i++){
+		ret = WaitForSingleObject(handles[i], ms);
+		if(ret != WAIT_OBJECT_0){
+			return ret;
+		}
+	}
+
+	return WAIT_OBJECT_0;
+}
+
+BOOL CloseHandle(HANDLE handle){
+	compat_object *obj = (compat_object *)handle;
+	compat_file *file = (compat_file *)handle;
+
+	if(handle == NULL || handle == INVALID_HANDLE_VALUE){
+		return FALSE;
+	}
+
+	switch(obj->type){
+		case COMPAT_THREAD:
+			if(!obj->joined){
+				pthread_detach(obj->thread);
+			}
+			compat_object_release(obj);
+			return TRUE;
+		case COMPAT_EVENT:
+			compat_object_release(obj);
+			return TRUE;
+		case COMPAT_FILE:
+		case COMPAT_MAPPING:
+			close(file->fd);
+			free(file);
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+DWORD GetLastError(void){
+	return (DWORD)errno;
+}
+
+void InitializeCriticalSection(CRITICAL_SECTION *cs){
+	pthread_mutex_init(cs, NULL);
+}
+
+void DeleteCriticalSection(CRITICAL_SECTION *cs){
+	pthread_mutex_destroy(cs);
+}
+
+void EnterCriticalSection(CRITICAL_SECTION *cs){
+	pthread_mutex_lock(cs);
+}
+
+void LeaveCriticalSection(CRITICAL_SECTION *cs){
+	pthread_mutex_unlock(cs);
+}
+
+void InitializeConditionVariable(CONDITION_VARIABLE *cv){
+	compat_cond_init(cv);
+}
+
+BOOL SleepConditionVariableCS(CONDITION_VARIABLE *cv, CRITICAL_SECTION *cs, DWORD ms){
+	struct timespec deadline;
+
+	if(ms == INFINITE){
+		return pthread_cond_wait(cv, cs) == 0;
+	}
+
+	compat_deadline(&deadline, ms);
+
+	return pthread_cond_timedwait(cv, cs, &deadline) == 0;
+}
+
+void WakeConditionVariable(CONDITION_VARIABLE *cv){
+	pthread_cond_signal(cv);
+}
+
+void WakeAllConditionVariable(CONDITION_VARIABLE *cv){
+	pthread_cond_broadcast(cv);
+}
+
+// pthread_once takes no arguments, they go through the calling thread
+static __thread struct {
+	INIT_ONCE *once;
+	PINIT_ONCE_FN fn;
+	void *param;
+	void **context;
+} compat_once;
+
+static void compat_once_run(void){
+	compat_once.fn(compat_once.once, compat_once.param, compat_once.context);
+}
+
+BOOL InitOnceExecuteOnce(INIT_ONCE *once, PINIT_ONCE_FN fn, void *param, void **context){
+	compat_once.once = once;
+	compat_once.fn = fn;
+	compat_once.param = param;
+	compat_once.context = context;
+
+	return pthread_once(once, compat_once_run) == 0;
+}
+
+// nanoseconds of CLOCK_MONOTONIC
+BOOL QueryPerformanceCounter(LARGE_INTEGER *counter){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	counter->QuadPart = (LONGLONG)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+	return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq){
+	freq->QuadPart = 1000000000LL;
+
+	return TRUE;
+}
+
+static void compat_filetime(const struct timespec *ts, FILETIME *ft){
+	uint64_t t = (uint64_t)ts->tv_sec * 10000000ULL + (uint64_t)ts->tv_nsec / 100 + FILETIME_EPOCH;
+
+	ft->dwLowDateTime = (DWORD)(t & 0xFFFFFFFFUL);
+	ft->dwHighDateTime = (DWORD)(t >> 32);
+}
+
+void GetSystemTimePreciseAsFileTime(FILETIME *ft){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	compat_filetime(&ts, ft);
+}
+
+void GetSystemTime(SYSTEMTIME *st){
+	struct timespec ts;
+	struct tm tm;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	gmtime_r(&ts.tv_sec, &tm);
+
+	st->wYear = (WORD)(tm.tm_year + 1900);
+	st->wMonth = (WORD)(tm.tm_mon + 1);
+	st->wDayOfWeek = (WORD)tm.tm_wday;
+	st->wDay = (WORD)tm.tm_mday;
+	st->wHour = (WORD)tm.tm_hour;
+	st->wMinute = (WORD)tm.tm_min;
+	st->wSecond = (WORD)tm.tm_sec;
+	st->wMilliseconds = (WORD)(ts.tv_nsec / 1000000L);
+}
+
+BOOL SystemTimeToFileTime(const SYSTEMTIME *st, FILETIME *ft){
+	struct timespec ts;
+	struct tm tm;
+
+	memset(&tm, '\0', sizeof(tm));
+	tm.tm_year = st->wYear - 1900;
+	tm.tm_mon = st->wMonth - 1;
+	tm.tm_mday = st->wDay;
+	tm.tm_hour = st->wHour;
+	tm.tm_min = st->wMinute;
+	tm.tm_sec = st->wSecond;
+
+	ts.tv_sec = timegm(&tm);
+	ts.tv_nsec = (long)st->wMilliseconds * 1000000L;
+	compat_filetime(&ts, ft);
+
+	return TRUE;
+}
+
+HANDLE CreateFileA(const char *path, DWORD access, DWORD share, void *attr, DWORD disposition, DWORD flags, HANDLE tmpl){
+	compat_file *file;
+	int oflag;
+
+	oflag = (access & GENERIC_WRITE) ? ((access & GENERIC_READ) ? O_RDWR : O_WRONLY) : O_RDONLY;
+	if(disposition == OPEN_ALWAYS){
+		oflag |= O_CREAT;
+	}
+
+	file = (compat_file *)calloc(1, sizeof(compat_file));
+	if(file == NULL){
+		return INVALID_HANDLE_VALUE;
+	}
+	file->type = COMPAT_FILE;
+	file->fd = open(path, oflag, 0644);
+	if(file->fd < 0){
+		free(file);
+		return INVALID_HANDLE_VALUE;
+	}
+
+	return file;
+}
+
+BOOL GetFileSizeEx(HANDLE file, LARGE_INTEGER *size){
+	compat_file *f = (compat_file *)file;
+	struct stat st;
+
+	if(fstat(f->fd, &st) != 0){
+		return FALSE;
+	}
+	size->QuadPart = (LONGLONG)st.st_size;
+
+	return TRUE;
+}
+
+// No creation time on POSIX, the status change time stands in.
+BOOL GetFileTime(HANDLE file, FILETIME *creation, FILETIME *access, FILETIME *write){
+	compat_file *f = (compat_file *)file;
+	struct stat st;
+
+	if(fstat(f->fd, &st) != 0){
+		return FALSE;
+	}
+	if(creation != NULL){
+		compat_filetime(&st.st_ctim, creation);
+	}
+	if(access != NULL){
+		compat_filetime(&st.st_atim, access);
+	}
+	if(write != NULL){
+		compat_filetime(&st.st_mtim, write);
+	}
+
+	return TRUE;
+}
+
+// The file grows to the mapping size, like with Win32. Size 0 maps the whole file.
+HANDLE CreateFileMappingA(HANDLE file, void *attr, DWORD protect, DWORD size_high, DWORD size_low, const char *name){
+	compat_file *f = (compat_file *)file;
+	compat_file *mapping;
+	struct stat st;
+	size_t size = ((size_t)size_high << 32) | size_low;
+
+	if(fstat(f->fd, &st) != 0){
+		return NULL;
+	}
+	if(size == 0){
+		size = (size_t)st.st_size;
+	}
+	if(size == 0){
+		// like Win32, an empty file cannot be mapped
+		errno = EINVAL;
+		return NULL;
+	}
+	if((size_t)st.st_size < size && ftruncate(f->fd, (off_t)size) != 0){
+		return NULL;
+	}
+
+	mapping = (compat_file *)calloc(1, sizeof(compat_file));
+	if(mapping == NULL){
+		return NULL;
+	}
+	mapping->type = COMPAT_MAPPING;
+	mapping->fd = dup(f->fd);
+	mapping->size = size;
+	mapping->writable = (protect == PAGE_READWRITE);
+
+	return mapping;
+}
+
+void *MapViewOfFile(HANDLE mapping, DWORD access, DWORD offset_high, DWORD offset_low, size_t size){
+	compat_file *m = (compat_file *)mapping;
+	off_t offset = (off_t)(((uint64_t)offset_high << 32) | offset_low);
+	void *base;
+	int i;
+
+	if(size == 0){
+		size = m->size - (size_t)offset;
+	}
+
+	base = mmap(NULL, size, (m->writable && access != FILE_MAP_READ) ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, m->fd, offset);
+	if(base == MAP_FAILED){
+		return NULL;
+	}
+
+	// munmap and msync need the size of the view
+	pthread_mutex_lock(&views_mutex);
+	for(i = 0; i < COMPAT_MAX_VIEWS; i++){
+		if(views[i].base == NULL){
+			views[i].base = base;
+			views[i].size = size;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&views_mutex);
+
+	if(i == COMPAT_MAX_VIEWS){
+		munmap(base, size);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return base;
+}
+
+static compat_view *compat_find_view(const void *base){
+	int i;
+
+	for(i = 0; i < COMPAT_MAX_VIEWS; i++){
+		if(views[i].base == base){
+			return &views[i];
+		}
+	}
+
+	return NULL;
+}
+
+BOOL FlushViewOfFile(const void *base, size_t size){
+	compat_view *view;
+	int ret;
+
+	pthread_mutex_lock(&views_mutex);
+	view = compat_find_view(base);
+	ret = (view != NULL) && msync(view->base, size ? size : view->size, MS_SYNC) == 0;
+	pthread_mutex_unlock(&views_mutex);
+
+	return ret;
+}
+
+BOOL UnmapViewOfFile(const void *base){
+	compat_view *view;
+	int ret;
+
+	pthread_mutex_lock(&views_mutex);
+	view = compat_find_view(base);
+	ret = (view != NULL) && munmap(view->base, view->size) == 0;
+	if(view != NULL){
+		view->base = NULL;
+	}
+	pthread_mutex_unlock(&views_mutex);
+
+	return ret;
+}
+
+void GetSystemInfo(SYSTEM_INFO *info){
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	info->dwNumberOfProcessors = n > 0 ? (DWORD)n : 1;
+}
+
+DWORD GetTempPathA(DWORD len, char *buf){
+	const char *dir = getenv("TMPDIR");
+	int n;
+
+	if(dir == NULL || *dir == '\0'){
+		dir = "/tmp";
+	}
+
+	n = snprintf(buf, len, "%s%s", dir, dir[strlen(dir) - 1] == '/' ? "" : "/");
+
+	return (n < 0 || (DWORD)n >= len) ? 0 : (DWORD)n;
+}
+
+// Creates the file like Win32 does for unique == 0.
+unsigned int GetTempFileNameA(const char *dir, const char *prefix, unsigned int unique, char *buf){
+	int fd;
+
+	snprintf(buf, _MAX_PATH, "%s%s%.3sXXXXXX", dir, dir[strlen(dir) - 1] == '/' ? "" : "/", prefix);
+
+	fd = mkstemp(buf);
+	if(fd < 0){
+		return 0;
+	}
+	close(fd);
+
+	return 1;
+}
+
+// Key press on a terminal, never for redirected input.
+int _kbhit(void){
+	struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+	int pending = 0;
+
+	if(!isatty(STDIN_FILENO)){
+		return 0;
+	}
+	if(poll(&pfd, 1, 0) <= 0){
+		return 0;
+	}
+	if(ioctl(STDIN_FILENO, FIONREAD, &pending) != 0){
+		return 0;
+	}
+
+	return pending > 0;
+}
+
+int _getch(void){
+	unsigned char c;
+
+	return read(STDIN_FILENO, &c, 1) == 1 ? c : EOF;
+}
+
+// Like MSVC, count may be _TRUNCATE, too long a source is truncated.
+errno_t strncpy_s(char *dst, size_t size, const char *src, size_t count){
+	size_t len = 0;
+
+	if(dst == NULL || size == 0){
+		return EINVAL;
+	}
+
+	while(len < count && len < size - 1 && src[len] != '\0'){
+		len++;
+	}
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+
+	return (len < count && src[len] != '\0') ? ERANGE : 0;
+}
+
+errno_t fopen_s(FILE **fp, const char *path, const char *mode){
+	*fp = fopen(path, mode);
+
+	return *fp ? 0 : errno;
+}
+
+static void compat_copy(char *dst, size_t size, const char *src, size_t len){
+	if(dst != NULL && size > 0){
+		strncpy_s(dst, size, src, len);
+	}
+}
+
+void _splitpath_s(const char *path, char *drive, size_t drive_len, char *dir, size_t dir_len,
+	char *fname, size_t fname_len, char *ext, size_t ext_len){
+	const char *name, *dot;
+
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	dot = strrchr(name, '.');
+	if(dot == NULL || dot == name){
+		dot = name + strlen(name);
+	}
+
+	compat_copy(drive, drive_len, "", 0);
+	compat_copy(dir, dir_len, path, (size_t)(name - path));
+	compat_copy(fname, fname_len, name, (size_t)(dot - name));
+	compat_copy(ext, ext_len, dot, strlen(dot));
+}
@@ -0,0 +1,193 @@
+#ifndef POSIX_COMPAT_H
+#define POSIX_COMPAT_H
+
+/**
+ * Win32 compatibility layer for POSIX systems
+ *
+ * Only the subset of the Win32 API and the MSVC CRT used by this tool,
+ * implemented on pthreads, clock_gettime and mmap (see compat.c), so the
+ * sources keep their Windows spelling.
+ *
+ * HANDLE is a tagged object. CloseHandle and WaitForSingleObject accept
+ * threads and events, CloseHandle also files and file mappings.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+// names the C library uses differently, declared above before renaming
+#define basename kv_basename
+#define gettimeofday kv_gettimeofday
+
+#define __int8 char
+#define __int32 int
+
+typedef int BOOL;
+typedef unsigned char BYTE;
+typedef unsigned short WORD;
+typedef unsigned long DWORD;
+typedef int32_t LONG;
+typedef int64_t LONGLONG;
+typedef void *HANDLE;
+typedef void *LPVOID;
+typedef int errno_t;
+
+#define TRUE 1
+#define FALSE 0
+#define WINAPI
+
+#define INFINITE 0xFFFFFFFFUL
+#define WAIT_OBJECT_0 0UL
+#define WAIT_TIMEOUT 258UL
+#define WAIT_FAILED 0xFFFFFFFFUL
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+
+#define _MAX_PATH PATH_MAX
+#define _MAX_DRIVE 3
+#define _MAX_DIR 256
+#define _MAX_FNAME 256
+#define _MAX_EXT 256
+#define _TRUNCATE ((size_t)-1)
+
+typedef union {
+	struct {
+		DWORD LowPart;
+		LONG HighPart;
+	} u;
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct {
+	DWORD dwLowDateTime;
+	DWORD dwHighDateTime;
+} FILETIME;
+
+typedef struct {
+	WORD wYear;
+	WORD wMonth;
+	WORD wDayOfWeek;
+	WORD wDay;
+	WORD wHour;
+	WORD wMinute;
+	WORD wSecond;
+	WORD wMilliseconds;
+} SYSTEMTIME;
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+typedef pthread_cond_t CONDITION_VARIABLE;
+
+typedef DWORD (*LPTHREAD_START_ROUTINE)(LPVOID param);
+
+// threads, priorities above THREAD_PRIORITY_HIGHEST are SCHED_FIFO
+#define THREAD_PRIORITY_NORMAL 0
+#define THREAD_PRIORITY_HIGHEST 2
+#define THREAD_PRIORITY_TIME_CRITICAL 15
+
+HANDLE CreateThread(void *attr, size_t stack_size, LPTHREAD_START_ROUTINE start, LPVOID param, DWORD flags, DWORD *thread_id);
+static inline HANDLE GetCurrentThread(void){ return (HANDLE)(intptr_t)-2; }
+BOOL SetThreadPriority(HANDLE thread, int priority);
+void Sleep(DWORD ms);
+
+static inline void YieldProcessor(void){
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+// events
+#define CreateEvent CreateEventA
+HANDLE CreateEventA(void *attr, BOOL manual_reset, BOOL initial_state, const char *name);
+BOOL SetEvent(HANDLE event);
+BOOL ResetEvent(HANDLE event);
+
+DWORD WaitForSingleObject(HANDLE handle, DWORD ms);
+DWORD WaitForMultipleObjects(DWORD count, const HANDLE *handles, BOOL wait_all, DWORD ms);
+BOOL CloseHandle(HANDLE handle);
+DWORD GetLastError(void);
+
+// locks, condition variables wait on CLOCK_MONOTONIC
+void InitializeCriticalSection(CRITICAL_SECTION *cs);
+void DeleteCriticalSection(CRITICAL_SECTION *cs);
+void EnterCriticalSection(CRITICAL_SECTION *cs);
+void LeaveCriticalSection(CRITICAL_SECTION *cs);
+void InitializeConditionVariable(CONDITION_VARIABLE *cv);
+BOOL SleepConditionVariableCS(CONDITION_VARIABLE *cv, CRITICAL_SECTION *cs, DWORD ms);
+void WakeConditionVariable(CONDITION_VARIABLE *cv);
+void WakeAllConditionVariable(CONDITION_VARIABLE *cv);
+
+// one-time initialization on pthread_once, the callback must not fail
+typedef pthread_once_t INIT_ONCE;
+#define INIT_ONCE_STATIC_INIT PTHREAD_ONCE_INIT
+#define CALLBACK
+typedef BOOL (*PINIT_ONCE_FN)(INIT_ONCE *once, void *param, void **context);
+BOOL InitOnceExecuteOnce(INIT_ONCE *once, PINIT_ONCE_FN fn, void *param, void **context);
+
+#define MemoryBarrier() __sync_synchronize()
+#define InterlockedCompareExchange(dst, exchange, comparand) __sync_val_compare_and_swap((dst), (comparand), (exchange))
+
+// time
+BOOL QueryPerformanceCounter(LARGE_INTEGER *counter);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq);
+void GetSystemTimePreciseAsFileTime(FILETIME *ft);
+void GetSystemTime(SYSTEMTIME *st);
+BOOL SystemTimeToFileTime(const SYSTEMTIME *st, FILETIME *ft);
+static inline unsigned int timeBeginPeriod(unsigned int ms){ return 0; }
+static inline unsigned int timeEndPeriod(unsigned int ms){ return 0; }
+
+// files and mappings
+#define GENERIC_READ 0x80000000UL
+#define GENERIC_WRITE 0x40000000UL
+#define FILE_SHARE_READ 0x00000001UL
+#define FILE_SHARE_WRITE 0x00000002UL
+#define OPEN_EXISTING 3
+#define OPEN_ALWAYS 4
+#define FILE_ATTRIBUTE_NORMAL 0x80
+#define PAGE_READONLY 0x02
+#define PAGE_READWRITE 0x04
+#define FILE_MAP_READ 0x0004
+#define FILE_MAP_ALL_ACCESS 0xF001F
+
+HANDLE CreateFileA(const char *path, DWORD access, DWORD share, void *attr, DWORD disposition, DWORD flags, HANDLE tmpl);
+BOOL GetFileSizeEx(HANDLE file, LARGE_INTEGER *size);
+BOOL GetFileTime(HANDLE file, FILETIME *creation, FILETIME *access, FILETIME *write);
+HANDLE CreateFileMappingA(HANDLE file, void *attr, DWORD protect, DWORD size_high, DWORD size_low, const char *name);
+void *MapViewOfFile(HANDLE mapping, DWORD access, DWORD offset_high, DWORD offset_low, size_t size);
+BOOL FlushViewOfFile(const void *base, size_t size);
+BOOL UnmapViewOfFile(const void *base);
+DWORD GetTempPathA(DWORD len, char *buf);
+unsigned int GetTempFileNameA(const char *dir, const char *prefix, unsigned int unique, char *buf);
+
+// system
+typedef struct {
+	DWORD dwNumberOfProcessors;
+} SYSTEM_INFO;
+
+void GetSystemInfo(SYSTEM_INFO *info);
+
+// console, VT sequences work as they are
+#define STD_OUTPUT_HANDLE ((DWORD)-11)
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+static inline HANDLE GetStdHandle(DWORD std){ return NULL; }
+static inline BOOL GetConsoleMode(HANDLE console, DWORD *mode){ *mode = 0; return FALSE; }
+static inline BOOL SetConsoleMode(HANDLE console, DWORD mode){ return TRUE; }
+int _kbhit(void);
+int _getch(void);
+
+// MSVC CRT
+#define strtok_s strtok_r
+// no buffer sizes after %s, %c and %[ here, pass them under _WIN32 only
+#define sscanf_s sscanf
+#define _fseeki64 fseeko
+errno_t strncpy_s(char *dst, size_t size, const char *src, size_t count);
+errno_t fopen_s(FILE **fp, const char *path, const char *mode);
+void _splitpath_s(const char *path, char *drive, size_t drive_len, char *dir, size_t dir_len,
+	char *fname, size_t fname_len, char *ext, size_t ext_len);
+
+#endif // POSIX_COMPAT_H
@@ -0,0 +1,354 @@
+#include "lib.h"
+
+// Thread-Safe Queue
+int init_queue(log_queue* queue, int size) {
+    queue->buffer = (can_log*)malloc(sizeof(can_log) * size);
+    if (queue->buffer == NULL) {
+        return -1;
+    }
+
+    queue->head = 0;
+    queue->tail = 0;
+    queue->count = 0;
+    queue->size = size;
+
+    InitializeCriticalSection(&queue->mutex);
+    InitializeConditionVariable(&queue->not_empty);
+    InitializeConditionVariable(&queue->not_full);
+
+    return 0;
+}
+
+void destroy_queue(log_queue* queue) {
+    if (queue->buffer) {
+        free(queue->buffer);
+        queue->buffer = NULL;
+    }
+
+    DeleteCriticalSection(&queue->mutex);
+}
+
+int enqueue_frame(log_queue* queue, const can_log* frame) {
+    EnterCriticalSection(&queue->mutex);
+
+	while (queue->count >= queue->size && !stop_flag) {
+		// Buffer is full - sleep so consumers can get items.
+		SleepConditionVariableCS(&queue->not_full, &queue->mutex, INFINITE);
+	}
+
+    if (stop_flag) {
+        LeaveCriticalSection(&queue->mutex);
+        return -1;
+    }
+
+	// Copy the log to buffer
+    memcpy(&queue->buffer[queue->head], frame, sizeof(can_log));
+    queue->head = (queue->head + 1) % queue->size;
+    queue->count++;
+
+    LeaveCriticalSection(&queue->mutex);
+
+	// If a consumer is waiting, wake it
+    WakeConditionVariable(&queue->not_empty);
+
+    return 0;
+}
+
+int dequeue_frame(log_queue* queue, can_log* frame) {
+    EnterCriticalSection(&queue->mutex);
+
+	while (queue->count == 0 && !stop_flag) {
+		// Buffer is empty - sleep so producers can create items.
+		SleepConditionVariableCS(&queue->not_empty, &queue->mutex, 50);
+	}
+
+	// Stop flag is set and queue is empty
+    if (queue->count == 0 && stop_flag) {
+        LeaveCriticalSection(&queue->mutex);
+        return -1;
+    }
+
+	// Get frame
+    memcpy(frame, &queue->buffer[queue->tail], sizeof(can_log));
+    queue->tail = (queue->tail + 1) % queue->size;
+    queue->count--;
+
+    LeaveCriticalSection(&queue->mutex);
+
+	// If a producer is waiting, wake it.
+    WakeConditionVariable(&queue->not_full);
+
+    return 0;
+}
+
+// Take up to max frames with a single lock, waiting at most timeout ms.
+int dequeue_frames(log_queue* queue, can_log* frames, int max, DWORD timeout) {
+	int n, chunk;
+
+    EnterCriticalSection(&queue->mutex);
+
+	if (queue->count == 0 && !stop_flag) {
+		SleepConditionVariableCS(&queue->not_empty, &queue->mutex, timeout);
+	}
+
+	n = queue->count < max ? queue->count : max;
+
+	// copy in up to two pieces when the range wraps
+	chunk = queue->size - queue->tail;
+	if (chunk > n) {
+		chunk = n;
+	}
+    memcpy(frames, &queue->buffer[queue->tail], sizeof(can_log) * chunk);
+    memcpy(frames + chunk, queue->buffer, sizeof(can_log) * (n - chunk));
+    queue->tail = (queue->tail + n) % queue->size;
+    queue->count -= n;
+
+    LeaveCriticalSection(&queue->mutex);
+
+	if (n > 0) {
+		WakeAllConditionVariable(&queue->not_full);
+	}
+
+    return n;
+}
+
+/**
+ * Lock-free single-producer/single-consumer ring.
+ *
+ * head is only written by the producer and tail only by the consumer.
+ * Both are free running counters, the slot index is (counter & mask).
+ * Each side keeps a private copy of the other side's counter so the
+ * shared cache line is only touched when the cached value runs out.
+ *
+ */
+int spsc_ring_init(spsc_ring *ring, unsigned int size) {
+	unsigned int capacity = 1;
+
+	while (capacity < size) {
+		capacity <<= 1;
+	}
+
+	memset(ring, '\0', sizeof(spsc_ring));
+
+	ring->buffer = (can_log*)malloc(sizeof(can_log) * capacity);
+	if (ring->buffer == NULL) {
+		return -1;
+	}
+
+	ring->mask = capacity - 1;
+
+	return 0;
+}
+
+void spsc_ring_destroy(spsc_ring *ring) {
+	if (ring->buffer) {
+		free(ring->buffer);
+		ring->buffer = NULL;
+	}
+}
+
+int spsc_ring_push(spsc_ring *ring, const can_log *log) {
+	unsigned int head = ring->head;
+
+	if (head - ring->tail_cache > ring->mask) {
+		ring->tail_cache = ring->tail;
+		if (head - ring->tail_cache > ring->mask) {
+			// full
+			return -1;
+		}
+	}
+
+	memcpy(&ring->buffer[head & ring->mask], log, sizeof(can_log));
+
+	// publish the slot before moving head
+	MemoryBarrier();
+	ring->head = head + 1;
+
+	return 0;
+}
+
+// Push, taking the oldest slot away from the consumer when full.
+// Returns 1 when a frame was dropped to make room, else 0.
+int spsc_ring_push_overwrite(spsc_ring *ring, const can_log *log) {
+	unsigned int head = ring->head;
+	unsigned int tail = ring->tail;
+	int dropped = 0;
+
+	if (head - tail > ring->mask) {
+		// fails only if the consumer released slots in the meantime
+		if ((unsigned int)InterlockedCompareExchange((volatile LONG*)&ring->tail, (LONG)(tail + 1), (LONG)tail) == tail) {
+			dropped = 1;
+		}
+	}
+
+	memcpy(&ring->buffer[head & ring->mask], log, sizeof(can_log));
+
+	MemoryBarrier();
+	ring->head = head + 1;
+
+	return dropped;
+}
+
+int spsc_ring_pop(spsc_ring *ring, can_log *log) {
+	unsigned int tail = ring->tail;
+
+	if (ring->overwrite) {
+		return spsc_ring_pop_batch(ring, log, 1) == 1 ? 0 : -1;
+	}
+
+	if (tail == ring->head_cache) {
+		ring->head_cache = ring->head;
+		if (tail == ring->head_cache) {
+			// empty
+			return -1;
+		}
+		MemoryBarrier();
+	}
+
+	memcpy(log, &ring->buffer[tail & ring->mask], sizeof(can_log));
+
+	// release the slot after it has been copied out
+	MemoryBarrier();
+	ring->tail = tail + 1;
+
+	return 0;
+}
+
+// Pop up to max frames at once, one barrier for the whole batch.
+// With overwrite the copy is only kept if the producer did not move
+// tail meanwhile, otherwise slots may have been reused under us.
+int spsc_ring_pop_batch(spsc_ring *ring, can_log *logs, int max) {
+	unsigned int tail;
+	unsigned int n, idx, chunk;
+
+	for (;;) {
+		tail = ring->tail;
+		n = ring->head_cache - tail;
+		if (ring->overwrite || n < (unsigned int)max) {
+			ring->head_cache = ring->head;
+			MemoryBarrier();
+			n = ring->head_cache - tail;
+		}
+
+		if (n == 0) {
+			return 0;
+		}
+		if (n > (unsigned int)max) {
+			n = max;
+		}
+
+		idx = tail & ring->mask;
+		chunk = ring->mask + 1 - idx;
+		if (chunk > n) {
+			chunk = n;
+		}
+		memcpy(logs, &ring->buffer[idx], sizeof(can_log) * chunk);
+		memcpy(logs + chunk, ring->buffer, sizeof(can_log) * (n - chunk));
+
+		MemoryBarrier();
+		if (!ring->overwrite) {
+			ring->tail = tail + n;
+			break;
+		}
+		if ((unsigned int)InterlockedCompareExchange((volatile LONG*)&ring->tail, (LONG)(tail + n), (LONG)tail) == tail) {
+			break;
+		}
+	}
+
+	return (int)n;
+}
+
+unsigned int spsc_ring_count(spsc_ring *ring) {
+	return ring->head - ring->tail;
+}
+
+/**
+ * Spill file
+ *
+ * Once a ring is full the producer appends to the spill file instead,
+ * and keeps doing so until the consumer has read the file back to the
+ * end. The consumer only reads it after the ring ran empty, so frames
+ * of a channel stay in order.
+ *
+ */
+int spill_open(spill_file *sp) {
+	char dir[_MAX_PATH];
+
+	memset(sp, '\0', sizeof(spill_file));
+
+	if (GetTempPathA(sizeof(dir), dir) == 0 || GetTempFileNameA(dir, "kvs", 0, sp->path) == 0) {
+		fprintf(stderr, "cannot create spill file\n");
+		return -1;
+	}
+
+	if (fopen_s(&sp->fp, sp->path, "w+b") != 0) {
+		fprintf(stderr, "cannot open: %s\n", sp->path);
+		sp->fp = NULL;
+		return -1;
+	}
+
+	fgetpos(sp->fp, &sp->start);
+	sp->read_pos = sp->start;
+	sp->write_pos = sp->start;
+
+	InitializeCriticalSection(&sp->mutex);
+
+	return 0;
+}
+
+void spill_close(spill_file *sp) {
+	if (sp->fp) {
+		fclose(sp->fp);
+		sp->fp = NULL;
+		remove(sp->path);
+		DeleteCriticalSection(&sp->mutex);
+	}
+}
+
+int spill_write(spill_file *sp, const can_log *log) {
+	int ret = 0;
+
+	EnterCriticalSection(&sp->mutex);
+
+	fsetpos(sp->fp, &sp->write_pos);
+	if (fwrite(log, sizeof(can_log), 1, sp->fp) == 1) {
+		fgetpos(sp->fp, &sp->write_pos);
+		sp->written++;
+		sp->active = 1;
+	}
+	else {
+		ret = -1;
+	}
+
+	LeaveCriticalSection(&sp->mutex);
+
+	return ret;
+}
+
+// Read back up to max frames, the file starts over once it is drained.
+int spill_read(spill_file *sp, can_log *logs, int max) {
+	uint64_t avail;
+	size_t n;
+
+	EnterCriticalSection(&sp->mutex);
+
+	avail = sp->written - sp->read;
+	n = avail < (uint64_t)max ? (size_t)avail : (size_t)max;
+
+	fsetpos(sp->fp, &sp->read_pos);
+	n = fread(logs, sizeof(can_log), n, sp->fp);
+	fgetpos(sp->fp, &sp->read_pos);
+	sp->read += n;
+
+	if (sp->read == sp->written) {
+		sp->read = 0;
+		sp->written = 0;
+		sp->read_pos = sp->start;
+		sp->write_pos = sp->start;
+		sp->active = 0;
+	}
+
+	LeaveCriticalSection(&sp->mutex);
+
+	return (int)n;
+}
@@ -0,0 +1,286 @@
+#include "lib.h"
+
+/**
+ * Flight recorder
+ *
+ * Frames are kept in a fixed-size memory-mapped ring file and nothing
+ * else is written to disk. When a trigger fires, the frames from
+ * <pre> before to <post> after the trigger are written to a standalone
+ * compact log <ringfile>.<n>.log once the post window has passed.
+ *
+ * The ring file starts with a recorder_header, the can_log records
+ * follow at RECORDER_DATA_OFFSET. The ring has to hold at least
+ * pre + post worth of traffic, older frames are overwritten.
+ *
+ * The output thread only copies the window out of the ring, a dump
+ * thread formats and writes it so the rings keep draining meanwhile.
+ *
+ */
+static const char recorder_magic[8] = {'K', 'V', 'F', 'R', 1, 0, 0, 0};
+
+#define RECORDER_DATA_OFFSET 64
+#define RECORDER_DUMP_INITIAL 4096      // frames the window copy starts with
+
+static void recorder_wait_dump(flight_recorder *fr);
+
+int recorder_open(flight_recorder *fr, const char *path, uint64_t size){
+	recorder_header *hdr;
+	uint64_t capacity;
+
+	capacity = (size - RECORDER_DATA_OFFSET) / sizeof(can_log);
+	if(size <= RECORDER_DATA_OFFSET || capacity == 0){
+		fprintf(stderr, "Flight recorder size too small: %llu\n", (unsigned long long)size);
+		return -1;
+	}
+
+	strncpy_s(fr->path, sizeof(fr->path), path, _TRUNCATE);
+
+	fr->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(fr->file == INVALID_HANDLE_VALUE){
+		fprintf(stderr, "cannot open: %s\n", path);
+		return -1;
+	}
+
+	fr->mapping = CreateFileMappingA(fr->file, NULL, PAGE_READWRITE,
+		(DWORD)(size >> 32), (DWORD)(size & 0xFFFFFFFF), NULL);
+	if(fr->mapping == NULL){
+		fprintf(stderr, "CreateFileMapping failed: %lu\n", GetLastError());
+		CloseHandle(fr->file);
+		return -1;
+	}
+
+	fr->base = (char*)MapViewOfFile(fr->mapping, FILE_MAP_ALL_ACCESS, 0, 0, (size_t)size);
+	if(fr->base == NULL){
+		fprintf(stderr, "MapViewOfFile failed: %lu\n", GetLastError());
+		CloseHandle(fr->mapping);
+		CloseHandle(fr->file);
+		return -1;
+	}
+
+	fr->size = size;
+	fr->records = (can_log*)(fr->base + RECORDER_DATA_OFFSET);
+
+	// keep the content of a matching ring from a previous run
+	hdr = (recorder_header*)fr->base;
+	if(memcmp(hdr->magic, recorder_magic, sizeof(recorder_magic)) != 0
+		|| hdr->record_size != sizeof(can_log)
+		|| hdr->capacity != capacity){
+		memcpy(hdr->magic, recorder_magic, sizeof(recorder_magic));
+		hdr->record_size = sizeof(can_log);
+		hdr->capacity = capacity;
+		hdr->head = 0;
+	}
+	fr->hdr = hdr;
+
+	return 0;
+}
+
+void recorder_close(flight_recorder *fr){
+	recorder_wait_dump(fr);
+
+	if(fr->base){
+		FlushViewOfFile(fr->base, 0);
+		UnmapViewOfFile(fr->base);
+		fr->base = NULL;
+	}
+	if(fr->mapping){
+		CloseHandle(fr->mapping);
+		fr->mapping = NULL;
+	}
+	if(fr->file && fr->file != INVALID_HANDLE_VALUE){
+		CloseHandle(fr->file);
+		fr->file = NULL;
+	}
+}
+
+/**
+ *
+ * Format of <trigger>: <can-id>{:<mask>}{#<data>}
+ *  123           can-id 0x123
+ *  100:700       can-id 0x100-0x1FF
+ *  123#DEAD      can-id 0x123 with payload starting 0xDE 0xAD
+ *
+ */
+int recorder_add_trigger(flight_recorder *fr, const char *cs){
+	recorder_match_rule *tr;
+	char *endptr;
+	char data[CANFD_MAX_DLEN * 2 + 1];
+	size_t len;
+
+	if(fr->num_triggers >= RECORDER_MAX_TRIGGERS){
+		return -1;
+	}
+	tr = &fr->triggers[fr->num_triggers];
+	memset(tr, '\0', sizeof(recorder_match_rule));
+
+	tr->id = strtoul(cs, &endptr, 16);
+	tr->mask = CAN_EFF_MASK;
+	if(endptr == cs){
+		return -1;
+	}
+
+	if(*endptr == ':'){
+		cs = endptr + 1;
+		tr->mask = strtoul(cs, &endptr, 16);
+		if(endptr == cs){
+			return -1;
+		}
+	}
+
+	if(*endptr == '#'){
+		len = strlen(endptr + 1);
+		if(len == 0 || len >= sizeof(data)){
+			return -1;
+		}
+		strncpy_s(data, sizeof(data), endptr + 1, len);
+		if(hexstring2data(data, tr->data, CANFD_MAX_DLEN) != 0){
+			return -1;
+		}
+		tr->len = (int)len / 2;
+	}
+	else if(*endptr != '\0'){
+		return -1;
+	}
+
+	fr->num_triggers++;
+
+	return 0;
+}
+
+static int recorder_match(flight_recorder *fr, can_log *log){
+	int i;
+	recorder_match_rule *tr;
+
+	for(i = 0; i < fr->num_triggers; i++){
+		tr = &fr->triggers[i];
+		if(((__u32)log->frame.id & tr->mask) != (tr->id & tr->mask)){
+			continue;
+		}
+		if(tr->len > 0 && ((int)log->frame.dlc < tr->len || memcmp(log->frame.msg, tr->data, tr->len) != 0)){
+			continue;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+// Start a freeze window around time, ignored while one is pending.
+void recorder_trigger(flight_recorder *fr, uint64_t time){
+	if(fr->triggered){
+		return;
+	}
+
+	fr->triggered = 1;
+	fr->trigger_time = time;
+	fprintf(stderr, "flight recorder: triggered at %llu.%06llu\n",
+		(unsigned long long)(time / 1000000), (unsigned long long)(time % 1000000));
+}
+
+void recorder_write(flight_recorder *fr, can_log *log){
+	recorder_header *hdr = fr->hdr;
+
+	memcpy(&fr->records[hdr->head % hdr->capacity], log, sizeof(can_log));
+	hdr->head++;
+
+	if(fr->num_triggers > 0 && !fr->triggered && recorder_match(fr, log)){
+		recorder_trigger(fr, log->timestamp);
+	}
+}
+
+// Write the copied window to its log, on the dump thread.
+DWORD WINAPI recorder_dump_thread(LPVOID param){
+	flight_recorder *fr = (flight_recorder *)param;
+	char *buffer;
+	FILE *fp;
+	uint64_t i;
+
+	if(fopen_s(&fp, fr->dump_path, "wb") != 0){
+		fprintf(stderr, "cannot open: %s\n", fr->dump_path);
+		return 1;
+	}
+
+	buffer = (char*)malloc(RECORDER_OUTPUT_BUFFER_SIZE);
+	if(buffer){
+		setvbuf(fp, buffer, _IOFBF, RECORDER_OUTPUT_BUFFER_SIZE);
+	}
+
+	for(i = 0; i < fr->dump_count; i++){
+		fprint_log(fp, &fr->dump_logs[i], 0);
+	}
+
+	if(fclose(fp) != 0){
+		fprintf(stderr, "cannot write: %s\n", fr->dump_path);
+	}else{
+		fprintf(stderr, "flight recorder: %llu frames written to %s\n",
+			(unsigned long long)fr->dump_count, fr->dump_path);
+	}
+	free(buffer);
+
+	return 0;
+}
+
+// Wait until the previous window is on disk.
+static void recorder_wait_dump(flight_recorder *fr){
+	if(fr->dump_thread){
+		WaitForSingleObject(fr->dump_thread, INFINITE);
+		CloseHandle(fr->dump_thread);
+		fr->dump_thread = NULL;
+	}
+
+	free(fr->dump_logs);
+	fr->dump_logs = NULL;
+	fr->dump_count = 0;
+}
+
+// Copy the frames of the window out of the ring and have the dump thread write them.
+static int recorder_freeze(flight_recorder *fr){
+	uint64_t i, first, from, to, max;
+	recorder_header *hdr = fr->hdr;
+	can_log *log, *logs;
+
+	recorder_wait_dump(fr);
+
+	from = fr->trigger_time > fr->pre ? fr->trigger_time - fr->pre : 0;
+	to = fr->trigger_time + fr->post;
+	first = hdr->head > hdr->capacity ? hdr->head - hdr->capacity : 0;
+
+	max = 0;
+	for(i = first; i < hdr->head; i++){
+		log = &fr->records[i % hdr->capacity];
+		if(log->timestamp < from || log->timestamp > to){
+			continue;
+		}
+
+		if(fr->dump_count == max){
+			max = max ? max * 2 : RECORDER_DUMP_INITIAL;
+			logs = (can_log*)realloc(fr->dump_logs, (size_t)max * sizeof(can_log));
+			if(logs == NULL){
+				fprintf(stderr, "out of memory\n");
+				recorder_wait_dump(fr);
+				return -1;
+			}
+			fr->dump_logs = logs;
+		}
+		memcpy(&fr->dump_logs[fr->dump_count++], log, sizeof(can_log));
+	}
+
+	snprintf(fr->dump_path, sizeof(fr->dump_path), "%s.%d.log", fr->path, fr->dumps++);
+
+	fr->dump_thread = CreateThread(NULL, 0, recorder_dump_thread, fr, 0, NULL);
+	if(fr->dump_thread == NULL){
+		// write it here then
+		recorder_dump_thread(fr);
+	}
+
+	return 0;
+}
+
+// Write out the pending window once now is past its end.
+void recorder_poll(flight_recorder *fr, uint64_t now){
+	if(fr->triggered && now >= fr->trigger_time + fr->post){
+		recorder_freeze(fr);
+		fr->triggered = 0;
+	}
+}
@@ -0,0 +1,325 @@
+#include "lib.h"
+
+/**
+ * Replay plan
+ *
+ * The whole log is parsed once into compact entries in an arena of
+ * large blocks, so replaying (and every loop of canplay -l) only walks
+ * memory. An entry holds the time since the previous entry, the channel
+ * and the frame with just its payload bytes:
+ *
+ *  replay_entry   16 bytes
+ *  payload        dlc bytes (none for RTR), padded to 4
+ *
+ * A classic 8-byte frame takes 24 bytes. Frames older than their
+ * predecessor (channels merged slightly out of order) get a delta of 0.
+ * Gaps longer than a delta can hold are split by entries without a frame.
+ *
+ */
+typedef struct {
+	uint32_t delta;     // us since the previous entry
+	__u32 id;
+	__u32 flag;
+	__u8 channel;       // REPLAY_GAP for an entry without a frame
+	__u8 dlc;
+	__u8 len;           // payload bytes
+	__u8 reserved;
+} replay_entry;
+
+#define REPLAY_GAP 0xFF
+#define REPLAY_DELTA_MAX 0xFFFFFFFFU
+#define REPLAY_ALIGN(n) (((n) + 3) & ~(size_t)3)
+
+static replay_entry *replay_alloc(replay_plan *plan, size_t size){
+	replay_block *b = plan->num_blocks > 0 ? plan->blocks[plan->num_blocks - 1] : NULL;
+	replay_block **blocks;
+
+	if(b == NULL || b->used + size > REPLAY_BLOCK_SIZE){
+		if(plan->num_blocks == plan->max_blocks){
+			plan->max_blocks = plan->max_blocks ? plan->max_blocks * 2 : 16;
+			blocks = (replay_block**)realloc(plan->blocks, plan->max_blocks * sizeof(replay_block*));
+			if(blocks == NULL){
+				return NULL;
+			}
+			plan->blocks = blocks;
+		}
+
+		b = (replay_block*)malloc(sizeof(replay_block));
+		if(b == NULL){
+			return NULL;
+		}
+		b->used = 0;
+		plan->blocks[plan->num_blocks++] = b;
+	}
+
+	b->used += size;
+
+	return (replay_entry*)(b->data + b->used - size);
+}
+
+// Append a frame logged at time us after the first one.
+static int replay_append(replay_plan *plan, can_log *log, uint64_t time){
+	replay_entry *e;
+	uint64_t delta = time > plan->duration ? time - plan->duration : 0;
+	size_t len = (log->frame.flag & canMSG_RTR) ? 0 : log->frame.dlc;
+
+	if(len > CANFD_MAX_DLEN){
+		len = CANFD_MAX_DLEN;
+	}
+
+	for(; delta > REPLAY_DELTA_MAX; delta -= REPLAY_DELTA_MAX){
+		e = replay_alloc(plan, sizeof(replay_entry));
+		if(e == NULL){
+			return -1;
+		}
+		memset(e, '\0', sizeof(replay_entry));
+		e->delta = REPLAY_DELTA_MAX;
+		e->channel = REPLAY_GAP;
+	}
+
+	e = replay_alloc(plan, REPLAY_ALIGN(sizeof(replay_entry) + len));
+	if(e == NULL){
+		return -1;
+	}
+	e->delta = (uint32_t)delta;
+	e->id = (__u32)log->frame.id;
+	e->flag = log->frame.flag;
+	e->channel = (__u8)log->channel;
+	e->dlc = (__u8)log->frame.dlc;
+	e->len = (__u8)len;
+	e->reserved = 0;
+	memcpy(e + 1, log->frame.msg, len);
+
+	if(time > plan->duration){
+		plan->duration = time;
+	}
+	plan->frames++;
+
+	return 0;
+}
+
+// Part of the log to load, us after its first frame.
+typedef struct {
+	uint64_t start;
+	uint64_t end;           // 0 for the rest of the log
+	uint64_t first_ts;      // of the log's first frame
+	int known;              // first_ts is set
+	uint64_t offset;        // where to start reading
+	uint64_t offset_ts;
+} replay_window;
+
+// Append a logged frame, the first one sets the start of the plan. Returns 0, 1 after the window or -1.
+static int replay_add(replay_plan *plan, replay_window *win, can_log *log){
+	if(log->channel < 0 || log->channel >= MAX_CHANNELS){
+		fprintf(stderr, "invalid channel %d in logfile\n", log->channel);
+		return -1;
+	}
+
+	if(!win->known){
+		win->first_ts = log->timestamp;
+		win->known = 1;
+	}
+	if(log->timestamp < win->first_ts + win->start){
+		return 0;
+	}
+	if(win->end && log->timestamp >= win->first_ts + win->end){
+		return 1;
+	}
+
+	if(plan->frames == 0){
+		plan->start_ts = log->timestamp;
+	}
+
+	if(replay_append(plan, log, log->timestamp > plan->start_ts ? log->timestamp - plan->start_ts : 0) != 0){
+		fprintf(stderr, "out of memory after %llu frames\n", (unsigned long long)plan->frames);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Text logs with the parallel parser, returns 0, 1 for other formats or -1.
+static int replay_plan_parse(replay_plan *plan, replay_window *win, const char *path, int threads){
+	log_parser parser;
+	can_log *logs;
+	int i, n, ret = 0;
+
+	n = log_parser_open(&parser, path, threads, win->offset);
+	if(n != 0){
+		if(n < 0){
+			fprintf(stderr, "cannot open: %s\n", path);
+		}
+		return n;
+	}
+
+	while(ret == 0 && (n = log_parser_next(&parser, &logs)) > 0){
+		for(i = 0; i < n && ret == 0; i++){
+			ret = replay_add(plan, win, &logs[i]);
+		}
+	}
+
+	if(n < 0){
+		fprintf(stderr, "incorrect line format in logfile at byte %llu\n", (unsigned long long)parser.error);
+		ret = -1;
+	}
+
+	log_parser_close(&parser);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/**
+ * Parse the log at path (any format log_reader reads) into plan. Text
+ * logs are parsed by threads threads, 0 for one per processor.
+ * Only frames from start to end us after the first frame of the log are
+ * loaded (end 0 for all), reading starts at the log's index when it has
+ * one (index.c). Returns 0 or -1.
+ *
+ */
+int replay_plan_load(replay_plan *plan, const char *path, int threads, uint64_t start, uint64_t end){
+	replay_window win;
+	index_entry entry;
+	log_reader reader;
+	can_log log;
+	int ret;
+
+	memset(plan, '\0', sizeof(replay_plan));
+	memset(&win, '\0', sizeof(win));
+	win.start = start;
+	win.end = end;
+
+	if(start > 0){
+		if(index_lookup(path, start, &entry, &win.first_ts) == 0){
+			win.known = 1;
+			win.offset = entry.offset;
+			win.offset_ts = entry.base_ts;
+		}
+	}
+
+	ret = replay_plan_parse(plan, &win, path, threads);
+	if(ret <= 0){
+		if(ret != 0){
+			replay_plan_free(plan);
+		}
+		return ret;
+	}
+
+	// binary and compressed captures
+	if(log_reader_open(&reader, path) != 0){
+		fprintf(stderr, "cannot open: %s\n", path);
+		return -1;
+	}
+
+	if(win.offset > 0 && log_reader_seek(&reader, win.offset, win.offset_ts) != 0){
+		fprintf(stderr, "cannot seek in %s, it does not match its index\n", path);
+		log_reader_close(&reader);
+		return -1;
+	}
+
+	for(;;){
+		ret = log_reader_next(&reader, &log);
+		if(ret > 0){
+			ret = 0;
+			break;
+		}
+
+		if(ret < 0){
+			fprintf(stderr, "incorrect line format in logfile\n");
+			break;
+		}
+
+		ret = replay_add(plan, &win, &log);
+		if(ret != 0){
+			ret = ret < 0 ? -1 : 0;
+			break;
+		}
+	}
+
+	log_reader_close(&reader);
+
+	if(ret != 0){
+		replay_plan_free(plan);
+		return -1;
+	}
+
+	return 0;
+}
+
+void replay_plan_free(replay_plan *plan){
+	int i;
+
+	for(i = 0; i < plan->num_blocks; i++){
+		free(plan->blocks[i]);
+	}
+	free(plan->blocks);
+
+	memset(plan, '\0', sizeof(replay_plan));
+}
+
+void replay_rewind(replay_cursor *cur){
+	memset(cur, '\0', sizeof(replay_cursor));
+}
+
+// Next frame of the plan, its time (us after the first frame) in cur->time; returns 0 or 1 at the end.
+int replay_next(replay_plan *plan, replay_cursor *cur, int *channel, can_frame *cf){
+	replay_block *b;
+	replay_entry *e;
+
+	for(;;){
+		if(cur->block >= plan->num_blocks){
+			return 1;
+		}
+
+		b = plan->blocks[cur->block];
+		if(cur->pos >= b->used){
+			cur->block++;
+			cur->pos = 0;
+			continue;
+		}
+
+		e = (replay_entry*)(b->data + cur->pos);
+		cur->pos += REPLAY_ALIGN(sizeof(replay_entry) + e->len);
+		cur->time += e->delta;
+
+		if(e->channel != REPLAY_GAP){
+			break;
+		}
+	}
+
+	*channel = e->channel;
+	cf->id = (__i32)e->id;
+	cf->flag = e->flag;
+	cf->dlc = e->dlc;
+	memcpy(cf->msg, e + 1, e->len);
+
+	return 0;
+}
+
+/**
+ * Split plan into one plan per channel (out has MAX_CHANNELS entries).
+ * They keep the time base of plan: a channel's first frame is not at 0
+ * unless it is the first frame of the log. Returns 0 or -1.
+ *
+ */
+int replay_plan_split(replay_plan *plan, replay_plan *out){
+	replay_cursor cur;
+	can_log log;
+	int i;
+
+	for(i = 0; i < MAX_CHANNELS; i++){
+		memset(&out[i], '\0', sizeof(replay_plan));
+		out[i].start_ts = plan->start_ts;
+	}
+
+	replay_rewind(&cur);
+	while(replay_next(plan, &cur, &log.channel, &log.frame) == 0){
+		if(replay_append(&out[log.channel], &log, cur.time) != 0){
+			for(i = 0; i < MAX_CHANNELS; i++){
+				replay_plan_free(&out[i]);
+			}
+			return -1;
+		}
+	}
+
+	return 0;
+}
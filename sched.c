@@ -0,0 +1,96 @@
+#include "lib.h"
+#ifndef _WIN32
+#include <errno.h>
+#endif
+
+/**
+ * Waiting for a deadline on the monotonic clock (get_monotonic_time)
+ *
+ * The thread sleeps until spin us before the deadline and busy-waits the
+ * rest. Sleeping alone is only as precise as the system timer: about
+ * 1 ms on Windows even with a high resolution waitable timer or
+ * timeBeginPeriod(1), 50-100 us with nanosleep on Linux.
+ *
+ */
+#define SCHED_SLICE 100000      // longest sleep between stop_flag checks, us
+
+#ifdef _WIN32
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+#endif
+
+int sched_timer_init(sched_timer *t, uint64_t spin){
+	t->spin = spin;
+	t->timer = NULL;
+
+#ifdef _WIN32
+	// Windows 10 1803 and later, Sleep otherwise
+	t->timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+#endif
+
+	return 0;
+}
+
+void sched_timer_close(sched_timer *t){
+	if(t->timer){
+		CloseHandle(t->timer);
+		t->timer = NULL;
+	}
+}
+
+static void sched_sleep(sched_timer *t, uint64_t us){
+#ifdef _WIN32
+	LARGE_INTEGER due;
+
+	if(t->timer){
+		due.QuadPart = -(LONGLONG)(us * 10);    // relative, 100ns
+		if(SetWaitableTimer(t->timer, &due, 0, NULL, NULL, FALSE)){
+			WaitForSingleObject(t->timer, INFINITE);
+			return;
+		}
+	}
+
+	if(us >= 1000){
+		Sleep((DWORD)(us / 1000));
+	}
+#else
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(us / 1000000);
+	ts.tv_nsec = (long)(us % 1000000) * 1000L;
+	while(nanosleep(&ts, &ts) != 0 && errno == EINTR){
+		;
+	}
+#endif
+}
+
+/**
+ * Wait until the monotonic clock reaches deadline (us), returns the time
+ * when done. Returns earlier when stop_flag is set.
+ *
+ */
+uint64_t sched_wait_until(sched_timer *t, uint64_t deadline){
+	uint64_t now = get_monotonic_time();
+
+	while(now + t->spin < deadline && !stop_flag){
+		sched_sleep(t, deadline - t->spin - now < SCHED_SLICE ? deadline - t->spin - now : SCHED_SLICE);
+		now = get_monotonic_time();
+	}
+
+	while(now < deadline && !stop_flag){
+		YieldProcessor();
+		now = get_monotonic_time();
+	}
+
+	return now;
+}
+
+// Raise the calling thread to real-time priority, returns 0 or -1 (e.g. no privileges).
+int sched_set_realtime(void){
+	if(!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)){
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,445 @@
+#include "lib.h"
+
+/**
+ * Simulated CAN bus, channel spec sim:<bus>{/<options>}
+ *
+ * Channels opened on the same bus name share an in-memory bus. A frame
+ * written on one channel is received by all other channels of the bus
+ * when its transmission ends. The bus sends one frame at a time: when
+ * it goes idle, the lowest arbitration field among the waiting frames
+ * wins and takes can_frame_time at the bus bit rates. Writers block
+ * while the bus queue is full, like on a saturated bus. The sender gets
+ * its frame back flagged canMSG_TXACK.
+ *
+ *  sim:a              bus a at the default bit rates
+ *  sim:a/Fb500Kd2M    bus a, CAN-FD 500K/2M
+ *  sim:a/l40          bus a with synthetic traffic using 40% of the bus
+ *
+ * Bit rates and load are taken from the first channel that names them.
+ * Synthetic frames are 11-bit, 8 bytes, with pseudo random ids and data.
+ * Timestamps are the host monotonic time of the end of the frame.
+ *
+ */
+#define SIM_MAX_BUSES 8
+#define SIM_QUEUE_SIZE 256
+#define SIM_RX_SIZE 4096    // power of 2
+
+typedef struct {
+	can_frame frame;
+	uint64_t time;          // ns, when it was queued
+	uint64_t seq;
+	__u32 key;              // arbitration field, lower wins
+	int sender;             // channel, -1 for synthetic traffic
+} sim_frame;
+
+typedef struct {
+	char name[32];
+	int refs;
+	CRITICAL_SECTION mutex;
+	int bitrate;
+	int data_bitrate;
+	// waiting for the bus
+	sim_frame queue[SIM_QUEUE_SIZE];
+	int num_queued;
+	uint64_t seq;
+	// on the bus
+	int busy;
+	sim_frame current;
+	uint64_t current_end;
+	uint64_t idle_at;
+	// synthetic load
+	int load;
+	uint64_t gen_next;
+	uint32_t rand;
+} sim_bus;
+
+typedef struct {
+	sim_bus *bus;
+	int on;
+	HANDLE event;           // frames received or bus state changed
+	can_log rx[SIM_RX_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	int overrun;
+	__u32 code[2];
+	__u32 mask[2];
+} sim_node;
+
+static sim_bus buses[SIM_MAX_BUSES];
+static sim_node *nodes[MAX_CHANNELS];
+
+static uint64_t sim_now(){
+	return get_monotonic_time() * 1000;
+}
+
+// Bits of the arbitration field: base id, RTR/SRR, IDE, extended id, RTR.
+static __u32 sim_arbitration_key(can_frame *cf){
+	__u32 id = (__u32)cf->id;
+	int rtr = (cf->flag & canMSG_RTR) ? 1 : 0;
+
+	if(cf->flag & canMSG_EXT){
+		return ((id >> 18) & CAN_SFF_MASK) << 21 | 1U << 20 | 1U << 19 | (id & 0x3FFFF) << 1 | rtr;
+	}
+
+	return (id & CAN_SFF_MASK) << 21 | (__u32)rtr << 20;
+}
+
+static uint32_t sim_rand(sim_bus *bus){
+	// xorshift32
+	bus->rand ^= bus->rand << 13;
+	bus->rand ^= bus->rand >> 17;
+	bus->rand ^= bus->rand << 5;
+
+	return bus->rand;
+}
+
+static void sim_enqueue(sim_bus *bus, can_frame *cf, uint64_t time, int sender){
+	sim_frame *f = &bus->queue[bus->num_queued++];
+
+	memcpy(&f->frame, cf, sizeof(can_frame));
+	f->time = time;
+	f->seq = bus->seq++;
+	f->key = sim_arbitration_key(cf);
+	f->sender = sender;
+}
+
+// Queue the synthetic frames due by now.
+static void sim_generate(sim_bus *bus, uint64_t now){
+	can_frame cf;
+	uint32_t r;
+	int i;
+
+	while(bus->load > 0 && bus->gen_next <= now && bus->num_queued < SIM_QUEUE_SIZE){
+		memset(&cf, '\0', sizeof(can_frame));
+		cf.id = 0x100 + sim_rand(bus) % 0x700;
+		cf.flag = canMSG_STD;
+		cf.dlc = 8;
+		for(i = 0; i < 8; i += 4){
+			r = sim_rand(bus);
+			memcpy(&cf.msg[i], &r, 4);
+		}
+
+		sim_enqueue(bus, &cf, bus->gen_next, -1);
+		bus->gen_next += can_frame_time(&cf, bus->bitrate, bus->data_bitrate) * 100 / bus->load;
+	}
+}
+
+static int sim_accept(sim_node *node, can_frame *cf){
+	int ext = (cf->flag & canMSG_EXT) ? 1 : 0;
+
+	return ((__u32)cf->id & node->mask[ext]) == (node->code[ext] & node->mask[ext]);
+}
+
+static void sim_push(sim_node *node, can_frame *cf, uint64_t end, __u32 flag){
+	can_log *log;
+
+	if(node->head - node->tail >= SIM_RX_SIZE){
+		node->overrun = 1;
+		return;
+	}
+
+	log = &node->rx[node->head & (SIM_RX_SIZE - 1)];
+	log->timestamp = end / 1000;
+	memcpy(&log->frame, cf, sizeof(can_frame));
+	log->frame.flag |= flag;
+	if(node->overrun){
+		log->frame.flag |= canMSGERR_SW_OVERRUN;
+		node->overrun = 0;
+	}
+	node->head++;
+
+	SetEvent(node->event);
+}
+
+static void sim_deliver(sim_bus *bus, sim_frame *f, uint64_t end){
+	sim_node *node;
+	int i;
+
+	for(i = 0; i < MAX_CHANNELS; i++){
+		node = nodes[i];
+		if(node == NULL || node->bus != bus || !node->on){
+			continue;
+		}
+
+		if(i == f->sender){
+			sim_push(node, &f->frame, end, canMSG_TXACK);
+		}
+		else if(sim_accept(node, &f->frame)){
+			sim_push(node, &f->frame, end, 0);
+		}
+	}
+}
+
+// Run the bus up to now, call with the bus locked.
+static void sim_advance(sim_bus *bus, uint64_t now){
+	uint64_t start;
+	int i, win;
+
+	for(;;){
+		if(bus->busy){
+			if(bus->current_end > now){
+				return;
+			}
+			sim_deliver(bus, &bus->current, bus->current_end);
+			bus->busy = 0;
+			bus->idle_at = bus->current_end;
+		}
+
+		sim_generate(bus, now);
+		if(bus->num_queued == 0){
+			return;
+		}
+
+		// arbitration starts when the bus is idle and a frame is waiting
+		start = UINT64_MAX;
+		for(i = 0; i < bus->num_queued; i++){
+			if(bus->queue[i].time < start){
+				start = bus->queue[i].time;
+			}
+		}
+		if(start < bus->idle_at){
+			start = bus->idle_at;
+		}
+		if(start > now){
+			return;
+		}
+
+		win = -1;
+		for(i = 0; i < bus->num_queued; i++){
+			if(bus->queue[i].time > start){
+				continue;
+			}
+			if(win < 0 || bus->queue[i].key < bus->queue[win].key
+				|| (bus->queue[i].key == bus->queue[win].key && bus->queue[i].seq < bus->queue[win].seq)){
+				win = i;
+			}
+		}
+
+		memcpy(&bus->current, &bus->queue[win], sizeof(sim_frame));
+		bus->queue[win] = bus->queue[--bus->num_queued];
+		bus->current_end = start + can_frame_time(&bus->current.frame, bus->bitrate, bus->data_bitrate);
+		bus->busy = 1;
+	}
+}
+
+// ns until the bus changes state, 0 if nothing is pending; call with the bus locked.
+static uint64_t sim_next_event(sim_bus *bus, uint64_t now){
+	uint64_t next = 0;
+
+	if(bus->busy){
+		next = bus->current_end;
+	}
+	else if(bus->num_queued > 0){
+		next = bus->idle_at;
+	}
+	if(bus->load > 0 && (next == 0 || bus->gen_next < next)){
+		next = bus->gen_next;
+	}
+
+	return next > now ? next - now : (next ? 1 : 0);
+}
+
+// Wait for the node's event, but not past the next bus event or deadline (ns).
+static void sim_wait(sim_node *node, uint64_t wait, uint64_t deadline, uint64_t now){
+	DWORD ms;
+
+	if(wait == 0 || now + wait > deadline){
+		wait = deadline - now;
+	}
+	ms = (DWORD)((wait + 999999) / 1000000);
+
+	WaitForSingleObject(node->event, ms);
+}
+
+static int sim_open(can_channel *ch){
+	sim_bus *bus = NULL;
+	sim_node *node;
+	int i;
+
+	for(i = 0; i < SIM_MAX_BUSES; i++){
+		if(buses[i].refs > 0 && strcmp(buses[i].name, ch->ifname) == 0){
+			bus = &buses[i];
+			break;
+		}
+	}
+	if(bus == NULL){
+		for(i = 0; i < SIM_MAX_BUSES; i++){
+			if(buses[i].refs == 0){
+				bus = &buses[i];
+				memset(bus, '\0', sizeof(sim_bus));
+				strncpy_s(bus->name, sizeof(bus->name), ch->ifname, _TRUNCATE);
+				InitializeCriticalSection(&bus->mutex);
+				bus->rand = 0x2545F491;
+				break;
+			}
+		}
+	}
+	if(bus == NULL){
+		fprintf(stderr, "Too many simulated buses\n");
+		return -1;
+	}
+
+	node = (sim_node *)calloc(1, sizeof(sim_node));
+	if(node == NULL){
+		return -1;
+	}
+	node->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	node->bus = bus;
+
+	EnterCriticalSection(&bus->mutex);
+	bus->refs++;
+	nodes[ch->channel] = node;
+	LeaveCriticalSection(&bus->mutex);
+
+	return 0;
+}
+
+static int sim_configure(can_channel *ch){
+	sim_bus *bus = nodes[ch->channel]->bus;
+
+	EnterCriticalSection(&bus->mutex);
+	if(bus->bitrate == 0){
+		bus->bitrate = ch->bitrate;
+		bus->data_bitrate = ch->data_bitrate;
+	}
+	if(ch->load > 0 && bus->load == 0){
+		bus->load = ch->load > 100 ? 100 : ch->load;
+		bus->gen_next = sim_now();
+	}
+	LeaveCriticalSection(&bus->mutex);
+
+	return 0;
+}
+
+static int sim_bus_on(can_channel *ch){
+	nodes[ch->channel]->on = 1;
+	return 0;
+}
+
+static int sim_bus_off(can_channel *ch){
+	nodes[ch->channel]->on = 0;
+	return 0;
+}
+
+static void sim_close(can_channel *ch){
+	sim_node *node = nodes[ch->channel];
+	sim_bus *bus = node->bus;
+	int refs;
+
+	EnterCriticalSection(&bus->mutex);
+	nodes[ch->channel] = NULL;
+	refs = --bus->refs;
+	LeaveCriticalSection(&bus->mutex);
+
+	if(refs == 0){
+		DeleteCriticalSection(&bus->mutex);
+	}
+
+	CloseHandle(node->event);
+	free(node);
+}
+
+static int sim_read_batch(can_channel *ch, can_log *logs, int max, DWORD timeout){
+	sim_node *node = nodes[ch->channel];
+	sim_bus *bus = node->bus;
+	uint64_t now, wait, deadline;
+	int n;
+
+	now = sim_now();
+	deadline = now + (uint64_t)timeout * 1000000;
+
+	for(;;){
+		EnterCriticalSection(&bus->mutex);
+		sim_advance(bus, now);
+		for(n = 0; n < max && node->tail != node->head; n++){
+			memcpy(&logs[n], &node->rx[node->tail & (SIM_RX_SIZE - 1)], sizeof(can_log));
+			node->tail++;
+		}
+		wait = sim_next_event(bus, now);
+		LeaveCriticalSection(&bus->mutex);
+
+		if(n > 0 || now >= deadline){
+			return n;
+		}
+
+		sim_wait(node, wait, deadline, now);
+		now = sim_now();
+	}
+}
+
+// Queue what fits into the bus queue, *wait is the time to the next bus event.
+static int sim_queue(can_channel *ch, can_frame *frames, int n, uint64_t now, uint64_t *wait){
+	sim_node *node = nodes[ch->channel];
+	sim_bus *bus = node->bus;
+	int i, sent = 0;
+
+	EnterCriticalSection(&bus->mutex);
+	sim_advance(bus, now);
+	while(sent < n && bus->num_queued < SIM_QUEUE_SIZE){
+		sim_enqueue(bus, &frames[sent++], now, ch->channel);
+	}
+	sim_advance(bus, now);
+	*wait = sim_next_event(bus, now);
+
+	// let readers wait for the new end of the bus
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(i != ch->channel && nodes[i] != NULL && nodes[i]->bus == bus){
+			SetEvent(nodes[i]->event);
+		}
+	}
+	LeaveCriticalSection(&bus->mutex);
+
+	return sent;
+}
+
+static int sim_write_batch(can_channel *ch, can_frame *frames, int n, DWORD timeout){
+	uint64_t now, wait, deadline;
+	int sent = 0;
+
+	now = sim_now();
+	deadline = now + (uint64_t)timeout * 1000000;
+
+	for(;;){
+		sent += sim_queue(ch, &frames[sent], n - sent, now, &wait);
+
+		if(sent == n || now >= deadline){
+			return sent > 0 ? sent : -1;
+		}
+
+		// bus queue full
+		sim_wait(nodes[ch->channel], wait, deadline, now);
+		now = sim_now();
+	}
+}
+
+// Queue without waiting.
+static int sim_send(can_channel *ch, can_frame *frames, int n){
+	uint64_t wait;
+
+	return sim_queue(ch, frames, n, sim_now(), &wait);
+}
+
+static int sim_set_filter(can_channel *ch, __u32 code, __u32 mask, int ext){
+	sim_node *node = nodes[ch->channel];
+
+	EnterCriticalSection(&node->bus->mutex);
+	node->code[ext ? 1 : 0] = code;
+	node->mask[ext ? 1 : 0] = mask;
+	LeaveCriticalSection(&node->bus->mutex);
+
+	return 0;
+}
+
+const can_driver sim_driver = {
+	"sim",
+	sim_open,
+	sim_configure,
+	sim_bus_on,
+	sim_bus_off,
+	sim_read_batch,
+	sim_write_batch,
+	sim_send,
+	NULL,
+	sim_set_filter,
+	sim_close
+};
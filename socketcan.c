@@ -0,0 +1,405 @@
+#define _GNU_SOURCE     // recvmmsg, sendmmsg
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include "lib.h"
+
+/**
+ * SocketCAN driver (Linux), channel spec sock:<interface>
+ *
+ * One CAN_RAW socket per channel. Frames are read with recvmmsg and
+ * written with sendmmsg, a whole batch per system call. Receive
+ * timestamps are the kernel's (SO_TIMESTAMPING), the device clock of
+ * the channel is CLOCK_REALTIME in us. Drops in the socket queue
+ * (SO_RXQ_OVFL) set canMSGERR_SW_OVERRUN on the next frame. The
+ * socket receives its own frames once sent (CAN_RAW_RECV_OWN_MSGS), the
+ * kernel marks them MSG_CONFIRM, they become canMSG_TXACK.
+ *
+ * Bit rates belong to the interface (ip link set can0 type can bitrate
+ * 500000), FD is used when the interface MTU allows it. Works on vcan.
+ *
+ */
+#define SOCKETCAN_BATCH 64
+#define SOCKETCAN_RCVBUF (1024 * 1024)
+#define SOCKETCAN_CTRL_SIZE (CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(__u32)))
+
+typedef struct {
+	struct can_filter filters[2];   // SFF, EFF in kernel encoding
+	__u32 drops;
+} socketcan_state;
+
+static socketcan_state states[MAX_CHANNELS];
+
+static void print_socketcan_error(const char *function, can_channel *ch){
+	fprintf(stderr, "%s failed on %s: %s\n", function, ch->ifname, strerror(errno));
+}
+
+static uint64_t socketcan_realtime(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int socketcan_open(can_channel *ch){
+	struct ifreq ifr;
+	struct sockaddr_can addr;
+
+	ch->sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if(ch->sock < 0){
+		print_socketcan_error("socket", ch);
+		return -1;
+	}
+
+	memset(&ifr, '\0', sizeof(ifr));
+	strncpy_s(ifr.ifr_name, sizeof(ifr.ifr_name), ch->ifname, _TRUNCATE);
+	if(ioctl(ch->sock, SIOCGIFINDEX, &ifr) < 0){
+		fprintf(stderr, "No such CAN interface: %s\n", ch->ifname);
+		close(ch->sock);
+		return -1;
+	}
+
+	// receive nothing until bus on
+	setsockopt(ch->sock, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+
+	memset(&addr, '\0', sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if(bind(ch->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+		print_socketcan_error("bind", ch);
+		close(ch->sock);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int socketcan_configure(can_channel *ch){
+	socketcan_state *st = &states[ch->channel];
+	struct ifreq ifr;
+	int on = 1;
+	int rcvbuf = SOCKETCAN_RCVBUF;
+	int ts_flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+	memset(&ifr, '\0', sizeof(ifr));
+	strncpy_s(ifr.ifr_name, sizeof(ifr.ifr_name), ch->ifname, _TRUNCATE);
+	if(ioctl(ch->sock, SIOCGIFMTU, &ifr) < 0){
+		print_socketcan_error("SIOCGIFMTU", ch);
+		return -1;
+	}
+
+	ch->fd = (ifr.ifr_mtu == CANFD_MTU);
+	if(ch->fd && setsockopt(ch->sock, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &on, sizeof(on)) < 0){
+		print_socketcan_error("CAN_RAW_FD_FRAMES", ch);
+		return -1;
+	}
+
+	if(setsockopt(ch->sock, SOL_SOCKET, SO_TIMESTAMPING, &ts_flags, sizeof(ts_flags)) < 0){
+		// the read time stands in for the kernel timestamp
+		print_socketcan_error("SO_TIMESTAMPING", ch);
+	}
+	setsockopt(ch->sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+	if(setsockopt(ch->sock, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &on, sizeof(on)) < 0){
+		print_socketcan_error("CAN_RAW_RECV_OWN_MSGS", ch);
+		return -1;
+	}
+	setsockopt(ch->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	// pass all
+	st->filters[0].can_id = 0;
+	st->filters[0].can_mask = CAN_EFF_FLAG;
+	st->filters[1].can_id = CAN_EFF_FLAG;
+	st->filters[1].can_mask = CAN_EFF_FLAG;
+	st->drops = 0;
+
+	return 0;
+}
+
+static int socketcan_bus_on(can_channel *ch){
+	socketcan_state *st = &states[ch->channel];
+
+	if(setsockopt(ch->sock, SOL_CAN_RAW, CAN_RAW_FILTER, st->filters, sizeof(st->filters)) < 0){
+		print_socketcan_error("CAN_RAW_FILTER", ch);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int socketcan_bus_off(can_channel *ch){
+	if(setsockopt(ch->sock, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0) < 0){
+		print_socketcan_error("CAN_RAW_FILTER", ch);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void socketcan_close(can_channel *ch){
+	close(ch->sock);
+	ch->sock = -1;
+}
+
+static void socketcan_to_log(can_channel *ch, struct msghdr *msg, struct canfd_frame *frame, unsigned int size, can_log *log){
+	socketcan_state *st = &states[ch->channel];
+	struct cmsghdr *cmsg;
+	struct scm_timestamping *tss;
+	can_frame *cf = &log->frame;
+	__u32 drops;
+	int len;
+
+	log->timestamp = 0;
+	cf->flag = 0;
+
+	for(cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)){
+		if(cmsg->cmsg_level != SOL_SOCKET){
+			continue;
+		}
+		if(cmsg->cmsg_type == SO_TIMESTAMPING){
+			tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+			log->timestamp = (uint64_t)tss->ts[0].tv_sec * 1000000ULL + (uint64_t)tss->ts[0].tv_nsec / 1000;
+		}
+		else if(cmsg->cmsg_type == SO_RXQ_OVFL){
+			memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+			if(drops != st->drops){
+				cf->flag |= canMSGERR_SW_OVERRUN;
+				st->drops = drops;
+			}
+		}
+	}
+	if(log->timestamp == 0){
+		log->timestamp = socketcan_realtime();
+	}
+	if(msg->msg_flags & MSG_CONFIRM){
+		cf->flag |= canMSG_TXACK;
+	}
+
+	if(frame->can_id & CAN_EFF_FLAG){
+		cf->id = frame->can_id & CAN_EFF_MASK;
+		cf->flag |= canMSG_EXT;
+	}else{
+		cf->id = frame->can_id & CAN_SFF_MASK;
+		cf->flag |= canMSG_STD;
+	}
+	if(frame->can_id & CAN_RTR_FLAG){
+		cf->flag |= canMSG_RTR;
+	}
+	if(frame->can_id & CAN_ERR_FLAG){
+		cf->flag |= canMSG_ERROR_FRAME;
+	}
+
+	len = frame->len;
+	if(size == CANFD_MTU){
+		cf->flag |= canFDMSG_FDF;
+		if(frame->flags & CANFD_BRS){
+			cf->flag |= canFDMSG_BRS;
+		}
+		if(frame->flags & CANFD_ESI){
+			cf->flag |= canFDMSG_ESI;
+		}
+		if(len > CANFD_MAX_DLEN){
+			len = CANFD_MAX_DLEN;
+		}
+	}
+	else if(len > CAN_MAX_DLEN){
+		len = CAN_MAX_DLEN;
+	}
+
+	cf->dlc = len;
+	if(!(frame->can_id & CAN_RTR_FLAG)){
+		memcpy(cf->msg, frame->data, len);
+	}
+}
+
+// Everything pending (up to max, at most SOCKETCAN_BATCH) in one recvmmsg, waits for the first frame.
+static int socketcan_read_batch(can_channel *ch, can_log *logs, int max, DWORD timeout){
+	struct mmsghdr msgs[SOCKETCAN_BATCH];
+	struct iovec iovs[SOCKETCAN_BATCH];
+	struct canfd_frame frames[SOCKETCAN_BATCH];
+	char ctrl[SOCKETCAN_BATCH][SOCKETCAN_CTRL_SIZE];
+	struct pollfd pfd;
+	int i, n;
+
+	if(max > SOCKETCAN_BATCH){
+		max = SOCKETCAN_BATCH;
+	}
+
+	memset(msgs, '\0', sizeof(struct mmsghdr) * max);
+	for(i = 0; i < max; i++){
+		iovs[i].iov_base = &frames[i];
+		iovs[i].iov_len = sizeof(struct canfd_frame);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = ctrl[i];
+		msgs[i].msg_hdr.msg_controllen = SOCKETCAN_CTRL_SIZE;
+	}
+
+	n = recvmmsg(ch->sock, msgs, max, MSG_DONTWAIT, NULL);
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+		pfd.fd = ch->sock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if(poll(&pfd, 1, (int)timeout) <= 0){
+			return 0;
+		}
+		n = recvmmsg(ch->sock, msgs, max, MSG_DONTWAIT, NULL);
+	}
+	if(n < 0){
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+			return 0;
+		}
+		print_socketcan_error("recvmmsg", ch);
+		return -1;
+	}
+
+	for(i = 0; i < n; i++){
+		socketcan_to_log(ch, &msgs[i].msg_hdr, &frames[i], msgs[i].msg_len, &logs[i]);
+	}
+
+	return n;
+}
+
+static int socketcan_from_frame(can_frame *cf, struct canfd_frame *frame){
+	int len = (int)cf->dlc;
+
+	memset(frame, '\0', sizeof(struct canfd_frame));
+
+	if(cf->flag & canMSG_EXT){
+		frame->can_id = ((__u32)cf->id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+	}else{
+		frame->can_id = (__u32)cf->id & CAN_SFF_MASK;
+	}
+	if(cf->flag & canMSG_RTR){
+		frame->can_id |= CAN_RTR_FLAG;
+	}
+
+	if(cf->flag & canFDMSG_FDF){
+		if(len > CANFD_MAX_DLEN){
+			len = CANFD_MAX_DLEN;
+		}
+		frame->flags = CANFD_FDF;
+		if(cf->flag & canFDMSG_BRS){
+			frame->flags |= CANFD_BRS;
+		}
+		if(cf->flag & canFDMSG_ESI){
+			frame->flags |= CANFD_ESI;
+		}
+	}
+	else if(len > CAN_MAX_DLEN){
+		len = CAN_MAX_DLEN;
+	}
+
+	frame->len = (__u8)len;
+	memcpy(frame->data, cf->msg, len);
+
+	return (cf->flag & canFDMSG_FDF) ? CANFD_MTU : CAN_MTU;
+}
+
+// The whole batch with as few sendmmsg calls as the socket allows, returns the number sent.
+static int socketcan_write_batch(can_channel *ch, can_frame *cfs, int n, DWORD timeout){
+	struct mmsghdr msgs[SOCKETCAN_BATCH];
+	struct iovec iovs[SOCKETCAN_BATCH];
+	struct canfd_frame frames[SOCKETCAN_BATCH];
+	uint64_t deadline = get_monotonic_time() + (uint64_t)timeout * 1000;
+	int i, m, ret, sent = 0;
+
+	while(sent < n){
+		m = n - sent < SOCKETCAN_BATCH ? n - sent : SOCKETCAN_BATCH;
+
+		memset(msgs, '\0', sizeof(struct mmsghdr) * m);
+		for(i = 0; i < m; i++){
+			iovs[i].iov_base = &frames[i];
+			iovs[i].iov_len = socketcan_from_frame(&cfs[sent + i], &frames[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		ret = sendmmsg(ch->sock, msgs, m, MSG_DONTWAIT);
+		if(ret < 0){
+			if((errno == EAGAIN || errno == ENOBUFS || errno == EINTR) && get_monotonic_time() < deadline){
+				// tx queue full, POLLOUT does not cover ENOBUFS
+				Sleep(1);
+				continue;
+			}
+			print_socketcan_error("sendmmsg", ch);
+			break;
+		}
+		sent += ret;
+	}
+
+	return sent > 0 ? sent : -1;
+}
+
+// One sendmmsg without waiting, returns the number the socket took (0 when its queue is full).
+static int socketcan_send(can_channel *ch, can_frame *cfs, int n){
+	struct mmsghdr msgs[SOCKETCAN_BATCH];
+	struct iovec iovs[SOCKETCAN_BATCH];
+	struct canfd_frame frames[SOCKETCAN_BATCH];
+	int i, ret;
+
+	if(n > SOCKETCAN_BATCH){
+		n = SOCKETCAN_BATCH;
+	}
+
+	memset(msgs, '\0', sizeof(struct mmsghdr) * n);
+	for(i = 0; i < n; i++){
+		iovs[i].iov_base = &frames[i];
+		iovs[i].iov_len = socketcan_from_frame(&cfs[i], &frames[i]);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = sendmmsg(ch->sock, msgs, n, MSG_DONTWAIT);
+	if(ret < 0){
+		if(errno == EAGAIN || errno == ENOBUFS || errno == EINTR){
+			return 0;
+		}
+		print_socketcan_error("sendmmsg", ch);
+		return -1;
+	}
+
+	return ret;
+}
+
+static int socketcan_set_filter(can_channel *ch, __u32 code, __u32 mask, int ext){
+	socketcan_state *st = &states[ch->channel];
+
+	if(ext){
+		st->filters[1].can_id = (code & CAN_EFF_MASK) | CAN_EFF_FLAG;
+		st->filters[1].can_mask = (mask & CAN_EFF_MASK) | CAN_EFF_FLAG;
+	}else{
+		st->filters[0].can_id = code & CAN_SFF_MASK;
+		st->filters[0].can_mask = (mask & CAN_SFF_MASK) | CAN_EFF_FLAG;
+	}
+
+	// takes effect now when the bus is on
+	return ch->state ? socketcan_bus_on(ch) : 0;
+}
+
+static int socketcan_read_timer(can_channel *ch, uint64_t *time){
+	*time = socketcan_realtime();
+
+	return 0;
+}
+
+const can_driver socketcan_driver = {
+	"sock",
+	socketcan_open,
+	socketcan_configure,
+	socketcan_bus_on,
+	socketcan_bus_off,
+	socketcan_read_batch,
+	socketcan_write_batch,
+	socketcan_send,
+	socketcan_read_timer,
+	socketcan_set_filter,
+	socketcan_close
+};
@@ -0,0 +1,393 @@
+#include "lib.h"
+
+/**
+ * Live per-ID statistics
+ *
+ * Frames come from candump's channel threads and are aggregated in place:
+ * a direct table for 11-bit ids and an open-addressing table for 29-bit
+ * ids per channel. Period and jitter are moving averages over the
+ * hardware timestamps (1/8 weight for a new sample).
+ *
+ * The screen is redrawn in place every -r ms with VT escape sequences.
+ *
+ */
+#define STAT_REFRESH_DEFAULT 500
+#define STAT_EFF_INITIAL 256
+#define STAT_BATCH 256
+#define STAT_SCREEN_SIZE (256 * 1024)
+
+#ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+#endif
+
+void print_usage_canstat(char *arg0, char *arg1)
+{
+	char prg[_MAX_FNAME];
+	char *cmd;
+
+	basename(arg0, prg, sizeof(prg));
+	cmd = arg1;
+
+	fprintf(stderr, "%s %s - show live per-ID statistics with Kvaser driver.\n\n", prg, cmd);
+	fprintf(stderr, "Usage: %s %s [options] <channel> [<channel> ...]\n", prg, cmd);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -r <ms>                        (refresh interval - default 500ms)\n");
+	fprintf(stderr, "  -n                             (no redraw, print a new table every interval)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Format of <channel>: <channel-num>{f|F}{_}{b|B<bitrate>}{d|D<data-bitrate>}{,<filter>}\n");
+	fprintf(stderr, "  see '%s dump help' for channels and filters\n", prg);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Columns:\n");
+	fprintf(stderr, "  RATE    frames per second over the last interval\n");
+	fprintf(stderr, "  PERIOD  average time between frames\n");
+	fprintf(stderr, "  JITTER  average deviation from PERIOD\n");
+	fprintf(stderr, "  LOAD    bus load from the exact bit time of each frame, stuff bits included\n");
+}
+
+stat_table stat_tables[MAX_CHANNELS];
+
+static int stat_table_init(stat_table *t){
+	__u32 i;
+
+	memset(t, '\0', sizeof(stat_table));
+
+	t->sff = (id_stat*)calloc(CAN_SFF_MASK + 1, sizeof(id_stat));
+	t->eff = (id_stat*)malloc(sizeof(id_stat) * STAT_EFF_INITIAL);
+	if(t->sff == NULL || t->eff == NULL){
+		return -1;
+	}
+	memset(t->eff, 0xFF, sizeof(id_stat) * STAT_EFF_INITIAL);
+	t->eff_mask = STAT_EFF_INITIAL - 1;
+
+	for(i = 0; i <= CAN_SFF_MASK; i++){
+		t->sff[i].id = i;
+	}
+
+	return 0;
+}
+
+static void stat_table_destroy(stat_table *t){
+	free(t->sff);
+	free(t->eff);
+	t->sff = NULL;
+	t->eff = NULL;
+}
+
+static unsigned int stat_hash(__u32 id){
+	return (id * 0x9E3779B1U) >> 7;
+}
+
+static id_stat *stat_eff_slot(id_stat *table, unsigned int mask, __u32 id){
+	unsigned int h = stat_hash(id) & mask;
+
+	while(table[h].id != STAT_EMPTY && table[h].id != id){
+		h = (h + 1) & mask;
+	}
+
+	return &table[h];
+}
+
+// double the EFF table once it is half full
+static int stat_eff_grow(stat_table *t){
+	id_stat *table, *slot;
+	unsigned int i, mask = t->eff_mask * 2 + 1;
+
+	table = (id_stat*)malloc(sizeof(id_stat) * (mask + 1));
+	if(table == NULL){
+		return -1;
+	}
+	memset(table, 0xFF, sizeof(id_stat) * (mask + 1));
+
+	for(i = 0; i <= t->eff_mask; i++){
+		if(t->eff[i].id != STAT_EMPTY){
+			slot = stat_eff_slot(table, mask, t->eff[i].id);
+			memcpy(slot, &t->eff[i], sizeof(id_stat));
+		}
+	}
+
+	free(t->eff);
+	t->eff = table;
+	t->eff_mask = mask;
+
+	return 0;
+}
+
+static id_stat *stat_lookup(stat_table *t, can_frame *cf){
+	id_stat *s;
+	__u32 id;
+
+	if(!(cf->flag & canMSG_EXT)){
+		return &t->sff[cf->id & CAN_SFF_MASK];
+	}
+
+	id = (__u32)cf->id & CAN_EFF_MASK;
+	s = stat_eff_slot(t->eff, t->eff_mask, id);
+	if(s->id == STAT_EMPTY){
+		if((t->eff_used + 1) * 2 > t->eff_mask + 1){
+			if(stat_eff_grow(t) != 0){
+				return NULL;
+			}
+			s = stat_eff_slot(t->eff, t->eff_mask, id);
+		}
+		memset(s, '\0', sizeof(id_stat));
+		s->id = id;
+		t->eff_used++;
+	}
+
+	return s;
+}
+
+static void stat_frame(stat_table *t, can_channel *ch, can_log *log){
+	id_stat *s;
+	int64_t delta, dev;
+
+	s = stat_lookup(t, &log->frame);
+	if(s == NULL){
+		return;
+	}
+
+	if(s->count > 0){
+		delta = (int64_t)(log->timestamp - s->last_ts);
+		if(s->count == 1){
+			s->period = (uint32_t)delta;
+		}
+		else{
+			dev = delta - (int64_t)s->period;
+			s->period = (uint32_t)((int64_t)s->period + dev / 8);
+			dev = dev < 0 ? -dev : dev;
+			s->jitter = (uint32_t)((int64_t)s->jitter + (dev - (int64_t)s->jitter) / 8);
+		}
+	}
+
+	s->count++;
+	s->last_ts = log->timestamp;
+	s->flag = log->frame.flag;
+	s->dlc = (__u8)log->frame.dlc;
+	memcpy(s->data, log->frame.msg, sizeof(s->data));
+
+	t->bus_time += can_frame_time(&log->frame, ch->bitrate, ch->data_bitrate);
+	t->frames++;
+}
+
+static int stat_print_row(char *buf, size_t size, int channel, id_stat *s, int ext, uint64_t interval){
+	char data[3 * 8 + 1];
+	int i, n, len;
+
+	len = s->dlc < 8 ? s->dlc : 8;
+	if(s->flag & canMSG_RTR){
+		len = 0;
+	}
+
+	n = 0;
+	for(i = 0; i < len; i++){
+		n += snprintf(&data[n], sizeof(data) - n, "%02X ", s->data[i]);
+	}
+	data[n] = '\0';
+
+	return snprintf(buf, size, "%3d  %*s%0*X  %10llu %9.1f %10.3f %10.3f  %3u  %s%s\x1b[K\n",
+		channel,
+		ext ? 0 : 5, "",
+		ext ? 8 : 3, s->id,
+		(unsigned long long)s->count,
+		(double)(s->count - s->last_count) * 1000000.0 / interval,
+		s->period / 1000.0,
+		s->jitter / 1000.0,
+		s->dlc,
+		data,
+		s->dlc > 8 && !(s->flag & canMSG_RTR) ? "..." : "");
+}
+
+static int stat_cmp_id(const void *a, const void *b){
+	__u32 x = (*(id_stat**)a)->id, y = (*(id_stat**)b)->id;
+
+	return x < y ? -1 : (x > y);
+}
+
+static void stat_draw(char *screen, int redraw, uint64_t interval){
+	int i, n, k, num;
+	__u32 id;
+	stat_table *t;
+	id_stat **eff;
+
+	n = 0;
+	if(redraw){
+		n += snprintf(&screen[n], STAT_SCREEN_SIZE - n, "\x1b[H");
+	}
+
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(!channels[i].state){
+			continue;
+		}
+		t = &stat_tables[i];
+		n += snprintf(&screen[n], STAT_SCREEN_SIZE - n, "channel %d: %.0f frames/s, load %.1f%%\x1b[K\n",
+			i,
+			(double)t->frames * 1000000.0 / interval,
+			(double)t->bus_time / 10.0 / interval);
+		t->frames = 0;
+		t->bus_time = 0;
+	}
+
+	n += snprintf(&screen[n], STAT_SCREEN_SIZE - n,
+		"\x1b[K\n CH        ID       COUNT    RATE/s  PERIOD ms  JITTER ms  DLC  DATA\x1b[K\n");
+
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(!channels[i].state){
+			continue;
+		}
+		t = &stat_tables[i];
+
+		for(id = 0; id <= CAN_SFF_MASK; id++){
+			if(t->sff[id].count == 0){
+				continue;
+			}
+			if(n < STAT_SCREEN_SIZE - LOG_LINE_MAX){
+				n += stat_print_row(&screen[n], STAT_SCREEN_SIZE - n, i, &t->sff[id], 0, interval);
+			}
+			t->sff[id].last_count = t->sff[id].count;
+		}
+
+		// 29-bit ids in order of id
+		eff = (id_stat**)malloc(sizeof(id_stat*) * (t->eff_used + 1));
+		if(eff == NULL){
+			continue;
+		}
+		num = 0;
+		for(k = 0; k <= (int)t->eff_mask; k++){
+			if(t->eff[k].id != STAT_EMPTY){
+				eff[num++] = &t->eff[k];
+			}
+		}
+		qsort(eff, num, sizeof(id_stat*), stat_cmp_id);
+
+		for(k = 0; k < num; k++){
+			if(n < STAT_SCREEN_SIZE - LOG_LINE_MAX){
+				n += stat_print_row(&screen[n], STAT_SCREEN_SIZE - n, i, eff[k], 1, interval);
+			}
+			eff[k]->last_count = eff[k]->count;
+		}
+		free(eff);
+	}
+
+	if(redraw){
+		n += snprintf(&screen[n], STAT_SCREEN_SIZE - n, "\x1b[J");
+	}else{
+		n += snprintf(&screen[n], STAT_SCREEN_SIZE - n, "\n");
+	}
+
+	fwrite(screen, 1, n, stdout);
+	fflush(stdout);
+}
+
+int canstat(int argc, char *argv[]){
+	int i, j, n, refresh, redraw;
+	char *screen;
+	can_log logs[STAT_BATCH];
+	uint64_t now, last_draw;
+	HANDLE console;
+	DWORD mode;
+
+	if(argc <= 2){
+		print_usage_canstat(argv[0], argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	refresh = STAT_REFRESH_DEFAULT;
+	redraw = 1;
+
+	kv_initialize();
+
+	for(i = 2; i < argc; i++){
+		if(strcmp(argv[i], "-r") == 0){
+			if(i + 1 >= argc){
+				fprintf(stderr, "Error: Missing interval value after %s\n\n", argv[i]);
+				print_usage_canstat(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			refresh = atoi(argv[i]);
+
+			if (refresh <= 0) {
+				fprintf(stderr, "Invalid interval value: %s\n\n", argv[i]);
+				print_usage_canstat(argv[0], argv[1]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "-n") == 0){
+			redraw = 0;
+		}
+		else if(strcmp(argv[i], "help") == 0){
+			print_usage_canstat(argv[0], argv[1]);
+			return EXIT_FAILURE;
+		}
+		else{
+			if(capture_add_channel(argv[i]) != 0){
+				print_usage_canstat(argv[0], argv[1]);
+				kv_cleanup_channels();
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	screen = (char*)malloc(STAT_SCREEN_SIZE);
+	if(screen == NULL){
+		kv_cleanup_channels();
+		return EXIT_FAILURE;
+	}
+
+	for(i = 0; i < MAX_CHANNELS; i++){
+		if(channels[i].state && stat_table_init(&stat_tables[i]) != 0){
+			fprintf(stderr, "Failed to allocate statistics\n");
+			goto err;
+		}
+	}
+
+	if(capture_init() != 0){
+		goto err;
+	}
+
+	if(redraw){
+		// VT sequences for the in-place redraw
+		console = GetStdHandle(STD_OUTPUT_HANDLE);
+		if(GetConsoleMode(console, &mode)){
+			SetConsoleMode(console, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+		}
+		printf("\x1b[2J");
+	}
+
+	if(capture_start() != 0){
+		stop_flag = 1;
+		goto err;
+	}
+
+	last_draw = get_monotonic_time();
+	while(!stop_flag){
+		n = capture_read(logs, STAT_BATCH, 50);
+		for(j = 0; j < n; j++){
+			stat_frame(&stat_tables[logs[j].channel], &channels[logs[j].channel], &logs[j]);
+		}
+
+		now = get_monotonic_time();
+		if(now - last_draw >= (uint64_t)refresh * 1000){
+			stat_draw(screen, redraw, now - last_draw);
+			last_draw = now;
+		}
+	}
+
+	capture_stop();
+	for(i = 0; i < MAX_CHANNELS; i++){
+		stat_table_destroy(&stat_tables[i]);
+	}
+	free(screen);
+
+	return EXIT_SUCCESS;
+
+err:
+	capture_stop();
+	for(i = 0; i < MAX_CHANNELS; i++){
+		stat_table_destroy(&stat_tables[i]);
+	}
+	free(screen);
+
+	return EXIT_FAILURE;
+}
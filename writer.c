@@ -0,0 +1,465 @@
+#include "lib.h"
+
+/**
+ * Log file writer
+ *
+ * The output thread formats frames into fixed-size chunks and hands
+ * full chunks to a dedicated writer thread, which compresses them
+ * (zstd, when built with HAVE_ZSTD) and writes them to rotating files.
+ *
+ * Files are only rotated between chunks. Binary timestamp deltas run on
+ * across chunks, the first record of a new file is re-encoded against
+ * zero so each file is readable on its own.
+ *
+ *  <path>            no rotation
+ *  <path>.0000       rotation by size (-s) or period (-p)
+ *  ....zst           compressed, one zstd frame per file
+ *  ....idx           time index of the file (-i, index.c)
+ *
+ * The output thread decides where index entries go and notes them in the
+ * chunk, the writer thread turns them into file offsets. Every file's
+ * index starts with an entry for its first frame.
+ *
+ * A failed write (disk full, I/O error) stops the capture: the file ends
+ * there and the frames of the chunks still coming count as dropped.
+ *
+ */
+
+static writer_chunk *writer_get_free(log_writer *w){
+	writer_chunk *chunk;
+
+	EnterCriticalSection(&w->mutex);
+	while(w->num_free == 0){
+		SleepConditionVariableCS(&w->not_full, &w->mutex, INFINITE);
+	}
+	chunk = w->free[--w->num_free];
+	LeaveCriticalSection(&w->mutex);
+
+	chunk->len = 0;
+	chunk->flush = 0;
+	chunk->num_marks = 0;
+	memset(chunk->frames, '\0', sizeof(chunk->frames));
+
+	return chunk;
+}
+
+static void writer_submit(log_writer *w, writer_chunk *chunk){
+	EnterCriticalSection(&w->mutex);
+	w->full[(w->full_head + w->num_full) % WRITER_CHUNKS] = chunk;
+	w->num_full++;
+	LeaveCriticalSection(&w->mutex);
+
+	WakeConditionVariable(&w->not_empty);
+}
+
+static int writer_put(log_writer *w, const char *data, size_t len, int mode);
+
+static int writer_open_file(log_writer *w){
+	char path[_MAX_PATH + 16];
+	char header[BINLOG_HEADER_SIZE];
+	int n;
+
+	if(w->rotate_size || w->rotate_period){
+		n = snprintf(path, sizeof(path), "%s.%04d", w->path, w->file_index++);
+	}else{
+		n = snprintf(path, sizeof(path), "%s", w->path);
+	}
+	if(w->compress){
+		snprintf(path + n, sizeof(path) - n, ".zst");
+	}
+
+	if(fopen_s(&w->fp, path, "wb") != 0){
+		fprintf(stderr, "cannot open: %s\n", path);
+		w->fp = NULL;
+		return -1;
+	}
+
+	strncpy_s(w->file_path, sizeof(w->file_path), path, _TRUNCATE);
+	snprintf(path + strlen(path), sizeof(path) - strlen(path), "%s", INDEX_SUFFIX);
+
+	if(!w->index){
+		// an index of an earlier capture to this path would not match
+		remove(path);
+	}
+	else{
+		// the log's size and time go into the header once the file is complete
+		if(fopen_s(&w->index_fp, path, "wb") != 0 || index_write_header(w->index_fp, INDEX_FRAMES_DEFAULT, INDEX_PERIOD_DEFAULT, 0, 0) != 0){
+			fprintf(stderr, "cannot open: %s\n", path);
+			if(w->index_fp){
+				fclose(w->index_fp);
+				w->index_fp = NULL;
+			}
+		}
+	}
+
+	w->file_bytes = 0;
+	if(w->rotate_period){
+		// align to wall clock, e.g. full hours for -p 3600
+		w->next_rotate = (get_unix_time() / w->rotate_period + 1) * w->rotate_period;
+	}
+
+	if(w->binary){
+		binlog_get_header((__u8*)header);
+		return writer_put(w, header, BINLOG_HEADER_SIZE, WRITER_MODE_CONTINUE);
+	}
+
+	return 0;
+}
+
+// Compress and write data, returns 0 or -1.
+static int writer_put(log_writer *w, const char *data, size_t len, int mode){
+#ifdef HAVE_ZSTD
+	ZSTD_inBuffer in = {data, len, 0};
+	ZSTD_outBuffer out;
+	size_t remaining;
+
+	if(w->compress){
+		do {
+			out.dst = w->zbuf;
+			out.size = w->zsize;
+			out.pos = 0;
+			remaining = ZSTD_compressStream2(w->cctx, &out, &in, (ZSTD_EndDirective)mode);
+			if(ZSTD_isError(remaining)){
+				fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(remaining));
+				return -1;
+			}
+			if(fwrite(w->zbuf, 1, out.pos, w->fp) != out.pos){
+				return -1;
+			}
+			w->file_bytes += out.pos;
+		} while(mode == WRITER_MODE_CONTINUE ? in.pos < in.size : remaining != 0);
+		return 0;
+	}
+#endif
+
+	if(fwrite(data, 1, len, w->fp) != len){
+		return -1;
+	}
+	w->file_bytes += len;
+
+	return 0;
+}
+
+// Close the current file, returns 0 or -1 when its last data did not make it to disk.
+static int writer_close_file(log_writer *w){
+	uint64_t size, mtime;
+	int ret = 0;
+
+	if(w->fp == NULL){
+		return 0;
+	}
+
+#ifdef HAVE_ZSTD
+	if(w->compress && !w->failed){
+		ret = writer_put(w, NULL, 0, WRITER_MODE_END);
+	}
+#endif
+
+	if(fclose(w->fp) != 0){
+		ret = -1;
+	}
+	w->fp = NULL;
+
+	if(w->index_fp){
+		if(index_log_stamp(w->file_path, &size, &mtime) == 0 && fseek(w->index_fp, 0, SEEK_SET) == 0){
+			index_write_header(w->index_fp, INDEX_FRAMES_DEFAULT, INDEX_PERIOD_DEFAULT, size, mtime);
+		}
+		fclose(w->index_fp);
+		w->index_fp = NULL;
+	}
+
+	return ret;
+}
+
+// Re-encode the first record of chunk relative to zero, returns the size it had.
+static size_t writer_rebase(writer_chunk *chunk, __u8 *buf, int *len){
+	can_log log;
+	uint64_t ts = chunk->base_ts;
+	size_t first = 1 + (__u8)chunk->data[0];
+
+	binlog_decode((__u8*)chunk->data + 1, (int)first - 1, &log, &ts);
+
+	ts = 0;
+	*len = binlog_encode(buf, &log, &ts);
+
+	return first;
+}
+
+// Index entries of chunk, written from start in the file; a rebased first record took rebased instead of skip bytes.
+static void writer_write_marks(log_writer *w, writer_chunk *chunk, uint64_t start, size_t skip, int rebased, int rotated){
+	index_entry e;
+	int i, k;
+
+	if(w->index_fp == NULL || chunk->len == 0){
+		return;
+	}
+
+	if(rotated){
+		memcpy(w->index_base, chunk->counts, sizeof(w->index_base));
+
+		if(chunk->num_marks == 0 || chunk->marks[0].offset != 0){
+			memset(&e, '\0', sizeof(e));
+			e.timestamp = chunk->first_ts;
+			e.offset = start;
+			index_write_entry(w->index_fp, &e);
+		}
+	}
+
+	for(i = 0; i < chunk->num_marks; i++){
+		memcpy(&e, &chunk->marks[i], sizeof(e));
+
+		if(skip > 0 && e.offset == 0){
+			e.base_ts = 0;
+		}
+		e.offset = skip > 0 && e.offset > 0 ? start + rebased + (e.offset - skip) : start + e.offset;
+
+		for(k = 0; k < MAX_CHANNELS; k++){
+			e.counts[k] -= w->index_base[k];
+		}
+
+		index_write_entry(w->index_fp, &e);
+	}
+
+	if(chunk->flush){
+		fflush(w->index_fp);
+	}
+}
+
+// Write chunk to the current file, rotating first when due; returns 0 or -1.
+static int writer_write_chunk(log_writer *w, writer_chunk *chunk){
+	__u8 buf[BINLOG_RECORD_MAX];
+	size_t skip = 0;
+	uint64_t start;
+	int rotate, len = 0;
+
+	rotate = (w->fp == NULL)
+		|| (w->rotate_size && w->file_bytes >= w->rotate_size)
+		|| (w->rotate_period && get_unix_time() >= w->next_rotate);
+
+	if(rotate){
+		if(writer_close_file(w) != 0){
+			fprintf(stderr, "cannot write: %s\n", w->file_path);
+		}
+		if(writer_open_file(w) != 0){
+			return -1;
+		}
+	}
+
+	start = w->file_bytes;
+
+	if(rotate && w->binary && chunk->len > 0){
+		skip = writer_rebase(chunk, buf, &len);
+		if(writer_put(w, (char*)buf, len, WRITER_MODE_CONTINUE) != 0){
+			fprintf(stderr, "cannot write: %s\n", w->file_path);
+			return -1;
+		}
+	}
+
+	if(writer_put(w, chunk->data + skip, chunk->len - skip, chunk->flush ? WRITER_MODE_FLUSH : WRITER_MODE_CONTINUE) != 0
+		|| (chunk->flush && fflush(w->fp) != 0)){
+		fprintf(stderr, "cannot write: %s\n", w->file_path);
+		return -1;
+	}
+
+	writer_write_marks(w, chunk, start, skip, len, rotate);
+
+	return 0;
+}
+
+DWORD WINAPI writer_thread(LPVOID param) {
+	log_writer *w = (log_writer *)param;
+	writer_chunk *chunk;
+	int i;
+
+	for(;;){
+		EnterCriticalSection(&w->mutex);
+		while(w->num_full == 0 && !w->done){
+			SleepConditionVariableCS(&w->not_empty, &w->mutex, INFINITE);
+		}
+		if(w->num_full == 0 && w->done){
+			LeaveCriticalSection(&w->mutex);
+			break;
+		}
+		chunk = w->full[w->full_head];
+		w->full_head = (w->full_head + 1) % WRITER_CHUNKS;
+		w->num_full--;
+		LeaveCriticalSection(&w->mutex);
+
+		if(!w->failed && writer_write_chunk(w, chunk) != 0){
+			// a file with a hole is worse than a short one
+			fprintf(stderr, "stopping the capture, the frames still queued are dropped\n");
+			w->failed = 1;
+			stop_flag = 1;
+		}
+		if(w->failed){
+			for(i = 0; i < MAX_CHANNELS; i++){
+				w->dropped[i] += chunk->frames[i];
+			}
+		}
+
+		EnterCriticalSection(&w->mutex);
+		w->free[w->num_free++] = chunk;
+		LeaveCriticalSection(&w->mutex);
+		WakeConditionVariable(&w->not_full);
+	}
+
+	if(writer_close_file(w) != 0){
+		fprintf(stderr, "cannot write: %s\n", w->file_path);
+	}
+
+	return 0;
+}
+
+int writer_open(log_writer *w, const char *path, int binary, int compress, uint64_t rotate_size, uint64_t rotate_period, int index){
+	int i;
+
+	memset(w, '\0', sizeof(log_writer));
+
+#ifndef HAVE_ZSTD
+	if(compress){
+		fprintf(stderr, "compression is not available in this build\n");
+		return -1;
+	}
+#endif
+
+	strncpy_s(w->path, sizeof(w->path), path, _TRUNCATE);
+	w->binary = binary;
+	w->compress = compress;
+	w->rotate_size = rotate_size;
+	w->rotate_period = rotate_period;
+	w->index = index;
+	index_init(&w->marker, INDEX_FRAMES_DEFAULT, INDEX_PERIOD_DEFAULT);
+
+	for(i = 0; i < WRITER_CHUNKS; i++){
+		w->chunks[i].data = (char*)malloc(WRITER_CHUNK_SIZE);
+		if(w->chunks[i].data == NULL){
+			return -1;
+		}
+		if(index){
+			w->chunks[i].marks = (index_entry*)malloc(sizeof(index_entry) * WRITER_MARKS);
+			if(w->chunks[i].marks == NULL){
+				return -1;
+			}
+		}
+		w->free[w->num_free++] = &w->chunks[i];
+	}
+
+#ifdef HAVE_ZSTD
+	if(compress){
+		w->cctx = ZSTD_createCCtx();
+		w->zsize = ZSTD_CStreamOutSize();
+		w->zbuf = (char*)malloc(w->zsize);
+		if(w->cctx == NULL || w->zbuf == NULL){
+			return -1;
+		}
+		ZSTD_CCtx_setParameter(w->cctx, ZSTD_c_compressionLevel, WRITER_ZSTD_LEVEL);
+	}
+#endif
+
+	InitializeCriticalSection(&w->mutex);
+	InitializeConditionVariable(&w->not_empty);
+	InitializeConditionVariable(&w->not_full);
+
+	// open the first file up front so a bad path fails early
+	if(writer_open_file(w) != 0){
+		return -1;
+	}
+
+	w->current = writer_get_free(w);
+
+	w->thread = CreateThread(NULL, 0, writer_thread, w, 0, NULL);
+	if(w->thread == NULL){
+		fprintf(stderr, "Failed to create writer thread\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Append one frame to the current chunk, called from the output thread only.
+void writer_write_log(log_writer *w, can_log *log, int verbose){
+	writer_chunk *chunk = w->current;
+	size_t need = w->binary ? BINLOG_RECORD_MAX : LOG_LINE_MAX;
+	index_entry e;
+
+	if(chunk->len + need > WRITER_CHUNK_SIZE){
+		writer_submit(w, chunk);
+		chunk = w->current = writer_get_free(w);
+	}
+
+	if(w->index){
+		if(chunk->len == 0){
+			chunk->first_ts = log->timestamp;
+			memcpy(chunk->counts, w->marker.counts, sizeof(chunk->counts));
+		}
+		// an entry that does not fit is dropped, the next one comes with the interval
+		if(index_next(&w->marker, log, &e) && chunk->num_marks < WRITER_MARKS){
+			e.offset = chunk->len;
+			e.base_ts = w->binary ? w->last_ts : 0;
+			memcpy(&chunk->marks[chunk->num_marks++], &e, sizeof(e));
+		}
+	}
+
+	chunk->frames[log->channel]++;
+
+	if(w->binary){
+		if(chunk->len == 0){
+			chunk->base_ts = w->last_ts;
+		}
+		chunk->len += binlog_encode((__u8*)chunk->data + chunk->len, log, &w->last_ts);
+	}else{
+		chunk->len += sprint_log(chunk->data + chunk->len, log, verbose);
+	}
+}
+
+// Hand a partially filled chunk to the writer and have it flushed to disk.
+void writer_flush(log_writer *w){
+	if(w->current->len == 0){
+		return;
+	}
+
+	w->current->flush = 1;
+	writer_submit(w, w->current);
+	w->current = writer_get_free(w);
+}
+
+void writer_close(log_writer *w){
+	int i;
+
+	if(w->thread){
+		if(w->current && w->current->len > 0){
+			writer_submit(w, w->current);
+			w->current = NULL;
+		}
+
+		EnterCriticalSection(&w->mutex);
+		w->done = 1;
+		LeaveCriticalSection(&w->mutex);
+		WakeConditionVariable(&w->not_empty);
+
+		WaitForSingleObject(w->thread, INFINITE);
+		CloseHandle(w->thread);
+		w->thread = NULL;
+
+		DeleteCriticalSection(&w->mutex);
+	}
+	else{
+		writer_close_file(w);
+	}
+
+	for(i = 0; i < WRITER_CHUNKS; i++){
+		free(w->chunks[i].data);
+		w->chunks[i].data = NULL;
+		free(w->chunks[i].marks);
+		w->chunks[i].marks = NULL;
+	}
+
+#ifdef HAVE_ZSTD
+	if(w->cctx){
+		ZSTD_freeCCtx(w->cctx);
+		w->cctx = NULL;
+	}
+	free(w->zbuf);
+	w->zbuf = NULL;
+#endif
+}